@@ -0,0 +1,409 @@
+#include "benchmark.h"
+#include "verify.h"
+
+/*
+Throughput benchmark for huffman::Encoder and huffman::Decoder. It works on the library alone, no file I/O or hashing is timed.
+
+Every corpus is run once per chunk size. Each phase is repeated for the given number of iterations and the fastest run is kept:
+	histogram	huffman::Histogram::add() over the whole input
+	tree		building the canonical codes from the histogram, reported per build
+	encode		huffman::Encoder::encode() over the whole input
+	decode		building a huffman::Decoder from the code lengths and decoding everything encode() produced
+
+With --streams every chunk is encoded and decoded as a block of interleaved streams instead. With --compact the decode phase
+uses huffman::CompactDecoder, which decodes the whole stream or every block in one call.
+
+With --verify nothing is timed. Every encoder and decoder is checked against a reference instead, on intact and corrupt data and
+on random code tables, see verify.h. The generated corpora are smaller by default, as the reference codes a bit at a time.
+
+Commands:
+			Corpus files, e.g. the Silesia files or enwik8
+-c, --chunk-sizes   Sizes the input is handed to the coder in, e.g. 8K 64K 1M
+-i, --iterations    Runs of each phase, the fastest is reported
+-s, --streams       Interleaved streams per chunk, 1 for a single stream
+--size              Size of the generated corpora
+--no-synthetic      Only run the files given on the command line
+--compact           Decode with huffman::CompactDecoder
+--verify            Check the fast paths against the reference instead of timing them
+--csv               Print comma separated values instead of a table
+
+*/
+
+namespace
+{
+    // Tree builds take microseconds, so each timed run builds this many trees.
+    constexpr unsigned int TREE_REPEATS = 100;
+
+    // Size of the generated corpora for --verify, unless --size is given.
+    constexpr size_t VERIFY_SIZE = 1024 * 1024;
+
+    // Random code tables checked by --verify.
+    constexpr unsigned int VERIFY_TABLES = 3000;
+
+    // Runs phase repeats times and keeps the result if it's the fastest so far. A PhaseTime of 0 hasn't been timed yet.
+    template <typename Phase>
+    void timePhase(PhaseTime& best, unsigned int repeats, Phase phase)
+    {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t startCycles = readCycles();
+
+        for (unsigned int i = 0; i < repeats; i++)
+            phase();
+
+        uint64_t cycles = (readCycles() - startCycles) / repeats;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / repeats;
+
+        if (best.seconds == 0 || seconds < best.seconds)
+        {
+            best.seconds = seconds;
+            best.cycles = cycles;
+        }
+    }
+
+    double megabytesPerSecond(size_t size, const PhaseTime& time)
+    {
+        return time.seconds > 0 ? size / time.seconds / 1e6 : 0;
+    }
+
+    double cyclesPerByte(size_t size, const PhaseTime& time)
+    {
+        return size > 0 ? static_cast<double>(time.cycles) / size : 0;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    CLI::App app{ "Huffman encode/decode throughput benchmark" };
+
+    BenchOptions options;
+
+    // Corpus files: Silesia, enwik8 or anything else worth measuring.
+    app.add_option("files", options.files, "Optional. Files to benchmark, e.g. the Silesia corpus or enwik8")->check(CLI::ExistingFile);
+
+    // Chunk sizes: -c, --chunk-sizes   The sizes the input is passed to the coder in.
+    app.add_option("-c, --chunk-sizes", options.chunkSizes, "Optional. Sizes the input is handed to the coder in, e.g. 8K 64K 1M")->transform(CLI::AsSizeValue(false));
+
+    // Iterations: -i, --iterations     Each phase is run this many times and the fastest run is kept.
+    app.add_option("-i, --iterations", options.iterations, "Optional. Runs of each phase, the fastest is reported")->check(CLI::PositiveNumber);
+
+    // Streams: -s, --streams   Code every chunk as this many interleaved streams.
+    app.add_option("-s, --streams", options.streams, "Optional. Codes every chunk on its own as this many interleaved streams, up to 8")->check(CLI::Range(1U, huffman::MAX_STREAMS));
+
+    // Size: --size     How big the generated corpora are.
+    CLI::Option* sizeOption = app.add_option("--size", options.syntheticSize, "Optional. Size of the generated corpora, e.g. 16M")->transform(CLI::AsSizeValue(false));
+
+    bool noSyntheticFlag = false;
+    app.add_flag("--no-synthetic", noSyntheticFlag, "Include to only run the files given on the command line");
+
+    // Compact: --compact   Time the small, table free decoder instead.
+    app.add_flag("--compact", options.compact, "Include to decode with huffman::CompactDecoder instead of huffman::Decoder");
+
+    // Verify: --verify   Check the fast paths instead of timing them.
+    app.add_flag("--verify", options.verify, "Include to check every encoder and decoder against a bit at a time reference instead of timing them");
+
+    app.add_flag("--csv", options.csv, "Include to print comma separated values instead of a table");
+
+    CLI11_PARSE(app, argc, argv);
+
+    options.synthetic = !noSyntheticFlag;
+    if (options.verify && sizeOption->count() == 0)
+        options.syntheticSize = VERIFY_SIZE;
+
+    std::vector<Corpus> corpora;
+    if (options.synthetic)
+        corpora = syntheticCorpora(options.syntheticSize);
+
+    for (auto& filename : options.files)
+    {
+        Corpus corpus;
+        if (!loadCorpus(filename, corpus))
+        {
+            std::cerr << "ERROR: File \"" << filename << "\" was not able to be read.\n";
+            continue;
+        }
+        corpora.push_back(std::move(corpus));
+    }
+
+    // Each check starts from its own seed, so a failure shows up again on the next run with the same options.
+    if (options.verify)
+    {
+        printVerifyHeader();
+        uint64_t failed = 0;
+        uint32_t seed = 1;
+        for (auto& corpus : corpora)
+        {
+            for (auto chunkSize : options.chunkSizes)
+            {
+                if (chunkSize == 0)
+                    continue;
+
+                VerifyResult result = verifyCorpus(corpus, chunkSize, seed++);
+                failed += result.failed;
+                printVerifyRow(result);
+            }
+        }
+
+        VerifyResult tables = verifyRandomTables(VERIFY_TABLES, seed);
+        failed += tables.failed;
+        printVerifyRow(tables);
+        return failed != 0 ? 1 : 0;
+    }
+
+    if (options.csv)
+        printCsvHeader();
+    else
+        printTableHeader();
+
+    bool failed = false;
+    for (auto& corpus : corpora)
+    {
+        for (auto chunkSize : options.chunkSizes)
+        {
+            if (chunkSize == 0)
+                continue;
+
+            Result result = runCorpus(corpus, chunkSize, options.iterations, options.streams, options.compact);
+            failed |= !result.roundTrip;
+
+            if (options.csv)
+                printCsvRow(result);
+            else
+                printTableRow(result);
+        }
+    }
+
+    // A kernel that decodes something other than what went in isn't faster, it's broken.
+    return failed ? 1 : 0;
+}
+
+Result runCorpus(const Corpus& corpus, size_t chunkSize, unsigned int iterations, unsigned int streams, bool compact)
+{
+    const char* data = corpus.data.data();
+    const size_t size = corpus.data.size();
+
+    Result result;
+    result.corpus = corpus.name;
+    result.size = size;
+    result.chunkSize = chunkSize;
+    result.streams = streams;
+    result.compressedSize = 0;
+    result.roundTrip = true;
+
+    // Both buffers are sized up front, so the timed phases don't allocate.
+    std::string compressed;
+    std::string decoded(size, '\0');
+    std::vector<size_t> blockSizes((size + chunkSize - 1) / chunkSize);
+
+    for (unsigned int iteration = 0; iteration < iterations; iteration++)
+    {
+        huffman::Histogram histogram;
+        timePhase(result.histogram, 1, [&]()
+            {
+                for (size_t pos = 0; pos < size; pos += chunkSize)
+                    histogram.add(data + pos, std::min(chunkSize, size - pos));
+            });
+
+        huffman::Encoder built;
+        timePhase(result.tree, TREE_REPEATS, [&]()
+            {
+                built = huffman::Encoder();
+                built.buildFreqTable(histogram);
+                built.buildEncodingTree();
+            });
+
+        // Every run starts from a freshly built encoder so the leftover bits of the last run aren't carried over.
+        huffman::Encoder encoder = built;
+        compressed.resize(streams > 1 ? blockSizes.size() * encoder.interleavedBound(chunkSize, streams) : encoder.encodeBound(size));
+        size_t compressedSize = 0;
+        timePhase(result.encode, 1, [&]()
+            {
+                if (streams > 1)
+                {
+                    uint8_t* out = reinterpret_cast<uint8_t*>(&compressed[0]);
+                    compressedSize = 0;
+                    for (size_t block = 0; block < blockSizes.size(); block++)
+                    {
+                        size_t pos = block * chunkSize;
+                        blockSizes[block] = encoder.encodeInterleaved(reinterpret_cast<const uint8_t*>(data + pos), std::min(chunkSize, size - pos),
+                            streams, out + compressedSize, compressed.size() - compressedSize);
+                        compressedSize += blockSizes[block];
+                    }
+                    return;
+                }
+
+                uint8_t* out = reinterpret_cast<uint8_t*>(&compressed[0]);
+                size_t capacity = compressed.size();
+                compressedSize = 0;
+                for (size_t pos = 0; pos < size; pos += chunkSize)
+                {
+                    compressedSize += encoder.encode(reinterpret_cast<const uint8_t*>(data + pos), std::min(chunkSize, size - pos),
+                        out + compressedSize, capacity - compressedSize);
+                }
+                compressedSize += encoder.finish(out + compressedSize, capacity - compressedSize);
+            });
+        result.compressedSize = compressedSize;
+
+        size_t decodedSize = 0;
+        timePhase(result.decode, 1, [&]()
+            {
+                const uint8_t* in = reinterpret_cast<const uint8_t*>(compressed.data());
+                uint8_t* out = reinterpret_cast<uint8_t*>(&decoded[0]);
+                decodedSize = 0;
+
+                // The compact decoder only decodes whole streams, so the single stream is decoded in one call.
+                if (compact)
+                {
+                    huffman::CompactDecoder decoder(built.codeLengths());
+                    if (streams == 1)
+                    {
+                        decodedSize = decoder.decodeBounded(in, compressedSize, out, size);
+                        return;
+                    }
+                    for (size_t block = 0; block < blockSizes.size(); block++)
+                    {
+                        size_t length = std::min(chunkSize, size - decodedSize);
+                        decodedSize += decoder.decodeInterleaved(in, blockSizes[block], streams, out + decodedSize, length);
+                        in += blockSizes[block];
+                    }
+                    return;
+                }
+
+                huffman::Decoder decoder(built.codeLengths(), built.maxCodeLength(), size);
+
+                if (streams > 1)
+                {
+                    for (size_t block = 0; block < blockSizes.size(); block++)
+                    {
+                        size_t length = std::min(chunkSize, size - decodedSize);
+                        decodedSize += decoder.decodeInterleaved(in, blockSizes[block], streams, out + decodedSize, length);
+                        in += blockSizes[block];
+                    }
+                    return;
+                }
+
+                // Called at least once, a stream of 0 bit codes has no bytes at all.
+                size_t pos = 0;
+                do
+                {
+                    size_t chunk = std::min(chunkSize, compressedSize - pos);
+                    decodedSize += decoder.decode(in + pos, chunk, out + decodedSize, decoded.size() - decodedSize);
+                    pos += chunk;
+                } while (pos < compressedSize && !decoder.done());
+            });
+
+        if (decodedSize != size || decoded != corpus.data)
+            result.roundTrip = false;
+    }
+
+    return result;
+}
+
+std::vector<Corpus> syntheticCorpora(size_t size)
+{
+    std::vector<Corpus> corpora;
+    std::mt19937 random(12345);
+
+    // Uniform bytes. Nothing to gain, so this is the worst case for both ratio and speed.
+    Corpus uniform{ "random", std::string(size, '\0') };
+    std::uniform_int_distribution<int> byteDist(0, 255);
+    for (auto& byte : uniform.data)
+        byte = static_cast<char>(byteDist(random));
+    corpora.push_back(std::move(uniform));
+
+    // One byte value repeated. The tree is a single leaf and the codes are empty.
+    corpora.push_back(Corpus{ "same-byte", std::string(size, 'a') });
+
+    // Words picked with Zipf-like weights, which gives text a skew similar to natural language.
+    const std::vector<std::string> words = { "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was", "with", "be",
+        "by", "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have", "an", "had", "they", "you",
+        "were", "their", "one", "all", "we", "can", "her", "has", "there", "been", "if", "more", "when", "will", "would", "who",
+        "so", "no", "compression", "Huffman", "frequency", "table", "1984", "2022," };
+    std::vector<double> weights;
+    for (size_t i = 0; i < words.size(); i++)
+        weights.push_back(1.0 / (i + 1));
+    std::discrete_distribution<size_t> wordDist(weights.begin(), weights.end());
+
+    Corpus text{ "text", std::string() };
+    text.data.reserve(size + 16);
+    for (unsigned int count = 1; text.data.size() < size; count++)
+    {
+        text.data += words[wordDist(random)];
+        text.data += count % 12 == 0 ? '\n' : ' ';
+    }
+    text.data.resize(size);
+    corpora.push_back(std::move(text));
+
+    // Small enough that building the tables costs more than coding the data.
+    corpora.push_back(Corpus{ "tiny", "GET /index.html HTTP/1.1\r\nHost: example.com\r\n\r\n" });
+
+    return corpora;
+}
+
+bool loadCorpus(const std::string& filename, Corpus& corpus)
+{
+    std::ifstream input(filename, std::ios::binary);
+    if (!input.good())
+        return false;
+
+    input.seekg(0, input.end);
+    corpus.data.resize(static_cast<size_t>(input.tellg()));
+    input.seekg(0, input.beg);
+    input.read(&corpus.data[0], corpus.data.size());
+
+    // Only the name of the file, it's used as the corpus name in the output.
+    size_t slash = filename.find_last_of("/\\");
+    corpus.name = slash == std::string::npos ? filename : filename.substr(slash + 1);
+
+    return input.good() || input.eof();
+}
+
+void printTableHeader()
+{
+    std::cout << std::left << std::setw(14) << "corpus" << std::right
+        << std::setw(12) << "size" << std::setw(9) << "chunk" << std::setw(8) << "streams" << std::setw(8) << "ratio"
+        << std::setw(11) << "hist MB/s" << std::setw(10) << "tree us"
+        << std::setw(10) << "enc MB/s" << std::setw(8) << "enc c/B"
+        << std::setw(10) << "dec MB/s" << std::setw(8) << "dec c/B" << "\n";
+}
+
+void printTableRow(const Result& result)
+{
+    double ratio = result.size > 0 ? static_cast<double>(result.compressedSize) / result.size : 0;
+
+    std::cout << std::left << std::setw(14) << result.corpus << std::right << std::fixed
+        << std::setw(12) << result.size << std::setw(9) << result.chunkSize << std::setw(8) << result.streams
+        << std::setprecision(3) << std::setw(8) << ratio
+        << std::setprecision(1) << std::setw(11) << megabytesPerSecond(result.size, result.histogram)
+        << std::setw(10) << result.tree.seconds * 1e6
+        << std::setw(10) << megabytesPerSecond(result.size, result.encode)
+        << std::setprecision(2) << std::setw(8) << cyclesPerByte(result.size, result.encode)
+        << std::setprecision(1) << std::setw(10) << megabytesPerSecond(result.size, result.decode)
+        << std::setprecision(2) << std::setw(8) << cyclesPerByte(result.size, result.decode)
+        << (result.roundTrip ? "" : "  MISMATCH") << "\n";
+}
+
+void printCsvHeader()
+{
+    std::cout << "corpus,size,chunk,streams,compressed,ratio,hist_mbps,tree_us,enc_mbps,enc_cpb,dec_mbps,dec_cpb,round_trip\n";
+}
+
+void printCsvRow(const Result& result)
+{
+    double ratio = result.size > 0 ? static_cast<double>(result.compressedSize) / result.size : 0;
+
+    std::cout << result.corpus << "," << result.size << "," << result.chunkSize << "," << result.streams << "," << result.compressedSize << ","
+        << ratio << "," << megabytesPerSecond(result.size, result.histogram) << "," << result.tree.seconds * 1e6 << ","
+        << megabytesPerSecond(result.size, result.encode) << "," << cyclesPerByte(result.size, result.encode) << ","
+        << megabytesPerSecond(result.size, result.decode) << "," << cyclesPerByte(result.size, result.decode) << ","
+        << (result.roundTrip ? "ok" : "MISMATCH") << "\n";
+}
+
+uint64_t readCycles()
+{
+    // The time stamp counter ticks at a fixed rate, which is close to but not always the core clock.
+#if HAS_CYCLE_COUNTER
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
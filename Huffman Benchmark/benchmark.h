@@ -0,0 +1,105 @@
+#pragma once
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define HAS_CYCLE_COUNTER 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAS_CYCLE_COUNTER 1
+#else
+#define HAS_CYCLE_COUNTER 0
+#endif
+#include "huffman.h"
+#include "ThirdParty/CLI11.hpp"
+
+
+
+// An input to benchmark. Either generated or read from a file given on the command line.
+struct Corpus
+{
+    std::string name;
+    std::string data;
+};
+
+// The time one phase took, from the fastest of all iterations.
+struct PhaseTime
+{
+    double seconds;
+    uint64_t cycles;
+
+    PhaseTime()
+        : seconds(0)
+        , cycles(0)
+    { }
+};
+
+// Everything measured for one corpus at one chunk size.
+struct Result
+{
+    std::string corpus;
+    size_t size;
+    size_t chunkSize;
+    unsigned int streams;
+    size_t compressedSize;
+    PhaseTime histogram;
+    PhaseTime tree;
+    PhaseTime encode;
+    PhaseTime decode;
+    // False if the decoded data didn't match the input.
+    bool roundTrip;
+};
+
+// Settings from the command line.
+struct BenchOptions
+{
+    std::vector<std::string> files;
+    std::vector<size_t> chunkSizes;
+    unsigned int iterations;
+    // More than 1 codes every chunk on its own as that many interleaved streams.
+    unsigned int streams;
+    size_t syntheticSize;
+    bool synthetic;
+    bool csv;
+    // Decode with CompactDecoder instead of Decoder.
+    bool compact;
+    // Check the fast paths against the reference instead of timing them.
+    bool verify;
+
+    BenchOptions()
+        : chunkSizes{ 8192, 64 * 1024, 1024 * 1024 }
+        , iterations(5)
+        , streams(1)
+        , syntheticSize(16 * 1024 * 1024)
+        , synthetic(true)
+        , csv(false)
+        , compact(false)
+        , verify(false)
+    { }
+};
+
+// Times the histogram, tree build, encode and decode phases of corpus with the input fed in chunkSize pieces.
+// With more than one stream every piece is coded on its own with encodeInterleaved() and decodeInterleaved().
+// With compact the decode phase uses CompactDecoder.
+Result runCorpus(const Corpus& corpus, size_t chunkSize, unsigned int iterations, unsigned int streams, bool compact);
+
+// Generated inputs that are always available: random bytes, a single repeated byte, skewed text-like bytes and a tiny message.
+std::vector<Corpus> syntheticCorpora(size_t size);
+
+// Reads a whole file into a corpus named after it. Returns false if the file couldn't be read.
+bool loadCorpus(const std::string& filename, Corpus& corpus);
+
+// Output of the results, one line per corpus and chunk size.
+void printTableHeader();
+void printTableRow(const Result& result);
+void printCsvHeader();
+void printCsvRow(const Result& result);
+
+// Reads the cycle counter, 0 if the platform doesn't have one the benchmark knows how to read.
+uint64_t readCycles();
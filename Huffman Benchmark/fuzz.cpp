@@ -0,0 +1,555 @@
+#include "fuzz.h"
+
+/*
+Fuzzer for the file and archive formats, see fuzz.h.
+
+Commands:
+			Files to run once each, e.g. a crash libFuzzer found. Without any the driver compresses and mutates its own
+-n, --mutations     Corrupt copies of the compressed inputs to run
+--seed              Seed of the mutations
+--work              Directory the inputs are compressed in. They are removed again when they have been read
+
+*/
+
+namespace
+{
+    // Size of the generated inputs. Big enough for several blocks, seek points and chunks with the sizes below.
+    constexpr size_t SEED_SIZE = 96 * 1024;
+
+    // Small blocks, seek points and chunks, so that every input has plenty of each.
+    constexpr unsigned int SEED_BLOCK_SIZE = 16 * 1024;
+    constexpr uint64_t SEED_SEEK_INTERVAL = 4 * 1024;
+    constexpr unsigned int FUZZ_CHUNK_SIZE = 4 * 1024;
+
+    constexpr unsigned int DEFAULT_MUTATIONS = 20000;
+
+    // Archives are compressed from this many parts of an input, and an empty member.
+    constexpr unsigned int ARCHIVE_MEMBERS = 3;
+
+    // Drops everything written to it.
+    class NullBuffer : public std::streambuf
+    {
+    protected:
+        int overflow(int c) override
+        {
+            return traits_type::not_eof(c);
+        }
+
+        std::streamsize xsputn(const char*, std::streamsize n) override
+        {
+            return n;
+        }
+    };
+
+    // Takes the messages of the functions under test. Nearly every input is corrupt, and each would print an error.
+    class NullStream : public std::ostream
+    {
+    public:
+        NullStream()
+            : std::ostream(&m_buffer)
+        { }
+
+    private:
+        NullBuffer m_buffer;
+    };
+
+    // What one path decoded. The header is the path's own copy, streamed files fill theirs in from the trailer.
+    struct Decoded
+    {
+        std::string data;
+        Header header;
+        bool intact;
+    };
+
+    void fail(FuzzResult& result, const std::string& what)
+    {
+        if (!result.consistent)
+            return;
+        result.consistent = false;
+        result.failure = what;
+    }
+
+    Options fuzzOptions(unsigned int threads)
+    {
+        Options options;
+        options.threads = threads;
+        options.progress = Progress::Format::None;
+        options.chunkSize = FUZZ_CHUNK_SIZE;
+        return options;
+    }
+
+    // Decodes everything after the header, which starts at dataStart, the way decompress() would.
+    // mapped hands decompressData() the bytes in place, like a mapped file, otherwise it reads them from the stream.
+    Decoded decodePath(const std::string& bytes, size_t dataStart, const Header& header, bool mapped, const Options& options)
+    {
+        NullStream quiet;
+        std::istringstream input(bytes);
+        input.seekg(static_cast<std::streamoff>(dataStart));
+
+        Decoded decoded;
+        decoded.header = header;
+        std::ostringstream output;
+        Checksum checksum(header.checksumType);
+        Progress progress(0, Progress::Format::None, quiet);
+        Stats stats(false, "fuzz");
+
+        const char* data = mapped ? bytes.data() + dataStart : nullptr;
+        size_t dataLen = mapped ? bytes.size() - dataStart : 0;
+        bool complete = decompressData(input, data, dataLen, output, decoded.header, checksum, options, progress, stats, quiet);
+
+        // Ranges can't be checked against the file's checksum, decompressRange() checks what it decoded itself.
+        decoded.data = output.str();
+        decoded.intact = complete && (options.range || checksum.getHash() == decoded.header.hash);
+        return decoded;
+    }
+
+    FuzzResult fuzzFile(const std::string& bytes)
+    {
+        FuzzResult result;
+        NullStream quiet;
+
+        std::istringstream input(bytes);
+        if (!checkSig(input, quiet))
+            return result;
+        Header header = readHeader(input);
+        if (!checkHeader(input, header, "", quiet))
+            return result;
+        result.parsed = true;
+        result.filename = header.filename;
+
+        if (header.fileSize > MAX_FUZZ_OUTPUT || header.blockSize > MAX_FUZZ_OUTPUT)
+            return result;
+        size_t dataStart = static_cast<size_t>(input.tellg());
+
+        // Blocks go to a thread pool when there is more than one thread, streamed files are the same either way mapped or not.
+        Decoded mapped = decodePath(bytes, dataStart, header, true, fuzzOptions(1));
+        Decoded streamed = decodePath(bytes, dataStart, header, false, fuzzOptions(2));
+        result.decoded = mapped.data;
+        result.intact = mapped.intact && streamed.intact;
+
+        // Without a checksum every file is intact, so the two have to agree on corrupt files too.
+        if ((mapped.intact || streamed.intact) && (mapped.intact != streamed.intact || mapped.data != streamed.data))
+            fail(result, "mapped and streamed decodes differ");
+
+        // Ranges are also run on corrupt files, but they only have to match the whole file when its checksum proves it right.
+        // Decoding from a seek point can go wrong in a different place than decoding from the start. The seek points themselves
+        // aren't covered by the checksum, readHeader() only rejects the ones that can't be right. A range that starts at one
+        // that was moved only has to stay inside the range.
+        uint64_t size = mapped.data.size();
+        Options rangeOptions = fuzzOptions(1);
+        rangeOptions.range = true;
+        rangeOptions.rangeOffset = size / 3;
+        rangeOptions.rangeLength = size / 2 + 1;
+        std::string expected = mapped.data.substr(static_cast<size_t>(rangeOptions.rangeOffset), static_cast<size_t>(rangeOptions.rangeLength));
+        bool checked = result.intact && header.checksumType != Checksum::Type::None;
+        bool seekPoints = (header.flags & FLAG_SEEK_INDEX) != 0;
+        for (bool inPlace : { true, false })
+        {
+            Decoded part = decodePath(bytes, dataStart, header, inPlace, rangeOptions);
+            if (checked && (seekPoints ? part.data.size() > expected.size() : !part.intact || part.data != expected))
+                fail(result, inPlace ? "mapped range differs from the whole file" : "streamed range differs from the whole file");
+        }
+        return result;
+    }
+
+    FuzzResult fuzzArchive(const std::string& bytes)
+    {
+        FuzzResult result;
+        NullStream quiet;
+
+        std::istringstream input(bytes);
+        ArchiveIndex index;
+        if (!readArchiveIndex(input, index, quiet))
+            return result;
+        result.parsed = true;
+
+        uint64_t total = 0;
+        for (auto& entry : index.entries)
+            total += std::min(entry.size, MAX_FUZZ_OUTPUT + 1);
+        if (total > MAX_FUZZ_OUTPUT)
+            return result;
+
+        // The same decoder extractArchive() builds.
+        std::unique_ptr<huffman::Decoder> shared;
+        if ((index.flags & ARCHIVE_SHARED_TABLE) && !huffman::emptyCodeLengths(index.sharedLengths))
+            shared.reset(new huffman::Decoder(index.sharedLengths, index.maxCodeLength, 0));
+
+        // readArchiveIndex() made sure every member lies inside the archive. The copy ends where the member does, so a read
+        // past the member is a read past the copy.
+        result.intact = true;
+        for (auto& entry : index.entries)
+        {
+            const char* member = bytes.data() + entry.offset;
+            Block inPlace = decodeMember(member, static_cast<size_t>(entry.compressedSize), index, entry, shared.get());
+            std::string copy(member, static_cast<size_t>(entry.compressedSize));
+            Block copied = decodeMember(copy.data(), copy.size(), index, entry, shared.get());
+
+            if (inPlace.data != copied.data || inPlace.checksum != copied.checksum)
+                fail(result, "archive member \"" + entry.name + "\" decodes differently in place and copied");
+            if (inPlace.checksum != entry.checksum)
+                result.intact = false;
+            result.decoded += inPlace.data;
+        }
+        return result;
+    }
+}
+
+FuzzResult fuzzContainer(const uint8_t* data, size_t size)
+{
+    std::string bytes(reinterpret_cast<const char*>(data), size);
+    if (bytes.compare(0, archiveSig.size(), archiveSig) == 0)
+        return fuzzArchive(bytes);
+    return fuzzFile(bytes);
+}
+
+std::string mutate(const std::string& input, std::mt19937& random)
+{
+    std::string output = input;
+    if (output.empty())
+        return output;
+
+    auto position = [&random](size_t size) { return static_cast<size_t>(random() % size); };
+    // Headers, trailers and directories are small next to the data, so most changes are aimed at either end.
+    auto nearEnd = [&random, &position](size_t size)
+    {
+        size_t edge = std::min<size_t>(size, 128);
+        return random() % 2 == 0 ? position(edge) : size - 1 - position(edge);
+    };
+
+    switch (random() % 8)
+    {
+    case 0:
+        output.resize(position(output.size()));
+        break;
+    case 1:
+        for (unsigned int i = 1 + random() % 5; i > 0; i--)
+            output[position(output.size())] = static_cast<char>(random());
+        break;
+    case 2:
+    {
+        // The values a size or a count is most likely to be checked wrong for.
+        const uint8_t values[] = { 0, 1, 0x7f, 0x80, 0xff };
+        output[nearEnd(output.size())] = static_cast<char>(values[random() % sizeof(values)]);
+        break;
+    }
+    case 3:
+    {
+        size_t at = nearEnd(output.size());
+        output.replace(at, 4, 4, '\xff');
+        break;
+    }
+    case 4:
+        output[nearEnd(output.size())] ^= static_cast<char>(1 << (random() % 8));
+        break;
+    case 5:
+        output[position(output.size())] ^= static_cast<char>(1 << (random() % 8));
+        break;
+    case 6:
+        output.erase(nearEnd(output.size()), 1 + random() % 20);
+        break;
+    default:
+    {
+        std::string inserted(1 + random() % 20, '\0');
+        for (char& c : inserted)
+            c = static_cast<char>(random());
+        output.insert(nearEnd(output.size()), inserted);
+        break;
+    }
+    }
+    return output;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    FuzzResult result = fuzzContainer(data, size);
+    if (!result.consistent)
+    {
+        std::cerr << "HFuzz: " << result.failure << "\n";
+        std::abort();
+    }
+    return 0;
+}
+
+#ifndef HUFFMAN_LIBFUZZER
+
+namespace
+{
+    // A compressed input and what it has to decode back to.
+    struct Seed
+    {
+        std::string name;
+        std::string bytes;
+        std::string original;
+        std::string filename;
+    };
+
+    // Bytes like the ones HBench generates: skewed text, random bytes, long runs, text and random bytes in turn, which --split
+    // cuts apart, and a short message.
+    std::vector<std::pair<std::string, std::string>> generateInputs(std::mt19937& random)
+    {
+        std::vector<std::pair<std::string, std::string>> inputs;
+
+        const char* words[] = { "the ", "huffman ", "code ", "of ", "a ", "block ", "stream ", "and ", "is ", "to ", "\n" };
+        std::string text;
+        while (text.size() < SEED_SIZE)
+            text += words[std::min(random() % 16, static_cast<std::mt19937::result_type>(10))];
+        inputs.emplace_back("text", text);
+
+        std::string noise(SEED_SIZE, '\0');
+        for (char& c : noise)
+            c = static_cast<char>(random());
+        inputs.emplace_back("random", noise);
+
+        std::string runs;
+        while (runs.size() < SEED_SIZE)
+            runs.append(1 + random() % 2000, static_cast<char>(random() % 4));
+        inputs.emplace_back("runs", runs);
+
+        inputs.emplace_back("mixed", text.substr(0, SEED_SIZE / 2) + noise.substr(0, SEED_SIZE / 2) + text.substr(SEED_SIZE / 2));
+        inputs.emplace_back("tiny", "GET /index.html HTTP/1.1\r\nHost: example.com\r\n\r\n");
+        inputs.emplace_back("same-byte", std::string(1000, 'a'));
+        inputs.emplace_back("empty", "");
+        return inputs;
+    }
+
+    // Every layout compress() can write, named after the options that make it.
+    std::vector<std::pair<std::string, Options>> layouts()
+    {
+        std::vector<std::pair<std::string, Options>> result;
+        Options options = fuzzOptions(2);
+        options.seekInterval = 0;
+        result.emplace_back("single stream", options);
+
+        options = fuzzOptions(2);
+        options.seekInterval = SEED_SEEK_INTERVAL;
+        result.emplace_back("--seek-interval", options);
+
+        options.checksum = Checksum::Type::MD5;
+        result.emplace_back("--checksum md5", options);
+
+        options = fuzzOptions(2);
+        options.tableName = "text";
+        result.emplace_back("--table text", options);
+
+        options = fuzzOptions(2);
+        options.blockSize = SEED_BLOCK_SIZE;
+        result.emplace_back("--block-size", options);
+
+        options.checksum = Checksum::Type::None;
+        result.emplace_back("--checksum none", options);
+
+        options = fuzzOptions(2);
+        options.blockSize = SEED_BLOCK_SIZE;
+        options.streams = 4;
+        result.emplace_back("--streams 4", options);
+
+        options = fuzzOptions(2);
+        options.blockSize = 4 * SPLIT_UNIT;
+        options.split = true;
+        result.emplace_back("--split", options);
+
+        options = fuzzOptions(2);
+        options.blockSize = SEED_BLOCK_SIZE;
+        options.rle = true;
+        result.emplace_back("--rle", options);
+        return result;
+    }
+
+    bool readFile(const std::string& filename, std::string& data)
+    {
+        std::ifstream input(filename, std::ios::binary);
+        if (!input.good())
+            return false;
+        std::ostringstream buffer;
+        buffer << input.rdbuf();
+        data = buffer.str();
+        return true;
+    }
+
+    bool writeFile(const std::string& filename, const std::string& data)
+    {
+        std::ofstream output(filename, std::ios::binary);
+        output.write(data.data(), data.size());
+        return output.good();
+    }
+
+    // Compresses data with compress(), from a name with a "\" in it. Only the part after it is stored, on Windows because it's
+    // the directory, elsewhere because it could be one on Windows.
+    bool compressFile(const std::string& name, const std::string& data, const Options& options, const std::string& work, Seed& seed)
+    {
+        NullStream quiet;
+        std::string inputName = work + "hfuzz\\" + name + ".txt";
+#ifdef _WIN32
+        createParentDirectories(work + "hfuzz/" + name + ".txt");
+#endif
+        std::string outputName = work + name + ".huf";
+        bool compressed = writeFile(inputName, data) && compress(inputName, work, options, quiet, quiet) && readFile(outputName, seed.bytes);
+        std::remove(inputName.c_str());
+        std::remove(outputName.c_str());
+        seed.original = data;
+        seed.filename = name + ".txt";
+        return compressed;
+    }
+
+    // Compresses data the way compress() does stdin.
+    void compressPiped(const std::string& data, const Options& options, Seed& seed)
+    {
+        NullStream quiet;
+        Header header;
+        header.fileVersion = curFileVersion;
+        header.checksumType = options.checksum;
+        header.maxCodeLength = huffman::MAX_CODE_LENGTH;
+        header.flags = FLAG_STREAMED;
+        header.blockSize = options.blockSize != 0 ? static_cast<uint32_t>(options.blockSize) : SEED_BLOCK_SIZE;
+        header.streams = options.streams;
+        if (header.streams > 1)
+            header.flags |= FLAG_INTERLEAVED;
+        if (options.rle)
+            header.flags |= FLAG_RLE;
+
+        std::istringstream input(data);
+        std::ostringstream output;
+        Stats stats(false, "compress");
+        Progress progress(0, Progress::Format::None, quiet);
+        compressStream(input, output, header, options.threads, options.split, progress, stats);
+        seed.bytes = output.str();
+        seed.original = data;
+        seed.filename = "";
+    }
+
+    // Compresses data in parts into an archive, followed by an empty member.
+    bool compressMembers(const std::string& data, const Options& options, const std::string& work, Seed& seed)
+    {
+        std::vector<std::string> members;
+        size_t partSize = data.size() / ARCHIVE_MEMBERS + 1;
+        bool written = true;
+        for (unsigned int i = 0; i <= ARCHIVE_MEMBERS; i++)
+        {
+            members.push_back(work + "hfuzz-member" + std::to_string(i));
+            std::string part = i < ARCHIVE_MEMBERS ? data.substr(std::min(data.size(), i * partSize), partSize) : "";
+            written = writeFile(members.back(), part) && written;
+        }
+
+        std::string archiveName = work + "hfuzz-archive.huf";
+        bool compressed = written && compressArchive(members, archiveName, options) && readFile(archiveName, seed.bytes);
+        for (auto& member : members)
+            std::remove(member.c_str());
+        std::remove(archiveName.c_str());
+        seed.original = data;
+        seed.filename = "";
+        return compressed;
+    }
+
+    // Every input in every layout, piped and as archives. Prints the seeds that couldn't be written or didn't decode back
+    // to their input, and returns how many.
+    unsigned int buildSeeds(const std::string& work, std::mt19937& random, std::vector<Seed>& seeds)
+    {
+        unsigned int failed = 0;
+        auto add = [&seeds, &failed](Seed& seed, bool compressed)
+        {
+            FuzzResult result = fuzzContainer(reinterpret_cast<const uint8_t*>(seed.bytes.data()), seed.bytes.size());
+            if (compressed && result.intact && result.consistent && result.decoded == seed.original && result.filename == seed.filename)
+            {
+                seeds.push_back(seed);
+                return;
+            }
+            failed++;
+            std::cout << "FAILED  " << seed.name << ": " << (!compressed ? "not compressed" : !result.consistent ? result.failure
+                : result.filename != seed.filename ? "stored as \"" + result.filename + "\"" : "didn't decode back to its input") << "\n";
+        };
+
+        for (auto& input : generateInputs(random))
+        {
+            for (auto& layout : layouts())
+            {
+                Seed seed;
+                seed.name = input.first + " " + layout.first;
+                add(seed, compressFile(input.first, input.second, layout.second, work, seed));
+
+                // Prebuilt tables only code single stream files, which can't be piped.
+                if (!layout.second.tableName.empty())
+                    continue;
+
+                seed = Seed();
+                seed.name = input.first + " piped " + layout.first;
+                compressPiped(input.second, layout.second, seed);
+                add(seed, true);
+            }
+
+            for (bool shared : { false, true })
+            {
+                Options options = fuzzOptions(2);
+                options.sharedTable = shared;
+                Seed seed;
+                seed.name = input.first + (shared ? " archive --shared-table" : " archive");
+                add(seed, compressMembers(input.second, options, work, seed));
+            }
+        }
+        return failed;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    CLI::App app{ "Fuzzer for the Huffman file and archive formats" };
+
+    std::vector<std::string> files;
+    app.add_option("files", files, "Optional. Files to run once each instead of fuzzing")->check(CLI::ExistingFile);
+
+    unsigned int mutations = DEFAULT_MUTATIONS;
+    app.add_option("-n, --mutations", mutations, "Optional. Corrupt copies of the compressed inputs to run");
+
+    uint32_t seedValue = 1;
+    app.add_option("--seed", seedValue, "Optional. Seed of the generated inputs and the mutations");
+
+    std::string work = "";
+    app.add_option("--work", work, "Optional. Directory the inputs are compressed in, the current one by default")->check(CLI::ExistingDirectory);
+
+    CLI11_PARSE(app, argc, argv);
+
+    if (!files.empty())
+    {
+        unsigned int failed = 0;
+        for (auto& filename : files)
+        {
+            std::string bytes;
+            FuzzResult result;
+            if (readFile(filename, bytes))
+                result = fuzzContainer(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size());
+            std::cout << (result.consistent ? "ok      " : "FAILED  ") << filename << (result.consistent ? "" : ": " + result.failure) << "\n";
+            failed += result.consistent ? 0 : 1;
+        }
+        return failed == 0 ? 0 : 1;
+    }
+
+    if (!work.empty())
+        pathEndSlash(work);
+
+    std::mt19937 random(seedValue);
+    std::vector<Seed> seeds;
+    unsigned int failedSeeds = buildSeeds(work, random, seeds);
+    std::cout << seeds.size() + failedSeeds << " inputs compressed, " << failedSeeds << " didn't decode back.\n";
+
+    // Failed inputs are kept next to the compressed ones, to be run again by name.
+    unsigned int parsed = 0;
+    unsigned int failed = 0;
+    for (unsigned int i = 0; i < mutations && !seeds.empty(); i++)
+    {
+        const Seed& seed = seeds[random() % seeds.size()];
+        std::string bytes = mutate(seed.bytes, random);
+        FuzzResult result = fuzzContainer(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size());
+        parsed += result.parsed ? 1 : 0;
+        if (result.consistent)
+            continue;
+
+        failed++;
+        std::string failedName = work + "hfuzz-failed-" + std::to_string(i) + ".huf";
+        writeFile(failedName, bytes);
+        std::cout << "FAILED  " << seed.name << ", mutation " << i << ": " << result.failure << ", written to " << failedName << "\n";
+    }
+    std::cout << mutations << " mutations run, " << parsed << " had a readable header, " << failed << " failed.\n";
+
+    return failedSeeds == 0 && failed == 0 ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,63 @@
+#pragma once
+#include <random>
+#include "main.h"
+#include "archive.h"
+
+/*
+Fuzzing for the file and archive formats. Where HBench --verify checks the codec, this checks everything in front of it:
+checkSig(), readHeader() and readCodeLengths(), the block decoders unpackBlock() and unpackSplit(), seek points, the trailer
+of streamed files and readArchiveIndex().
+
+Every input is decoded more than once, along paths that have to agree:
+	files		mapped on one thread and streamed on two, through decompressData(). When either passes its checksum, both have to,
+				with the same bytes. A range from the middle has to decode to the same bytes as well, mapped and streamed.
+				The checksum doesn't cover seek points, so ranges that decode from one only have to stay inside the range
+	archives	every member decoded in place and from a copy of exactly its own bytes, which have to agree
+
+Each input is decoded into memory. Files, blocks and archives that claim to be bigger than MAX_FUZZ_OUTPUT are only parsed.
+
+Built with HUFFMAN_LIBFUZZER, HFuzz is a libFuzzer target and a failed check aborts. Otherwise it has a driver of its own:
+	HFuzz FILE...		runs each file once
+	HFuzz				compresses generated inputs with every layout into --work, checks that each of them decodes back to its
+						input and to the name it was compressed from, then runs --mutations corrupt copies of them
+
+Build with -fsanitize=address,undefined to have reads past the end of a corrupt input caught as well.
+*/
+
+// The most a fuzzed file is allowed to decode to.
+constexpr uint64_t MAX_FUZZ_OUTPUT = 16 * 1024 * 1024;
+
+// What running one input found.
+struct FuzzResult
+{
+    // The header or the archive directory was read without an error.
+    bool parsed;
+    // Every checksum matched.
+    bool intact;
+    // False if two paths that have to agree didn't. The first one that didn't is in failure.
+    bool consistent;
+    std::string failure;
+    // What the file decoded to, mapped. Every member one after the other for archives.
+    std::string decoded;
+    // The name stored in the header of a file. Empty for archives.
+    std::string filename;
+
+    FuzzResult()
+        : parsed(false)
+        , intact(false)
+        , consistent(true)
+        , failure("")
+        , decoded("")
+        , filename("")
+    { }
+};
+
+// Runs a file or an archive through every path that reads it.
+FuzzResult fuzzContainer(const uint8_t* data, size_t size);
+
+// A corrupt copy of input: bits flipped, bytes overwritten, taken out or put in, or cut short. Most changes land in the first
+// and last bytes, where the headers, trailers and archive directories are.
+std::string mutate(const std::string& input, std::mt19937& random);
+
+// The entry point for libFuzzer and the fuzzers that share its interface. Aborts if fuzzContainer() finds a failed check.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
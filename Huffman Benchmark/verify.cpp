@@ -0,0 +1,530 @@
+#include "verify.h"
+
+namespace
+{
+    // Corrupt blocks are decoded into a buffer this much longer than the block, filled with GUARD_BYTE, to catch writes past its end.
+    constexpr size_t GUARD_SIZE = 64;
+    constexpr uint8_t GUARD_BYTE = 0xA5;
+
+    // Failures kept per result. Any more are only counted.
+    constexpr size_t MAX_FAILURES = 8;
+
+    // Bytes coded with each random table.
+    constexpr size_t TABLE_MESSAGE_SIZE = 4096;
+
+    void check(VerifyResult& result, bool passed, const std::string& what)
+    {
+        result.checks++;
+        if (passed)
+            return;
+
+        result.failed++;
+        if (result.failures.size() < MAX_FAILURES)
+            result.failures.push_back(what);
+    }
+
+    // The canonical codes of a table of code lengths, worked out the slow and obvious way: codes are handed out in order of
+    // length, then byte value, and coded and decoded one bit at a time.
+    class ReferenceCode
+    {
+    public:
+        ReferenceCode(const lengthTable& codeLengths)
+            : m_lengths(codeLengths)
+            , m_codes{ }
+            , m_first{ }
+            , m_count{ }
+            , m_offset{ }
+            , m_single(false)
+            , m_valid(false)
+        {
+            unsigned int used = 0;
+            for (uint8_t len : codeLengths)
+            {
+                if (len > huffman::MAX_WRITER_CODE_LENGTH)
+                    return;
+                if (len != 0)
+                {
+                    m_count[len]++;
+                    used++;
+                }
+            }
+
+            // The code space left after each length, the way inflate checks it. Running out means more codes than fit.
+            int64_t left = 1;
+            for (unsigned int len = 1; len <= huffman::MAX_WRITER_CODE_LENGTH; len++)
+            {
+                left = left * 2 - static_cast<int64_t>(m_count[len]);
+                if (left < 0)
+                    return;
+            }
+            m_valid = used != 0;
+            m_single = used == 1;
+
+            uint64_t code = 0;
+            for (unsigned int len = 1; len <= huffman::MAX_WRITER_CODE_LENGTH; len++)
+            {
+                m_first[len] = code;
+                m_offset[len] = m_symbols.size();
+                for (unsigned int character = 0; character < codeLengths.size(); character++)
+                {
+                    if (codeLengths[character] != len)
+                        continue;
+                    m_codes[character] = static_cast<uint32_t>(code + m_symbols.size() - m_offset[len]);
+                    m_symbols.push_back(static_cast<uint8_t>(character));
+                }
+                code = (code + m_count[len]) << 1;
+            }
+        }
+
+        bool valid() const
+        {
+            return m_valid;
+        }
+
+        // Codes every step-th byte of data from start on, padded with zero bits to a whole byte. A lone byte value has no bits.
+        std::string encode(const uint8_t* data, size_t size, size_t start, size_t step) const
+        {
+            std::string output;
+            uint8_t byte = 0;
+            unsigned int bits = 0;
+            for (size_t i = start; i < size && !m_single; i += step)
+            {
+                unsigned int len = m_lengths[data[i]];
+                for (unsigned int bit = len; bit-- > 0;)
+                {
+                    byte = static_cast<uint8_t>((byte << 1) | ((m_codes[data[i]] >> bit) & 1U));
+                    if (++bits == 8)
+                    {
+                        output += static_cast<char>(byte);
+                        bits = 0;
+                    }
+                }
+            }
+            if (bits > 0)
+                output += static_cast<char>(byte << (8 - bits));
+            return output;
+        }
+
+        // Decodes count codes into every step-th byte of output. Stops at bits that don't start any code, or when the input runs
+        // out in the middle of one. Returns the bytes decoded.
+        size_t decode(const uint8_t* input, size_t size, size_t step, uint8_t* output, size_t count) const
+        {
+            if (m_single)
+            {
+                for (size_t i = 0; i < count; i++)
+                    output[i * step] = m_symbols[0];
+                return count;
+            }
+
+            uint64_t bit = 0;
+            for (size_t decoded = 0; decoded < count; decoded++)
+            {
+                uint64_t code = 0;
+                unsigned int len = 1;
+                for (; len <= huffman::MAX_WRITER_CODE_LENGTH; len++)
+                {
+                    if (bit == static_cast<uint64_t>(size) * 8)
+                        return decoded;
+                    code = (code << 1) | ((input[bit / 8] >> (7 - bit % 8)) & 1U);
+                    bit++;
+                    if (code >= m_first[len] && code - m_first[len] < m_count[len])
+                        break;
+                }
+                if (len > huffman::MAX_WRITER_CODE_LENGTH)
+                    return decoded;
+                output[decoded * step] = m_symbols[m_offset[len] + (code - m_first[len])];
+            }
+            return count;
+        }
+
+        // The block Encoder::encodeInterleaved() writes, see its comment in huffman.h for the layout.
+        std::string encodeInterleaved(const uint8_t* data, size_t size, unsigned int streams) const
+        {
+            std::string sizes;
+            std::string coded;
+            for (unsigned int stream = 0; stream < streams; stream++)
+            {
+                std::string part = encode(data, size, stream, streams);
+                if (stream + 1 < streams)
+                {
+                    for (unsigned int shift = 8 * huffman::STREAM_SIZE_BYTES; shift > 0; shift -= 8)
+                        sizes += static_cast<char>(part.size() >> (shift - 8));
+                }
+                coded += part;
+            }
+            return sizes + coded;
+        }
+
+        // Decodes a block of streams into length bytes of output. counts gets the bytes decoded from every stream, all 0 if the
+        // size table doesn't fit the block. Returns the bytes decoded.
+        size_t decodeInterleaved(const uint8_t* input, size_t size, unsigned int streams, uint8_t* output, size_t length, std::vector<size_t>& counts) const
+        {
+            counts.assign(streams, 0);
+            size_t tableSize = (streams - 1) * huffman::STREAM_SIZE_BYTES;
+            if (m_single)
+                tableSize = 0;
+            else if (size < tableSize)
+                return 0;
+
+            // Every stream starts where the one before it ends, the last one runs to the end of the block.
+            std::vector<size_t> starts(streams + 1, tableSize);
+            starts[streams] = size;
+            for (unsigned int stream = 0; stream + 1 < streams && !m_single; stream++)
+            {
+                uint64_t streamSize = 0;
+                for (unsigned int i = 0; i < huffman::STREAM_SIZE_BYTES; i++)
+                    streamSize = (streamSize << 8) | input[stream * huffman::STREAM_SIZE_BYTES + i];
+                if (streamSize > size - starts[stream])
+                    return 0;
+                starts[stream + 1] = starts[stream] + static_cast<size_t>(streamSize);
+            }
+
+            size_t decoded = 0;
+            for (unsigned int stream = 0; stream < streams; stream++)
+            {
+                size_t count = length / streams + (stream < length % streams ? 1 : 0);
+                counts[stream] = decode(input + starts[stream], starts[stream + 1] - starts[stream], streams, output + stream, count);
+                decoded += counts[stream];
+            }
+            return decoded;
+        }
+
+    private:
+        lengthTable m_lengths;
+        std::array<uint32_t, 256> m_codes;
+
+        // Byte values in code order, and for every length its first code, how many codes it has and where they start in m_symbols.
+        std::vector<uint8_t> m_symbols;
+        std::array<uint64_t, huffman::MAX_WRITER_CODE_LENGTH + 1> m_first;
+        std::array<uint64_t, huffman::MAX_WRITER_CODE_LENGTH + 1> m_count;
+        std::array<size_t, huffman::MAX_WRITER_CODE_LENGTH + 1> m_offset;
+
+        bool m_single;
+        bool m_valid;
+    };
+
+    std::string describe(const std::string& what, unsigned int streams, size_t offset)
+    {
+        return what + " (" + std::to_string(streams) + " streams, block at " + std::to_string(offset) + ")";
+    }
+
+    // An output buffer with guard bytes behind it.
+    struct GuardedOutput
+    {
+        std::vector<uint8_t> buffer;
+        size_t length;
+
+        GuardedOutput(size_t _length)
+            : buffer(_length + GUARD_SIZE, GUARD_BYTE)
+            , length(_length)
+        { }
+
+        uint8_t* data()
+        {
+            return buffer.data();
+        }
+
+        bool guardIntact() const
+        {
+            return std::all_of(buffer.begin() + length, buffer.end(), [](uint8_t byte) { return byte == GUARD_BYTE; });
+        }
+    };
+
+    // Decodes block with both decoders and the reference, which have to agree on how much of every stream decodes and what it
+    // decodes to. block doesn't have to be intact.
+    void compareDecoders(VerifyResult& result, const ReferenceCode& reference, const huffman::Decoder& decoder, const huffman::CompactDecoder& compact,
+        const std::vector<uint8_t>& block, unsigned int streams, size_t length, const std::string& what)
+    {
+        std::vector<uint8_t> expected(length);
+        std::vector<size_t> counts;
+        size_t expectedSize = reference.decodeInterleaved(block.data(), block.size(), streams, expected.data(), length, counts);
+
+        // Only the bytes of each stream up to where it stopped are compared. A decoder may leave anything behind them.
+        auto matches = [&](const uint8_t* output)
+            {
+                for (unsigned int stream = 0; stream < streams; stream++)
+                {
+                    for (size_t i = 0; i < counts[stream]; i++)
+                    {
+                        size_t pos = stream + i * streams;
+                        if (output[pos] != expected[pos])
+                            return false;
+                    }
+                }
+                return true;
+            };
+
+        GuardedOutput fast(length);
+        size_t fastSize = streams == 1
+            ? decoder.decodeBounded(block.data(), block.size(), fast.data(), length)
+            : decoder.decodeInterleaved(block.data(), block.size(), streams, fast.data(), length);
+        check(result, fastSize == expectedSize && matches(fast.data()), what + ": Decoder differs from the reference");
+        check(result, fast.guardIntact(), what + ": Decoder wrote past the end of its output");
+
+        GuardedOutput small(length);
+        size_t smallSize = streams == 1
+            ? compact.decodeBounded(block.data(), block.size(), small.data(), length)
+            : compact.decodeInterleaved(block.data(), block.size(), streams, small.data(), length);
+        check(result, smallSize == expectedSize && matches(small.data()), what + ": CompactDecoder differs from the reference");
+        check(result, small.guardIntact(), what + ": CompactDecoder wrote past the end of its output");
+    }
+
+    // A copy of block with some bits flipped, cut short, made longer or with a broken size table.
+    std::vector<uint8_t> corrupt(const std::vector<uint8_t>& block, unsigned int streams, std::mt19937& random)
+    {
+        std::vector<uint8_t> copy = block;
+        unsigned int kind = random() % 4;
+        if (copy.empty() || kind == 3)
+        {
+            unsigned int extra = 1 + random() % 16;
+            for (unsigned int i = 0; i < extra; i++)
+                copy.push_back(static_cast<uint8_t>(random()));
+        }
+        else if (kind == 0)
+        {
+            unsigned int flips = 1 + random() % 4;
+            for (unsigned int i = 0; i < flips; i++)
+                copy[random() % copy.size()] ^= static_cast<uint8_t>(1U << (random() % 8));
+        }
+        else if (kind == 1)
+        {
+            copy.resize(random() % copy.size());
+        }
+        else
+        {
+            size_t tableSize = std::min<size_t>((streams - 1) * huffman::STREAM_SIZE_BYTES, copy.size());
+            copy[random() % (tableSize != 0 ? tableSize : copy.size())] = static_cast<uint8_t>(random());
+        }
+        return copy;
+    }
+
+    // Random code lengths: a complete code made by splitting leaves of a tree, the same with some codes taken out, or lengths
+    // picked at random, which are mostly not a prefix code at all. Deep chains of splits give codes up to the longest allowed.
+    lengthTable randomLengths(unsigned int kind, std::mt19937& random)
+    {
+        lengthTable lengths{ };
+        if (kind == 2)
+        {
+            unsigned int count = 1 + random() % 256;
+            for (unsigned int i = 0; i < count; i++)
+                lengths[random() % 256] = static_cast<uint8_t>(random() % (huffman::MAX_WRITER_CODE_LENGTH + 8));
+            return lengths;
+        }
+
+        unsigned int count = 1 + random() % 256;
+        std::vector<unsigned int> depths = { 0 };
+        size_t last = 0;
+        while (depths.size() < count)
+        {
+            size_t leaf = random() % 2 == 0 ? last : random() % depths.size();
+            if (depths[leaf] == huffman::MAX_WRITER_CODE_LENGTH)
+                continue;
+            depths[leaf]++;
+            depths.push_back(depths[leaf]);
+            last = random() % 2 == 0 ? leaf : depths.size() - 1;
+        }
+
+        if (kind == 1 && depths.size() > 1)
+        {
+            size_t removed = 1 + random() % (depths.size() / 2);
+            for (size_t i = 0; i < removed; i++)
+                depths.erase(depths.begin() + random() % depths.size());
+        }
+
+        std::vector<unsigned int> characters(256);
+        for (unsigned int i = 0; i < characters.size(); i++)
+            characters[i] = i;
+        std::shuffle(characters.begin(), characters.end(), random);
+        for (size_t i = 0; i < depths.size(); i++)
+            lengths[characters[i]] = static_cast<uint8_t>(std::max(depths[i], 1U));
+        return lengths;
+    }
+}
+
+VerifyResult verifyCorpus(const Corpus& corpus, size_t chunkSize, uint32_t seed)
+{
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(corpus.data.data());
+    const size_t size = corpus.data.size();
+    VerifyResult result = { corpus.name, size, chunkSize, 0, 0, { } };
+    if (size == 0)
+        return result;
+
+    huffman::Encoder encoder;
+    encoder.buildFreqTable(corpus.data);
+    encoder.buildEncodingTree();
+    const lengthTable lengths = encoder.codeLengths();
+    const ReferenceCode reference(lengths);
+    check(result, reference.valid() && huffman::validCodeLengths(lengths), "the code lengths of the corpus aren't a prefix code");
+
+    // One stream, encoded a chunk at a time.
+    std::string expected = reference.encode(data, size, 0, 1);
+    std::vector<uint8_t> encoded(encoder.encodeBound(size));
+    size_t encodedSize = 0;
+    for (size_t pos = 0; pos < size; pos += chunkSize)
+        encodedSize += encoder.encode(data + pos, std::min(chunkSize, size - pos), encoded.data() + encodedSize, encoded.size() - encodedSize);
+    encodedSize += encoder.finish(encoded.data() + encodedSize, encoded.size() - encodedSize);
+    encoded.resize(encodedSize);
+    check(result, std::string(encoded.begin(), encoded.end()) == expected, "Encoder::encode() differs from the reference");
+
+    // The stream decoded a chunk at a time, then in small uneven pieces that end in the middle of codes, then in one go.
+    std::mt19937 random(seed);
+    for (unsigned int pass = 0; pass < 2; pass++)
+    {
+        huffman::Decoder decoder(lengths, encoder.maxCodeLength(), size);
+        std::vector<uint8_t> decoded(size);
+        size_t decodedSize = 0;
+        size_t pos = 0;
+        do
+        {
+            size_t piece = std::min(pass == 0 ? chunkSize : 1 + random() % 13, encodedSize - pos);
+            decodedSize += decoder.decode(encoded.data() + pos, piece, decoded.data() + decodedSize, decoded.size() - decodedSize);
+            pos += piece;
+        } while (pos < encodedSize && !decoder.done());
+        check(result, decodedSize == size && std::memcmp(decoded.data(), data, size) == 0,
+            pass == 0 ? "Decoder::decode() in chunks differs from the input" : "Decoder::decode() in small pieces differs from the input");
+    }
+
+    huffman::Decoder decoder(lengths, encoder.maxCodeLength(), size);
+    huffman::CompactDecoder compact(lengths);
+    {
+        GuardedOutput whole(size);
+        check(result, decoder.decodeBounded(encoded.data(), encodedSize, whole.data(), size) == size && std::memcmp(whole.data(), data, size) == 0
+            && whole.guardIntact(), "Decoder::decodeBounded() differs from the input");
+
+        GuardedOutput small(size);
+        check(result, compact.decodeBounded(encoded.data(), encodedSize, small.data(), size) == size && std::memcmp(small.data(), data, size) == 0
+            && small.guardIntact(), "CompactDecoder::decodeBounded() differs from the input");
+    }
+
+    // Every chunk as a block of each number of streams, intact and then corrupt.
+    for (unsigned int streams = 1; streams <= huffman::MAX_STREAMS; streams++)
+    {
+        std::vector<uint8_t> block(encoder.interleavedBound(chunkSize, streams));
+        for (size_t pos = 0; pos < size; pos += chunkSize)
+        {
+            size_t length = std::min(chunkSize, size - pos);
+            block.resize(encoder.interleavedBound(chunkSize, streams));
+            block.resize(encoder.encodeInterleaved(data + pos, length, streams, block.data(), block.size()));
+            check(result, std::string(block.begin(), block.end()) == reference.encodeInterleaved(data + pos, length, streams),
+                describe("Encoder::encodeInterleaved() differs from the reference", streams, pos));
+
+            GuardedOutput fast(length);
+            size_t fastSize = streams == 1
+                ? decoder.decodeBounded(block.data(), block.size(), fast.data(), length)
+                : decoder.decodeInterleaved(block.data(), block.size(), streams, fast.data(), length);
+            check(result, fastSize == length && std::memcmp(fast.data(), data + pos, length) == 0 && fast.guardIntact(),
+                describe("Decoder differs from the input", streams, pos));
+
+            GuardedOutput small(length);
+            size_t smallSize = streams == 1
+                ? compact.decodeBounded(block.data(), block.size(), small.data(), length)
+                : compact.decodeInterleaved(block.data(), block.size(), streams, small.data(), length);
+            check(result, smallSize == length && std::memcmp(small.data(), data + pos, length) == 0 && small.guardIntact(),
+                describe("CompactDecoder differs from the input", streams, pos));
+
+            compareDecoders(result, reference, decoder, compact, corrupt(block, streams, random), streams, length, describe("corrupt block", streams, pos));
+        }
+    }
+
+    return result;
+}
+
+VerifyResult verifyRandomTables(unsigned int count, uint32_t seed)
+{
+    VerifyResult result = { "random tables", count, TABLE_MESSAGE_SIZE, 0, 0, { } };
+    std::mt19937 random(seed);
+
+    for (unsigned int table = 0; table < count; table++)
+    {
+        const std::string name = "table " + std::to_string(table);
+        lengthTable lengths = randomLengths(table % 3, random);
+        ReferenceCode reference(lengths);
+        check(result, huffman::validCodeLengths(lengths) == reference.valid(), name + ": validCodeLengths() differs from the reference");
+
+        // Lengths that aren't a prefix code are never given to a Decoder, the file readers check them first.
+        if (!reference.valid())
+        {
+            huffman::CompactDecoder compact(lengths);
+            std::vector<uint8_t> input(64, 0x5A);
+            GuardedOutput output(64);
+            check(result, compact.decodeBounded(input.data(), input.size(), output.data(), 64) == 0 && output.guardIntact(),
+                name + ": CompactDecoder decoded lengths that aren't a prefix code");
+            continue;
+        }
+
+        // A message of byte values that have a code.
+        std::vector<uint8_t> characters;
+        for (unsigned int character = 0; character < lengths.size(); character++)
+        {
+            if (lengths[character] != 0)
+                characters.push_back(static_cast<uint8_t>(character));
+        }
+        std::vector<uint8_t> message(TABLE_MESSAGE_SIZE);
+        for (auto& byte : message)
+            byte = characters[random() % characters.size()];
+
+        unsigned int maxCodeLength = *std::max_element(lengths.begin(), lengths.end());
+        huffman::Encoder encoder;
+        encoder.setCodeLengths(lengths, maxCodeLength);
+
+        std::vector<uint8_t> encoded(encoder.encodeBound(message.size()));
+        size_t encodedSize = 0;
+        for (size_t pos = 0; pos < message.size();)
+        {
+            size_t piece = std::min<size_t>(1 + random() % 700, message.size() - pos);
+            encodedSize += encoder.encode(message.data() + pos, piece, encoded.data() + encodedSize, encoded.size() - encodedSize);
+            pos += piece;
+        }
+        encodedSize += encoder.finish(encoded.data() + encodedSize, encoded.size() - encodedSize);
+        encoded.resize(encodedSize);
+        check(result, std::string(encoded.begin(), encoded.end()) == reference.encode(message.data(), message.size(), 0, 1),
+            name + ": Encoder::encode() differs from the reference");
+
+        // The lookup table is sized by the length limit the file claims, which doesn't have to be the longest code.
+        huffman::Decoder decoder(lengths, 1 + random() % huffman::MAX_WRITER_CODE_LENGTH, message.size());
+        huffman::CompactDecoder compact(lengths);
+
+        std::vector<uint8_t> decoded(message.size());
+        size_t decodedSize = 0;
+        size_t pos = 0;
+        do
+        {
+            size_t piece = std::min<size_t>(1 + random() % 64, encodedSize - pos);
+            decodedSize += decoder.decode(encoded.data() + pos, piece, decoded.data() + decodedSize, decoded.size() - decodedSize);
+            pos += piece;
+        } while (pos < encodedSize && !decoder.done());
+        check(result, decodedSize == message.size() && decoded == message, name + ": Decoder::decode() differs from the message");
+
+        unsigned int streams = 1 + random() % huffman::MAX_STREAMS;
+        std::vector<uint8_t> block(encoder.interleavedBound(message.size(), streams));
+        block.resize(encoder.encodeInterleaved(message.data(), message.size(), streams, block.data(), block.size()));
+        check(result, std::string(block.begin(), block.end()) == reference.encodeInterleaved(message.data(), message.size(), streams),
+            name + ": Encoder::encodeInterleaved() differs from the reference");
+
+        compareDecoders(result, reference, decoder, compact, block, streams, message.size(), name);
+        compareDecoders(result, reference, decoder, compact, corrupt(block, streams, random), streams, message.size(), name + ", corrupt");
+
+        // Random bits run into the codes an incomplete table doesn't have.
+        std::vector<uint8_t> noise(256);
+        for (auto& byte : noise)
+            byte = static_cast<uint8_t>(random());
+        compareDecoders(result, reference, decoder, compact, noise, streams, noise.size() * 2, name + ", random input");
+    }
+
+    return result;
+}
+
+void printVerifyHeader()
+{
+    std::cout << std::left << std::setw(14) << "corpus" << std::right
+        << std::setw(12) << "size" << std::setw(9) << "chunk" << std::setw(10) << "checks" << std::setw(8) << "failed" << "\n";
+}
+
+void printVerifyRow(const VerifyResult& result)
+{
+    std::cout << std::left << std::setw(14) << result.name << std::right
+        << std::setw(12) << result.size << std::setw(9) << result.chunkSize << std::setw(10) << result.checks << std::setw(8) << result.failed
+        << (result.failed == 0 ? "" : "  FAILED") << "\n";
+    for (const std::string& failure : result.failures)
+        std::cout << "    " << failure << "\n";
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <cstring>
+#include "benchmark.h"
+
+/*
+Differential checks for --verify. Every fast path of the library is run against a reference that codes one bit at a time and
+shares no code with huffman.cpp, and has to come out byte for byte the same:
+	encode		Encoder::encode() and encodeInterleaved(), for 1 to MAX_STREAMS streams
+	decode		Decoder::decode() in chunks, decodeBounded() and decodeInterleaved(), and the same for CompactDecoder
+	corrupt		copies of every block with bits flipped, cut short or with a broken size table. Each decoder has to decode
+				exactly what the reference does before it gives up, and nothing may be written past the end of the output
+	tables		random code lengths, complete, incomplete and invalid ones, with codes up to MAX_WRITER_CODE_LENGTH bits
+
+The random parts start from a fixed seed, so a failure shows up again on the next run. Build with -fsanitize=address,undefined
+to have out of bounds reads of the corrupt blocks caught as well.
+*/
+
+// Everything checked for one corpus at one chunk size, or for the random tables.
+struct VerifyResult
+{
+    std::string name;
+    size_t size;
+    size_t chunkSize;
+    uint64_t checks;
+    uint64_t failed;
+    // The first few failures, one line each.
+    std::vector<std::string> failures;
+};
+
+// Runs the encode, decode and corrupt checks on corpus, coded in chunkSize pieces and blocks.
+VerifyResult verifyCorpus(const Corpus& corpus, size_t chunkSize, uint32_t seed);
+
+// Runs the table checks on count random code length tables.
+VerifyResult verifyRandomTables(unsigned int count, uint32_t seed);
+
+// Output of the results, one line per corpus and chunk size followed by its failures.
+void printVerifyHeader();
+void printVerifyRow(const VerifyResult& result);
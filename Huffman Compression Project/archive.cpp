@@ -0,0 +1,834 @@
+#include "archive.h"
+#include <set>
+#include <iomanip>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <cerrno>
+#endif
+
+/*
+Archive format:
+
+offset	bytes	description
+0		4		archiveSig
+4		2		version
+6		1		checksum type, see Checksum::Type
+7		1		flags (f), ARCHIVE_ values combined
+8		1		maximum code length
+9		...		the members in the order of the directory. Each is padded to a whole byte. Without ARCHIVE_SHARED_TABLE a member is
+				its code lengths followed by its stream, the same as a block (see encodeBlock). With it, only the stream.
+d		...		the directory
+end-12	8		offset of the directory (d), 4 bytes at end-8 in v2.4
+end-4	4		archiveSig
+
+Directory format:
+
+offset	bytes	description
+0		...		code lengths (see packCodeLengths), only when f has ARCHIVE_SHARED_TABLE
+...		v		number of members (m)
+...		...		m entries of:
+				2		name length (n)
+				n		name
+				v		offset of the member from the start of the archive
+				v		original size
+				v		compressed size
+				k		checksum of the original data, k is Checksum::size() of the type
+
+v is a varint (see writeVarint). In v2.4 the count and the three sizes were 4 byte integers.
+
+Empty members have no data at all.
+*/
+
+namespace
+{
+    // The shortest directory entry there can be: an empty name, the three sizes and no checksum.
+    constexpr unsigned int MIN_ENTRY_SIZE = 2 + 1 + 1 + 1;
+
+    // Big endian, like writeInt() and readInt().
+    void writeShort(std::ostream& output, uint16_t num)
+    {
+        output.put(static_cast<char>(num >> 8));
+        output.put(static_cast<char>(num));
+    }
+
+    uint16_t readShort(std::istream& input)
+    {
+        uint16_t high = static_cast<uint8_t>(input.get());
+        uint16_t low = static_cast<uint8_t>(input.get());
+        return static_cast<uint16_t>((high << 8) | low);
+    }
+
+    // Maps the file if possible, otherwise reads it into buffer. data and size point at its contents either way.
+    bool readMember(const std::string& filename, bool useMmap, MappedFile& mapped, std::string& buffer, const char*& data, size_t& size)
+    {
+        if (useMmap && mapped.open(filename))
+        {
+            data = mapped.data();
+            size = mapped.size();
+            return true;
+        }
+
+        std::ifstream input(filename, std::ios::binary);
+        if (!input.good())
+            return false;
+
+        input.seekg(0, input.end);
+        buffer.resize(static_cast<size_t>(input.tellg()));
+        input.seekg(0, input.beg);
+        input.read(&buffer[0], buffer.size());
+
+        data = buffer.data();
+        size = buffer.size();
+        return input.good();
+    }
+
+    // What a worker hands back for one member. ok is false if the file couldn't be read.
+    struct EncodedMember
+    {
+        Block block;
+        size_t size;
+        bool ok;
+    };
+
+    // A shared encoder already has its codes. Otherwise the member gets its own, stored in front of its stream.
+    EncodedMember encodeMember(const std::string& filename, const huffman::Encoder* shared, unsigned int maxCodeLength, Checksum::Type checksumType, bool useMmap)
+    {
+        EncodedMember member;
+        MappedFile mapped;
+        std::string buffer;
+        const char* data = nullptr;
+        member.size = 0;
+        member.ok = readMember(filename, useMmap, mapped, buffer, data, member.size);
+        if (!member.ok)
+            return member;
+
+        if (member.size == 0)
+        {
+            member.block.checksum = Checksum::of(checksumType, nullptr, 0);
+        }
+        else if (shared == nullptr)
+        {
+            member.block = encodeBlock(data, member.size, maxCodeLength, checksumType);
+        }
+        else
+        {
+            // Every member starts from the shared encoder as it was built so no bits are carried over from another member.
+            huffman::Encoder encoder = *shared;
+            std::string& block = member.block.data;
+            block.resize(encoder.encodeBound(member.size));
+            uint8_t* out = reinterpret_cast<uint8_t*>(&block[0]);
+            size_t written = encoder.encode(reinterpret_cast<const uint8_t*>(data), member.size, out, block.size());
+            written += encoder.finish(out + written, block.size() - written);
+            block.resize(written);
+            member.block.checksum = Checksum::of(checksumType, data, member.size);
+        }
+        return member;
+    }
+
+    // True if the member is name itself or inside the directory name.
+    bool memberMatches(const std::string& member, const std::string& name)
+    {
+        return member == name || (member.size() > name.size() && member.compare(0, name.size(), name) == 0 && member[name.size()] == '/');
+    }
+
+#ifdef _WIN32
+    bool makeDirectory(const std::string& path)
+    {
+        return CreateDirectoryA(path.c_str(), nullptr) || GetLastError() == ERROR_ALREADY_EXISTS;
+    }
+#else
+    bool makeDirectory(const std::string& path)
+    {
+        return mkdir(path.c_str(), 0777) == 0 || errno == EEXIST;
+    }
+#endif
+}
+
+bool compressArchive(const std::vector<std::string>& inputs, const std::string& archiveName, const Options& options)
+{
+    Stats stats(options.stats, "archive");
+
+    // False once a file was left out of the archive.
+    bool complete = true;
+
+    // The files to compress and the names they are stored under.
+    std::vector<std::string> files;
+    std::vector<std::string> names;
+    {
+        Stats::Timer timer(stats, Stats::Phase::Read);
+        std::set<std::string> seen;
+
+        auto addMember = [&](const std::string& file, const std::string& name)
+        {
+            // The archive can be written inside a directory that is being archived.
+            if (file == archiveName)
+                return;
+
+            if (name.size() > UINT16_MAX || !seen.insert(name).second)
+            {
+                std::cerr << "ERROR: \"" << file << "\" was skipped, its name is too long or already in the archive.\n";
+                complete = false;
+                return;
+            }
+            files.push_back(file);
+            names.push_back(name);
+        };
+
+        for (std::string input : inputs)
+        {
+            if (input == "-")
+            {
+                std::cerr << "ERROR: stdin can't be added to an archive.\n";
+                return false;
+            }
+
+            // Without the trailing slashes the directory's own name is the last part of the path.
+            while (input.size() > 1 && (input.back() == '/' || input.back() == '\\'))
+                input.pop_back();
+
+            if (!isDirectory(input))
+            {
+                addMember(input, removePath(input));
+                continue;
+            }
+
+            // Directories are stored under their own name, except for "." and the like, whose contents are stored as they are.
+            std::string base = removePath(input);
+            std::string prefix = base.empty() || base == "." || base == ".." ? "" : base + "/";
+
+            std::vector<std::string> found;
+            listDirectory(input, found);
+            for (auto& file : found)
+            {
+                addMember(file, prefix + file.substr(input.size() + 1));
+            }
+        }
+    }
+
+    std::ofstream output(archiveName, std::ios::binary);
+    if (!output.good())
+    {
+        std::cerr << "ERROR: output file failed to create.\n";
+        return false;
+    }
+
+    ArchiveIndex index;
+    index.fileVersion = curFileVersion;
+    index.checksumType = options.checksum;
+    index.flags = options.sharedTable ? ARCHIVE_SHARED_TABLE : 0;
+    index.maxCodeLength = huffman::MAX_CODE_LENGTH;
+
+    ThreadPool pool(options.threads);
+    bool useMmap = options.useMmap;
+
+    // A shared table needs every member counted before any of them can be encoded, so the members are read twice.
+    std::unique_ptr<huffman::Encoder> shared;
+    if (options.sharedTable)
+    {
+        huffman::Histogram histogram;
+        std::deque<std::future<huffman::Histogram>> pending;
+        size_t next = 0;
+
+        for (size_t counted = 0; counted < files.size(); counted++)
+        {
+            while (next < files.size() && pending.size() < 2 * pool.size())
+            {
+                const std::string& file = files[next++];
+                pending.push_back(pool.submit([&file, useMmap]()
+                    {
+                        huffman::Histogram counts;
+                        MappedFile mapped;
+                        std::string buffer;
+                        const char* data = nullptr;
+                        size_t size = 0;
+                        if (readMember(file, useMmap, mapped, buffer, data, size))
+                            counts.add(data, size);
+                        return counts;
+                    }));
+            }
+
+            Stats::Timer timer(stats, Stats::Phase::Histogram);
+            histogram.merge(pending.front().get());
+            pending.pop_front();
+        }
+
+        Stats::Timer timer(stats, Stats::Phase::Tree);
+        shared.reset(new huffman::Encoder());
+        shared->buildFreqTable(histogram);
+        shared->buildEncodingTree(index.maxCodeLength);
+        index.sharedLengths = shared->codeLengths();
+    }
+
+    {
+        Stats::Timer timer(stats, Stats::Phase::Header);
+        output.write(archiveSig.data(), archiveSig.size());
+        output.put(index.fileVersion.major);
+        output.put(index.fileVersion.minor);
+        output.put(static_cast<char>(index.checksumType));
+        output.put(index.flags);
+        output.put(index.maxCodeLength);
+    }
+
+    Progress progress(0, options.progress, std::cout);
+
+    // Members are encoded on the pool and written in order, the same way compressBlocks() handles blocks.
+    std::deque<std::future<EncodedMember>> pending;
+    const huffman::Encoder* sharedEncoder = shared.get();
+    Checksum::Type checksumType = index.checksumType;
+    unsigned int maxCodeLength = index.maxCodeLength;
+    uint64_t offset = ARCHIVE_HEADER_SIZE;
+    size_t next = 0;
+
+    for (size_t written = 0; written < files.size(); written++)
+    {
+        while (next < files.size() && pending.size() < 2 * pool.size())
+        {
+            const std::string& file = files[next++];
+            pending.push_back(pool.submit([&file, sharedEncoder, maxCodeLength, checksumType, useMmap, &progress]()
+                {
+                    EncodedMember member = encodeMember(file, sharedEncoder, maxCodeLength, checksumType, useMmap);
+                    progress.add(member.size);
+                    return member;
+                }));
+        }
+
+        EncodedMember member;
+        {
+            Stats::Timer timer(stats, Stats::Phase::Encode);
+            member = pending.front().get();
+            timer.bytes(member.size, member.block.data.size());
+        }
+        pending.pop_front();
+
+        if (!member.ok)
+        {
+            std::cerr << "ERROR: File \"" << files[written] << "\" was not able to be read.\n";
+            complete = false;
+            continue;
+        }
+
+        ArchiveEntry entry;
+        entry.name = names[written];
+        entry.offset = offset;
+        entry.size = member.size;
+        entry.compressedSize = member.block.data.size();
+        entry.checksum = member.block.checksum;
+        index.entries.push_back(std::move(entry));
+
+        Stats::Timer timer(stats, Stats::Phase::Write);
+        timer.bytes(member.block.data.size(), member.block.data.size());
+        output.write(member.block.data.data(), member.block.data.size());
+        offset += member.block.data.size();
+    }
+
+    Stats::Timer timer(stats, Stats::Phase::Header);
+    uint64_t directoryOffset = offset;
+    if (index.flags & ARCHIVE_SHARED_TABLE)
+    {
+        std::string lengths = packCodeLengths(index.sharedLengths, index.maxCodeLength);
+        output.write(lengths.data(), lengths.size());
+    }
+
+    writeVarint(output, index.entries.size());
+    for (auto& entry : index.entries)
+    {
+        writeShort(output, static_cast<uint16_t>(entry.name.size()));
+        output.write(entry.name.data(), entry.name.size());
+        writeVarint(output, entry.offset);
+        writeVarint(output, entry.size);
+        writeVarint(output, entry.compressedSize);
+        output.write(entry.checksum.data(), entry.checksum.size());
+    }
+
+    // The signature goes last so an archive that was cut short is recognised as incomplete.
+    writeLong(output, directoryOffset);
+    output.write(archiveSig.data(), archiveSig.size());
+    output.flush();
+
+    progress.finish();
+    stats.print(std::cout, options.statsJson);
+
+    if (!output.good())
+    {
+        std::cerr << "ERROR: The archive could not be written.\n";
+        return false;
+    }
+    return complete;
+}
+
+bool extractArchive(const std::string& filename, const std::string& path, const Options& options)
+{
+    std::ifstream input(filename, std::ios::binary);
+    if (!input.good())
+    {
+        std::cerr << "ERROR: File \"" << filename << "\"was not able to be opened.\n";
+        return false;
+    }
+
+    Stats stats(options.stats, "extract");
+
+    ArchiveIndex index;
+    {
+        Stats::Timer timer(stats, Stats::Phase::Header);
+        if (!readArchiveIndex(input, index, std::cerr))
+            return false;
+    }
+
+    // Pick the members to extract. Every name given on the command line has to match at least one of them.
+    // Names that match nothing and members that are skipped count as failed, the same as members that don't decode.
+    unsigned int failed = 0;
+    std::vector<size_t> selected;
+    std::vector<bool> found(options.members.size(), false);
+    uint64_t total = 0;
+    for (size_t i = 0; i < index.entries.size(); i++)
+    {
+        const ArchiveEntry& entry = index.entries[i];
+        bool wanted = options.members.empty();
+        for (size_t m = 0; m < options.members.size(); m++)
+        {
+            if (memberMatches(entry.name, options.members[m]))
+            {
+                wanted = true;
+                found[m] = true;
+            }
+        }
+        if (!wanted)
+            continue;
+
+        if (!safeMemberName(entry.name))
+        {
+            std::cerr << "ERROR: \"" << entry.name << "\" was skipped, it would be written outside of the output path.\n";
+            failed++;
+            continue;
+        }
+        selected.push_back(i);
+        total += entry.size;
+    }
+
+    for (size_t m = 0; m < options.members.size(); m++)
+    {
+        if (!found[m])
+        {
+            std::cerr << "ERROR: \"" << options.members[m] << "\" is not in the archive.\n";
+            failed++;
+        }
+    }
+
+    // Members are read in place when the archive can be mapped. Otherwise only the selected members are read.
+    MappedFile mapped;
+    if (options.useMmap)
+    {
+        Stats::Timer timer(stats, Stats::Phase::Read);
+        mapped.open(filename);
+    }
+
+    // The codes of a shared table are only built once.
+    std::unique_ptr<huffman::Decoder> shared;
+    if ((index.flags & ARCHIVE_SHARED_TABLE) && !huffman::emptyCodeLengths(index.sharedLengths))
+    {
+        Stats::Timer timer(stats, Stats::Phase::Tree);
+        shared.reset(new huffman::Decoder(index.sharedLengths, index.maxCodeLength, 0));
+    }
+    const huffman::Decoder* sharedDecoder = shared.get();
+
+    Progress progress(total, options.progress, std::cout);
+    ThreadPool pool(options.threads);
+    std::deque<std::future<Block>> pending;
+    size_t next = 0;
+    size_t extracted = 0;
+
+    for (size_t written = 0; written < selected.size(); written++)
+    {
+        while (next < selected.size() && pending.size() < 2 * pool.size())
+        {
+            const ArchiveEntry& entry = index.entries[selected[next++]];
+
+            if (mapped.isOpen())
+            {
+                // readArchiveIndex() made sure every member lies inside the archive.
+                const char* member = mapped.data() + entry.offset;
+                pending.push_back(pool.submit([member, &entry, &index, sharedDecoder, &progress]()
+                    {
+                        Block decoded = decodeMember(member, entry.compressedSize, index, entry, sharedDecoder);
+                        progress.add(decoded.data.size());
+                        return decoded;
+                    }));
+            }
+            else
+            {
+                std::string member(static_cast<size_t>(entry.compressedSize), '\0');
+                {
+                    Stats::Timer timer(stats, Stats::Phase::Read);
+                    timer.bytes(member.size(), member.size());
+                    input.seekg(static_cast<std::streamoff>(entry.offset), input.beg);
+                    input.read(&member[0], member.size());
+                }
+
+                pending.push_back(pool.submit([member = std::move(member), &entry, &index, sharedDecoder, &progress]()
+                    {
+                        Block decoded = decodeMember(member.data(), member.size(), index, entry, sharedDecoder);
+                        progress.add(decoded.data.size());
+                        return decoded;
+                    }));
+            }
+        }
+
+        Block decoded;
+        {
+            Stats::Timer timer(stats, Stats::Phase::Decode);
+            decoded = pending.front().get();
+            timer.bytes(0, decoded.data.size());
+        }
+        pending.pop_front();
+
+        const ArchiveEntry& entry = index.entries[selected[written]];
+        std::string outputName = path + entry.name;
+
+        //  Check if the file already exists to prevent overwriting.
+        if (!options.overwrite)
+        {
+            std::ifstream tempStream(outputName);
+            if (tempStream.good())
+            {
+                std::cout << outputName << " already exists. Add -o to command line to overwrite.\n";
+                failed++;
+                continue;
+            }
+        }
+
+        Stats::Timer timer(stats, Stats::Phase::Write);
+        timer.bytes(decoded.data.size(), decoded.data.size());
+
+        std::ofstream output;
+        if (createParentDirectories(outputName))
+            output.open(outputName, std::ios::binary);
+        if (!output.good())
+        {
+            std::cerr << "ERROR: " << outputName << " failed to create.\n";
+            failed++;
+            continue;
+        }
+        output.write(decoded.data.data(), decoded.data.size());
+        output.close();
+        if (output.fail())
+        {
+            std::cerr << "ERROR: " << outputName << " could not be written.\n";
+            failed++;
+            std::remove(outputName.c_str());
+            continue;
+        }
+
+        // Confirm the checksum matches and delete the file if it doesn't.
+        if (decoded.checksum != entry.checksum)
+        {
+            std::cerr << "Corruption ERROR: " << entry.name << " does not match its checksum\n";
+            failed++;
+            if (!options.keep)
+                std::remove(outputName.c_str());
+            continue;
+        }
+        extracted++;
+    }
+
+    progress.finish();
+    stats.print(std::cout, options.statsJson);
+
+    if (failed == 0)
+        std::cout << extracted << " files extracted successfully.\n";
+    return failed == 0;
+}
+
+bool listArchive(const std::string& filename)
+{
+    std::ifstream input(filename, std::ios::binary);
+
+    ArchiveIndex index;
+    if (!readArchiveIndex(input, index, std::cerr))
+        return false;
+
+    uint64_t totalSize = 0;
+    uint64_t totalCompressed = 0;
+    for (auto& entry : index.entries)
+    {
+        totalSize += entry.size;
+        totalCompressed += entry.compressedSize;
+    }
+
+    std::cout << "Huffman Compression version: " << static_cast<unsigned int>(index.fileVersion.major) << "." << static_cast<unsigned int>(index.fileVersion.minor) << "\n"
+        << "Archive members:             " << index.entries.size() << "\n"
+        << "Original size:               " << (float)totalSize / 1024 << " KB" << "\n"
+        << "Compressed size:             " << (float)totalCompressed / 1024 << " KB" << "\n"
+        << "Shared code table:           " << (index.flags & ARCHIVE_SHARED_TABLE ? "yes" : "no") << "\n"
+        << "Checksum:                    " << Checksum::name(index.checksumType) << "\n\n";
+
+    std::cout << std::setw(12) << "size" << std::setw(12) << "compressed" << "  " << std::left << std::setw(std::max<int>(9, Checksum::size(index.checksumType))) << "checksum" << "  name\n";
+    for (auto& entry : index.entries)
+    {
+        std::cout << std::right << std::setw(12) << entry.size << std::setw(12) << entry.compressedSize << "  "
+            << std::left << std::setw(std::max<int>(9, Checksum::size(index.checksumType))) << entry.checksum << "  " << entry.name << "\n";
+    }
+    return true;
+}
+
+Block decodeMember(const char* data, size_t size, const ArchiveIndex& index, const ArchiveEntry& entry, const huffman::Decoder* shared)
+{
+    if (entry.size == 0)
+    {
+        Block block;
+        block.checksum = Checksum::of(index.checksumType, nullptr, 0);
+        return block;
+    }
+
+    if (!(index.flags & ARCHIVE_SHARED_TABLE))
+        return decodeBlock(data, size, index.maxCodeLength, entry.size, index.checksumType);
+
+    // Same as decodeBlock(), a table without any codes leaves the member empty for the checksum to catch.
+    // Both sizes are known, so the member is decoded in one bounded pass. That doesn't change the decoder, the workers share it.
+    Block block;
+    if (shared != nullptr)
+    {
+        block.data.resize(static_cast<size_t>(entry.size));
+        size_t written = shared->decodeBounded(reinterpret_cast<const uint8_t*>(data), size, reinterpret_cast<uint8_t*>(&block.data[0]), block.data.size());
+        block.data.resize(written);
+    }
+    block.checksum = Checksum::of(index.checksumType, block.data.data(), block.data.size());
+    return block;
+}
+
+bool readArchiveIndex(std::istream& input, ArchiveIndex& index, std::ostream& errors)
+{
+    input.seekg(0, input.end);
+    uint64_t fileSize = static_cast<uint64_t>(input.tellg());
+    input.seekg(0, input.beg);
+
+    std::string signature(archiveSig.size(), '\0');
+    input.read(&signature[0], signature.size());
+    if (!input.good() || signature != archiveSig || fileSize < ARCHIVE_HEADER_SIZE + LEGACY_ARCHIVE_FOOTER_SIZE)
+    {
+        errors << "ERROR: Invalid archive.\n";
+        return false;
+    }
+
+    index.fileVersion.major = input.get();
+    index.fileVersion.minor = input.get();
+    if (!supportedVersion(index.fileVersion) || index.fileVersion < FileVersion{ 2,4 })
+    {
+        errors << "ERROR: Invalid file version.\n";
+        return false;
+    }
+
+    index.checksumType = static_cast<Checksum::Type>(input.get());
+    if (Checksum::name(index.checksumType) == nullptr)
+    {
+        errors << "ERROR: Unknown checksum type.\n";
+        return false;
+    }
+    index.flags = input.get();
+    index.maxCodeLength = input.get();
+
+    // The directory is found through the footer.
+    bool wide = index.fileVersion >= FileVersion{ 2,5 };
+    uint64_t footerSize = wide ? ARCHIVE_FOOTER_SIZE : LEGACY_ARCHIVE_FOOTER_SIZE;
+    if (fileSize < ARCHIVE_HEADER_SIZE + footerSize)
+    {
+        errors << "ERROR: Invalid archive.\n";
+        return false;
+    }
+
+    input.seekg(fileSize - footerSize, input.beg);
+    uint64_t directoryOffset = wide ? readLong(input) : readInt(input);
+    input.read(&signature[0], signature.size());
+    if (!input.good() || signature != archiveSig)
+    {
+        errors << "ERROR: Archive is incomplete, its directory is missing.\n";
+        return false;
+    }
+
+    uint64_t directoryEnd = fileSize - footerSize;
+    if (directoryOffset < ARCHIVE_HEADER_SIZE || directoryOffset > directoryEnd)
+    {
+        errors << "ERROR: Archive directory is corrupt.\n";
+        return false;
+    }
+
+    input.seekg(static_cast<std::streamoff>(directoryOffset), input.beg);
+    if (index.flags & ARCHIVE_SHARED_TABLE)
+    {
+        // The shared lengths are empty if every member was stored, otherwise they have to make a prefix code.
+        readCodeLengths(input, index.sharedLengths);
+        if (!huffman::emptyCodeLengths(index.sharedLengths) && !huffman::validCodeLengths(index.sharedLengths))
+        {
+            errors << "ERROR: Archive directory is corrupt.\n";
+            return false;
+        }
+    }
+
+    // A count that couldn't fit in the directory would only make the vector below huge.
+    uint64_t count = readSize(input, index.fileVersion);
+    if (!input.good() || count > (directoryEnd - directoryOffset) / MIN_ENTRY_SIZE)
+    {
+        errors << "ERROR: Archive directory is corrupt.\n";
+        return false;
+    }
+
+    size_t checksumSize = Checksum::size(index.checksumType);
+    index.entries.resize(static_cast<size_t>(count));
+    for (auto& entry : index.entries)
+    {
+        entry.name.resize(readShort(input));
+        input.read(&entry.name[0], entry.name.size());
+        entry.offset = readSize(input, index.fileVersion);
+        entry.size = readSize(input, index.fileVersion);
+        entry.compressedSize = readSize(input, index.fileVersion);
+        entry.checksum.resize(checksumSize);
+        input.read(&entry.checksum[0], checksumSize);
+
+        // Every member has to lie between the header and the directory.
+        if (!input.good() || entry.offset < ARCHIVE_HEADER_SIZE || entry.offset > directoryOffset || entry.compressedSize > directoryOffset - entry.offset)
+        {
+            errors << "ERROR: Archive directory is corrupt.\n";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool isArchive(const std::string& filename)
+{
+    if (filename == "-")
+        return false;
+
+    std::ifstream input(filename, std::ios::binary);
+    std::string signature(archiveSig.size(), '\0');
+    input.read(&signature[0], signature.size());
+    return input.good() && signature == archiveSig;
+}
+
+#ifdef _WIN32
+
+bool isDirectory(const std::string& path)
+{
+    DWORD attributes = GetFileAttributesA(path.c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+void listDirectory(const std::string& directory, std::vector<std::string>& files)
+{
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((directory + "\\*").c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE)
+        return;
+
+    // FindNextFile already returns names in order on NTFS, but not on every file system.
+    std::vector<std::pair<std::string, bool>> entries;
+    do
+    {
+        std::string name = data.cFileName;
+        if (name == "." || name == "..")
+            continue;
+
+        // Junctions and directory links are skipped, they can point back up the tree.
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            if (!(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+                entries.emplace_back(name, true);
+        }
+        else
+        {
+            entries.emplace_back(name, false);
+        }
+    } while (FindNextFileA(find, &data));
+    FindClose(find);
+
+    std::sort(entries.begin(), entries.end());
+    for (auto& entry : entries)
+    {
+        std::string path = directory + "/" + entry.first;
+        if (entry.second)
+            listDirectory(path, files);
+        else
+            files.push_back(path);
+    }
+}
+
+#else
+
+bool isDirectory(const std::string& path)
+{
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+void listDirectory(const std::string& directory, std::vector<std::string>& files)
+{
+    DIR* handle = opendir(directory.c_str());
+    if (handle == nullptr)
+        return;
+
+    // readdir() returns names in no particular order. Sorting them makes the archive the same every time.
+    std::vector<std::string> names;
+    while (dirent* entry = readdir(handle))
+    {
+        std::string name = entry->d_name;
+        if (name != "." && name != "..")
+            names.push_back(name);
+    }
+    closedir(handle);
+
+    std::sort(names.begin(), names.end());
+    for (auto& name : names)
+    {
+        std::string path = directory + "/" + name;
+
+        // Links to directories aren't followed, they can point back up the tree. Pipes and devices are skipped,
+        // only regular files and links to them are archived.
+        struct stat info;
+        if (lstat(path.c_str(), &info) != 0)
+            continue;
+
+        if (S_ISDIR(info.st_mode))
+            listDirectory(path, files);
+        else if (S_ISREG(info.st_mode) || (S_ISLNK(info.st_mode) && stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode)))
+            files.push_back(path);
+    }
+}
+
+#endif
+
+bool createParentDirectories(const std::string& filename)
+{
+    for (size_t pos = filename.find('/', 1); pos != std::string::npos; pos = filename.find('/', pos + 1))
+    {
+        std::string directory = filename.substr(0, pos);
+        if (!isDirectory(directory) && !makeDirectory(directory))
+            return false;
+    }
+    return true;
+}
+
+bool safeMemberName(const std::string& name)
+{
+    if (name.empty() || name[0] == '/' || name[0] == '\\' || name.find(':') != std::string::npos)
+        return false;
+
+    // Check every part of the path, split on both separators as either works on Windows.
+    size_t start = 0;
+    while (start <= name.size())
+    {
+        size_t end = name.find_first_of("/\\", start);
+        if (end == std::string::npos)
+            end = name.size();
+
+        if (name.compare(start, end - start, "..") == 0)
+            return false;
+        start = end + 1;
+    }
+    return true;
+}
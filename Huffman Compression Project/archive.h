@@ -0,0 +1,101 @@
+#pragma once
+#include "main.h"
+
+/*
+Archives: many files and directories compressed into one .huf file.
+
+Every member is compressed on its own and padded to a whole byte, so any one of them can be decoded without the others.
+The central directory at the end of the archive lists the name, offset, sizes and checksum of every member, so listing an
+archive only reads the directory and extracting one member only reads that member.
+
+Small files spend a large part of their compressed size on their code lengths. With a shared table the code lengths are
+built once from every member together and stored in the directory instead, and the members are only their streams.
+*/
+
+// Written at the start and again at the very end of an archive. The second copy is missing if the archive wasn't finished.
+const std::string archiveSig = "ANHA";
+
+// Archive flags.
+// The members share one table of code lengths, stored in the directory.
+constexpr uint8_t ARCHIVE_SHARED_TABLE = 1 << 0;
+
+// Size of the start of the archive: signature, version, checksum type, flags and maximum code length.
+constexpr unsigned int ARCHIVE_HEADER_SIZE = 4 + 2 + 1 + 1 + 1;
+
+// Size of the end of the archive: the offset of the directory and the signature. The offset was 4 bytes in v2.4.
+constexpr unsigned int ARCHIVE_FOOTER_SIZE = 8 + 4;
+constexpr unsigned int LEGACY_ARCHIVE_FOOTER_SIZE = 4 + 4;
+
+struct ArchiveEntry
+{
+    // Path of the member inside the archive. Directories are separated by "/".
+    std::string name;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t compressedSize;
+    std::string checksum;
+
+    ArchiveEntry()
+        : name("")
+        , offset(0)
+        , size(0)
+        , compressedSize(0)
+        , checksum("")
+    { }
+};
+
+struct ArchiveIndex
+{
+    FileVersion fileVersion;
+    Checksum::Type checksumType;
+    uint8_t flags;
+    unsigned int maxCodeLength;
+
+    // Only used with ARCHIVE_SHARED_TABLE.
+    lengthTable sharedLengths;
+
+    std::vector<ArchiveEntry> entries;
+
+    ArchiveIndex()
+        : fileVersion{ 0, 0 }
+        , checksumType(Checksum::Type::None)
+        , flags(0)
+        , maxCodeLength(0)
+        , sharedLengths{ }
+        , entries{ }
+    { }
+};
+
+// Compresses every file and, recursively, every directory in inputs into the archive archiveName.
+// Directories keep their name and structure inside the archive, files are stored under their name alone.
+// Returns false if the archive wasn't written or a file was left out of it.
+bool compressArchive(const std::vector<std::string>& inputs, const std::string& archiveName, const Options& options);
+
+// Extracts the members of an archive to path. Only the members named in options.members are extracted if there are any.
+// Naming a directory extracts everything in it. Returns false if any member wasn't extracted, or a name matched none of them.
+bool extractArchive(const std::string& filename, const std::string& path, const Options& options);
+
+// Prints the directory of an archive. None of the members are read. Returns false if the directory can't be read.
+bool listArchive(const std::string& filename);
+
+// Decodes one member from its compressed bytes. shared is the decoder for the shared table, built once for the whole archive.
+// nullptr if there is none. The block's checksum is left for the caller to compare against the entry's.
+Block decodeMember(const char* data, size_t size, const ArchiveIndex& index, const ArchiveEntry& entry, const huffman::Decoder* shared);
+
+// Reads the header and the directory. Prints an error to errors and returns false if the archive is broken or incomplete.
+bool readArchiveIndex(std::istream& input, ArchiveIndex& index, std::ostream& errors);
+
+// True if the file starts with the archive signature.
+bool isArchive(const std::string& filename);
+
+// True if path names a directory.
+bool isDirectory(const std::string& path);
+
+// Adds the path of every file under directory, sorted by name, to files. Subdirectories are walked as well.
+void listDirectory(const std::string& directory, std::vector<std::string>& files);
+
+// Makes sure every directory on the way to filename exists.
+bool createParentDirectories(const std::string& filename);
+
+// False for names that would be written outside the output path: absolute paths, drive letters and ".." components.
+bool safeMemberName(const std::string& name);
@@ -0,0 +1,145 @@
+#include "batch.h"
+#include "archive.h"
+
+namespace
+{
+    struct BatchResult
+    {
+        bool succeeded;
+        // Everything the file printed while it ran.
+        std::string messages;
+    };
+
+    // The directory part of filename, ending in a slash. Empty if it has none.
+    std::string directoryOf(const std::string& filename)
+    {
+        return filename.substr(0, filename.size() - removePath(filename).size());
+    }
+
+    bool isHufFile(const std::string& filename)
+    {
+        const std::string ext = ".huf";
+        return filename.size() > ext.size() && filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0;
+    }
+
+    // Runs on a worker thread. Whatever goes wrong only fails this file. Everything the file prints goes to its own stream,
+    // std::cout and std::cerr are shared with every other thread, their formatting included.
+    BatchResult runFile(const BatchFile& file, bool decompressFlag, const Options& options)
+    {
+        BatchResult result = { false, "" };
+        std::ostringstream messages;
+        try
+        {
+            if (file.filename == "-")
+                messages << "ERROR: stdin can't be part of a batch.\n";
+            else if (isDirectory(file.filename))
+                messages << "ERROR: Directories are given with --recursive.\n";
+            else if (decompressFlag && isArchive(file.filename))
+                messages << "ERROR: Archives are extracted on their own with -d.\n";
+            else if (!createParentDirectories(file.path))
+                messages << "ERROR: Output directory " << file.path << " could not be created.\n";
+            else
+                result.succeeded = decompressFlag ? decompress(file.filename, file.path, options, messages, messages) : compress(file.filename, file.path, options, messages, messages);
+        }
+        catch (const std::exception& error)
+        {
+            messages << "ERROR: " << error.what() << "\n";
+            result.succeeded = false;
+        }
+        result.messages = messages.str();
+        return result;
+    }
+
+    // Prints the messages of a file under its result, indented, one line at a time.
+    void printMessages(std::ostream& output, const std::string& messages)
+    {
+        std::istringstream lines(messages);
+        std::string line;
+        while (std::getline(lines, line))
+        {
+            if (!line.empty())
+                output << "    " << line << "\n";
+        }
+    }
+}
+
+bool readBatchList(const std::string& listName, const std::string& path, std::vector<BatchFile>& files)
+{
+    std::ifstream list(listName);
+    if (!list.good())
+    {
+        std::cerr << "ERROR: File list \"" << listName << "\" was not able to be opened.\n";
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(list, line))
+    {
+        // Lists written on Windows end their lines in "\r\n".
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (!line.empty())
+            files.push_back({ line, path.empty() ? directoryOf(line) : path });
+    }
+    return true;
+}
+
+void listBatchDirectory(const std::string& directory, const std::string& path, bool decompressFlag, std::vector<BatchFile>& files)
+{
+    // listDirectory() adds its own slash between the directory and every name in it.
+    std::string root = directory;
+    while (root.size() > 1 && root.back() == '/')
+        root.pop_back();
+
+    std::vector<std::string> found;
+    listDirectory(root, found);
+    for (const std::string& filename : found)
+    {
+        if (isHufFile(filename) != decompressFlag)
+            continue;
+
+        std::string outputPath = directoryOf(filename);
+        if (!path.empty())
+            outputPath = path + directoryOf(filename.substr(root.size() + 1));
+        files.push_back({ filename, outputPath });
+    }
+}
+
+size_t runBatch(const std::vector<BatchFile>& files, bool decompressFlag, unsigned int threads, const Options& options)
+{
+    // The pool runs whole files, each on one thread. Progress bars of files running side by side would only garble each other.
+    Options fileOptions = options;
+    fileOptions.threads = 1;
+    fileOptions.progress = Progress::Format::None;
+
+    size_t failed = 0;
+    {
+        ThreadPool pool(threads);
+
+        // Only a few files per thread are queued at a time, so a list of millions doesn't hold millions of pending results.
+        const size_t window = static_cast<size_t>(pool.size()) * 4;
+        std::deque<std::future<BatchResult>> pending;
+        size_t submitted = 0;
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            for (; submitted < files.size() && submitted < i + window; submitted++)
+            {
+                const BatchFile& file = files[submitted];
+                pending.push_back(pool.submit([&file, decompressFlag, &fileOptions]() { return runFile(file, decompressFlag, fileOptions); }));
+            }
+
+            BatchResult result = pending.front().get();
+            pending.pop_front();
+            if (!result.succeeded)
+                failed++;
+
+            std::cout << (result.succeeded ? "ok      " : "FAILED  ") << files[i].filename << "\n";
+            if (!result.succeeded || options.stats)
+                printMessages(std::cout, result.messages);
+        }
+    }
+
+    std::cout << files.size() - failed << " of " << files.size() << " files " << (decompressFlag ? "decompressed" : "compressed") << ", "
+        << failed << " failed.\n";
+    return failed;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include "main.h"
+
+/*
+Batch mode: many files compressed or decompressed by one run of the program.
+
+Running the program once per file pays for starting a process and parsing the command line every time, which is most of the
+work for small files. A batch takes a list of files or a whole directory and runs the files side by side on a thread pool
+instead, each one exactly as it would be on its own. A file that fails is reported and the rest carry on.
+
+The messages a file prints are held back until it's done, then printed together with its result, so the output of files
+running at the same time doesn't mix. Results are printed in the order of the batch.
+*/
+
+struct BatchFile
+{
+    std::string filename;
+    // Directory the output is written to, ending in a slash. Empty for the current directory.
+    std::string path;
+};
+
+// Reads the files for --batch from listName, one per line. Blank lines are skipped. Outputs go to path, or next to their
+// input when path is empty. Prints an error and returns false if the list couldn't be read.
+bool readBatchList(const std::string& listName, const std::string& path, std::vector<BatchFile>& files);
+
+// Adds every file under directory for --recursive. When compressing, files that are already .huf files are left out, when
+// decompressing only they are taken. Outputs go to the same place under path as their input is under directory, or next to
+// their input when path is empty.
+void listBatchDirectory(const std::string& directory, const std::string& path, bool decompressFlag, std::vector<BatchFile>& files);
+
+// Compresses, or with decompressFlag decompresses, every file on threads threads, one file per thread. Prints the result of
+// every file and a summary. Returns the number of files that failed.
+size_t runBatch(const std::vector<BatchFile>& files, bool decompressFlag, unsigned int threads, const Options& options);
@@ -0,0 +1,189 @@
+#include "checksum.h"
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define HAS_SSE42_CRC 1
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE42
+#else
+#define TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#else
+#define HAS_SSE42_CRC 0
+#endif
+
+namespace
+{
+    // CRC32C (Castagnoli) polynomial, bit reversed.
+    constexpr uint32_t CRC32C_POLY = 0x82F63B78;
+
+    // Tables for slicing by 8: table[k][b] is the CRC of byte b followed by k zero bytes.
+    typedef std::array<std::array<uint32_t, 256>, 8> CrcTables;
+
+    CrcTables makeCrcTables()
+    {
+        CrcTables tables;
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+            tables[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            for (size_t k = 1; k < tables.size(); k++)
+                tables[k][i] = (tables[k - 1][i] >> 8) ^ tables[0][tables[k - 1][i] & 0xFF];
+        }
+        return tables;
+    }
+
+    uint32_t crc32cSoftware(uint32_t crc, const uint8_t* data, size_t size)
+    {
+        static const CrcTables tables = makeCrcTables();
+
+        // Eight bytes at a time, each through its own table. The bytes are put together little endian no matter the platform.
+        while (size >= 8)
+        {
+            uint32_t low = (data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24)) ^ crc;
+            uint32_t high = data[4] | (data[5] << 8) | (data[6] << 16) | (static_cast<uint32_t>(data[7]) << 24);
+            crc = tables[7][low & 0xFF] ^ tables[6][(low >> 8) & 0xFF] ^ tables[5][(low >> 16) & 0xFF] ^ tables[4][low >> 24]
+                ^ tables[3][high & 0xFF] ^ tables[2][(high >> 8) & 0xFF] ^ tables[1][(high >> 16) & 0xFF] ^ tables[0][high >> 24];
+            data += 8;
+            size -= 8;
+        }
+        while (size--)
+            crc = (crc >> 8) ^ tables[0][(crc ^ *data++) & 0xFF];
+
+        return crc;
+    }
+
+#if HAS_SSE42_CRC
+    TARGET_SSE42 uint32_t crc32cHardware(uint32_t crc, const uint8_t* data, size_t size)
+    {
+        uint64_t crc64 = crc;
+        while (size >= 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, data, sizeof(word));
+            crc64 = _mm_crc32_u64(crc64, word);
+            data += 8;
+            size -= 8;
+        }
+
+        crc = static_cast<uint32_t>(crc64);
+        while (size--)
+            crc = _mm_crc32_u8(crc, *data++);
+
+        return crc;
+    }
+
+    bool hasSse42()
+    {
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 20)) != 0;
+#else
+        return __builtin_cpu_supports("sse4.2");
+#endif
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t size)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+
+#if HAS_SSE42_CRC
+    static const bool hardware = hasSse42();
+    if (hardware)
+        return ~crc32cHardware(crc, bytes, size);
+#endif
+
+    return ~crc32cSoftware(crc, bytes, size);
+}
+
+Checksum::Checksum(Type type)
+    : m_type(type)
+    , m_crc(0)
+{ }
+
+void Checksum::add(const void* data, size_t size)
+{
+    switch (m_type)
+    {
+    case Type::MD5:
+        m_md5.add(data, size);
+        break;
+    case Type::CRC32C:
+        m_crc = crc32c(m_crc, data, size);
+        break;
+    default:
+        break;
+    }
+}
+
+std::string Checksum::getHash()
+{
+    switch (m_type)
+    {
+    case Type::MD5:
+        return m_md5.getHash();
+    case Type::CRC32C:
+    {
+        // Same hex digits MD5 uses, most significant first.
+        static const char digits[] = "0123456789abcdef";
+        std::string hash(8, '0');
+        for (int i = 0; i < 8; i++)
+            hash[i] = digits[(m_crc >> (28 - 4 * i)) & 0xF];
+        return hash;
+    }
+    default:
+        return std::string();
+    }
+}
+
+Checksum::Type Checksum::type() const
+{
+    return m_type;
+}
+
+size_t Checksum::size(Type type)
+{
+    switch (type)
+    {
+    case Type::MD5:
+        return 32;
+    case Type::CRC32C:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+const char* Checksum::name(Type type)
+{
+    switch (type)
+    {
+    case Type::None:
+        return "none";
+    case Type::MD5:
+        return "md5";
+    case Type::CRC32C:
+        return "crc32c";
+    default:
+        return nullptr;
+    }
+}
+
+std::string Checksum::of(Type type, const void* data, size_t size)
+{
+    Checksum checksum(type);
+    checksum.add(data, size);
+    return checksum.getHash();
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include "ThirdParty/md5.h"
+
+/*
+The checksums a file can be verified with.
+
+MD5 is what every file before v2.4 stores. CRC32C is the default since v2.4. On x86 processors with SSE4.2 it's computed
+with the crc32 instruction, which is many times faster than MD5 and much faster than the Huffman coding itself.
+Elsewhere it falls back to a table driven version that still beats MD5.
+
+Checksums are stored in the file as lowercase hex, like the MD5 hash always has been.
+*/
+
+class Checksum
+{
+public:
+    enum class Type : uint8_t
+    {
+        None = 0,
+        MD5 = 1,
+        CRC32C = 2
+    };
+
+    explicit Checksum(Type type);
+
+    // Adds data to the checksum. Can be called any number of times.
+    void add(const void* data, size_t size);
+
+    // The checksum of everything added so far, as it's stored in the file.
+    std::string getHash();
+
+    // getter method for m_type
+    Type type() const;
+
+    // The number of characters a checksum of this type takes up in the file.
+    static size_t size(Type type);
+
+    // The name used on the command line and by listContents(). nullptr for a type this program doesn't know.
+    static const char* name(Type type);
+
+    // The checksum of a single buffer.
+    static std::string of(Type type, const void* data, size_t size);
+
+private:
+    Type m_type;
+    MD5 m_md5;
+    uint32_t m_crc;
+};
+
+// Continues crc, the CRC32C of everything before data, over data. The result for no data at all is 0.
+uint32_t crc32c(uint32_t crc, const void* data, size_t size);
@@ -0,0 +1,250 @@
+#include "main.h"
+#include "archive.h"
+#include "tables.h"
+#include "batch.h"
+
+/*
+This program is a command line based Huffman compressor. It was created as a portfolio piece for the SMU Guildhall Fall 2022 application.
+It uses two external resources: md5.h (and its associated .cpp file) by Stephan Brumme https://create.stephan-brumme.com/ and CLI11, a command line parser https://github.com/CLIUtils/CLI11
+
+Commands:
+			Filename, or - to read stdin and write stdout
+-d			Decompress
+-o			Overwrite
+-p, --path	Path for output
+-k          Debug tool. Prevents the program from deleting unencoded files when the hash is incorrect
+-l          List the contents of a .huf file.
+-t, --threads       Compress in blocks on this many threads, or decompress blocks on this many threads
+--block-size        Compress in blocks of this many bytes
+--no-mmap           Read the input through a stream instead of mapping it
+--mem-limit         Largest unmapped input that is read into memory once instead of twice
+-q, --quiet         Don't show progress
+--progress          Progress format: bar or json
+--stats             Print the time and bytes of each phase when done
+--stats-json        Same as --stats, as one JSON object
+--checksum          Checksum to verify the file with: crc32c, md5 or none
+-a, --archive       Compress every file and directory given into this archive
+--shared-table      Build one code table for every member of the archive
+--member            Only extract this member, or the members in this directory, of an archive
+--seek-interval     Bytes between the seek points of a single stream file, 0 for none
+--range             Only decompress LENGTH bytes from OFFSET on, given as OFFSET:LENGTH
+--table             Compress with this built in code table instead of building one
+--table-file        Compress with the code table in this file, or decompress a file that was
+--streams           Split every block into this many interleaved streams
+--chunk-size        Size of the reads and writes of single stream files
+--split             Code blocks in parts wherever their statistics change
+--rle               Shorten runs of the same byte before coding
+--build-table       Build a code table file with this name from the files given
+--batch             Compress or decompress every file in this list, on threads
+--recursive         Compress or decompress every file under this directory, on threads
+
+*/
+
+int main(int argc, char** argv)
+{
+	// CLI app object that parses the command line.
+	CLI::App app{ "Huffman Compression algorithm" };
+
+	// Filename. Archives take any number of files and directories.
+	std::vector<std::string> filenames;
+	app.add_option("filename", filenames, "The name of the file to be compressed/decompressed. - reads stdin and writes stdout")->check(CLI::ExistingPath | CLI::IsMember({ "-" }));
+
+
+	// Path: -p, --path        Specify output file path
+	std::string path = "";
+	app.add_option("-p, --path", path, "Optional. Specifies path that new file will be written to")->check(CLI::ExistingPath);
+
+	// Settings passed on to compress() and decompress().
+	Options options;
+
+	// Flags
+	// Decompress: -d
+	bool decompressFlag = false;
+	app.add_flag("-d", decompressFlag, "Include to decompress");
+
+	// Overwrite: -o
+	app.add_flag("-o", options.overwrite, "Include to overwrite existing file");
+
+	// Keep file if faulty. Used for debug purposes
+	app.add_flag("-k", options.keep, "Include to prevent bad files from being deleted on hash checking");
+
+	// List: -l                Lists contents of .huf file header.
+	bool listFlag = false;
+	app.add_flag("-l, --list", listFlag, "Include to list the contents of decompressed file");
+
+	// Threads: -t, --threads     Compress independent blocks on this many threads.
+	CLI::Option* threadsOption = app.add_option("-t, --threads", options.threads, "Optional. Compresses the file in independent blocks on this many threads. Blocked files are decompressed on this many threads")->check(CLI::PositiveNumber);
+
+	// Block size: --block-size   Uncompressed size of each block, accepts units like 4M.
+	app.add_option("--block-size", options.blockSize, "Optional. Compresses the file in independent blocks of this size, e.g. 4M, less than 4G")->transform(CLI::AsSizeValue(false))->check(CLI::Range(static_cast<uint64_t>(0), MAX_BLOCK_SIZE));
+
+	// No memory mapping: --no-mmap  Always read the input through a stream.
+	bool noMmapFlag = false;
+	app.add_flag("--no-mmap", noMmapFlag, "Include to read the input through a stream instead of mapping it into memory");
+
+	// Memory limit: --mem-limit  Unmapped inputs up to this size are read once and kept in memory, accepts units like 512M.
+	app.add_option("--mem-limit", options.memLimit, "Optional. Unmapped inputs up to this size are read into memory once instead of twice, e.g. 512M. 0 always reads twice")->transform(CLI::AsSizeValue(false))->check(CLI::NonNegativeNumber);
+
+	// Quiet: -q, --quiet       Hide the progress output.
+	bool quietFlag = false;
+	app.add_flag("-q, --quiet", quietFlag, "Include to hide the progress output");
+
+	// Progress format: --progress  A bar for terminals, or one JSON object per line for logs.
+	std::string progressFormat = "bar";
+	app.add_option("--progress", progressFormat, "Optional. Progress output format, bar or json. json writes one line per second with the bytes processed and bytes/sec")->check(CLI::IsMember({ "bar", "json" }));
+
+	// Stats: --stats, --stats-json  Time and count every phase and print the results when done.
+	app.add_flag("--stats", options.stats, "Include to print the wall time, CPU time, calls and bytes of each phase when done");
+	app.add_flag("--stats-json", options.statsJson, "Include to print the stats as one line of JSON");
+
+	// Checksum: --checksum   crc32c is much faster than md5. Blocked files get a checksum for every block.
+	std::string checksumName = "crc32c";
+	app.add_option("--checksum", checksumName, "Optional. Checksum to verify the file with when it's decompressed: crc32c, md5 or none. Blocked files also get one for every block")->check(CLI::IsMember({ "crc32c", "md5", "none" }));
+
+	// Archive: -a, --archive   Name of the archive every file and directory is compressed into.
+	std::string archiveName = "";
+	app.add_option("-a, --archive", archiveName, "Optional. Compresses every file and directory given into one archive with this name");
+	app.add_flag("--shared-table", options.sharedTable, "Include to build one code table for every member of the archive. Best for many small, similar files");
+
+	// Member: --member   Extract only some members of an archive, can be given more than once.
+	// Each --member takes one name, so the archive's own name after it isn't taken for a member too.
+	app.add_option("--member", options.members, "Optional. Only extracts this member of an archive, or every member in this directory. Can be given more than once")->allow_extra_args(false);
+
+	// Seek interval: --seek-interval   Single stream files record where decoding can start every this many bytes.
+	app.add_option("--seek-interval", options.seekInterval, "Optional. Single stream files get a seek point every this many bytes so --range can start near it, e.g. 1M. 0 for none")->transform(CLI::AsSizeValue(false));
+
+	// Range: --range   Decompress part of a file, e.g. 1G:4M. Without the length everything from the offset on is decompressed.
+	std::string rangeText = "";
+	app.add_option("--range", rangeText, "Optional. Only decompresses LENGTH bytes from OFFSET on, given as OFFSET:LENGTH with units like 4M. LENGTH can be left out");
+
+	// Tables: --table, --table-file   Code with a prebuilt table, so small files skip the frequency pass and the code lengths.
+	app.add_option("--table", options.tableName, "Optional. Compresses with this built in code table instead of building one from the file")->check(CLI::IsMember(tableNames()));
+	app.add_option("--table-file", options.tableFile, "Optional. Compresses with the code table in this file. Needed again to decompress the file")->check(CLI::ExistingFile);
+
+	// Streams: --streams   Split every block into this many interleaved bitstreams, which decode side by side.
+	app.add_option("--streams", options.streams, "Optional. Splits every block into this many interleaved streams, up to 8, so it decompresses faster on one thread. Implies --block-size")->check(CLI::Range(1U, huffman::MAX_STREAMS));
+
+	// Chunk size: --chunk-size   Single stream files are read, coded and written in chunks of this size, on three threads.
+	app.add_option("--chunk-size", options.chunkSize, "Optional. Single stream files are read, coded and written in chunks of this size, each on its own thread, e.g. 1M")->transform(CLI::AsSizeValue(false))->check(CLI::PositiveNumber);
+
+	// Split: --split   Blocks are coded in parts wherever the byte statistics change, each part with its own code lengths.
+	app.add_flag("--split", options.split, "Include to code every block in parts wherever its statistics change, for files that mix different kinds of data. Implies --block-size");
+
+	// RLE: --rle   Runs of the same byte are shortened to a count before the blocks are coded, see rle.h.
+	app.add_flag("--rle", options.rle, "Include to shorten runs of the same byte before coding, for sparse or padded data with long runs. Implies --block-size");
+
+	// Build table: --build-table   Count the bytes of every file given and write the table they make.
+	std::string buildTableName = "";
+	app.add_option("--build-table", buildTableName, "Optional. Builds a code table file with this name from the files given, for --table-file");
+
+	// Batch: --batch, --recursive   Run many files in one go, -t of them at a time. Each file is reported on its own.
+	std::string batchList = "";
+	app.add_option("--batch", batchList, "Optional. Compresses, or with -d decompresses, every file in this list, one per line. -t of them run at once, every core by default")->check(CLI::ExistingFile);
+	std::string batchDirectory = "";
+	app.add_option("--recursive", batchDirectory, "Optional. Compresses every file under this directory, or with -d decompresses every .huf file under it. Runs like --batch")->check(CLI::ExistingDirectory);
+
+	// Macro that tells CLI to parse the command line.
+	CLI11_PARSE(app, argc, argv);
+
+	// Every command exits with 1 when it failed, after printing why, so scripts don't have to read the messages.
+
+	if (!buildTableName.empty())
+	{
+		CodeTable table;
+		if (!buildTable(filenames, removeExtension(removePath(buildTableName)), table) || !writeTableFile(path + buildTableName, table))
+			return 1;
+		std::cout << "Table " << std::hex << table.id << std::dec << " written to " << path + buildTableName << ".\n";
+		return 0;
+	}
+
+	if (!rangeText.empty())
+	{
+		if (!decompressFlag)
+		{
+			std::cerr << "ERROR: --range only works with -d.\n";
+			return 1;
+		}
+		if (!parseRange(rangeText, options.rangeOffset, options.rangeLength))
+		{
+			std::cerr << "ERROR: --range takes OFFSET:LENGTH, like 1G:4M.\n";
+			return 1;
+		}
+		options.range = true;
+	}
+
+	options.useMmap = !noMmapFlag;
+	options.stats = options.stats || options.statsJson;
+	if (checksumName == "md5")
+		options.checksum = Checksum::Type::MD5;
+	else if (checksumName == "none")
+		options.checksum = Checksum::Type::None;
+
+	if (quietFlag)
+		options.progress = Progress::Format::None;
+	else if (progressFormat == "json")
+		options.progress = Progress::Format::Json;
+
+	// Using more than one thread only helps if there are blocks to hand out. Interleaved streams and splitting also only work on blocks.
+	// Batches use their threads for whole files instead.
+	bool batch = !batchList.empty() || !batchDirectory.empty();
+	if (((options.threads > 1 && !batch) || options.streams > 1 || options.split || options.rle) && options.blockSize == 0 && !decompressFlag)
+		options.blockSize = DEFAULT_BLOCK_SIZE;
+
+	// path needs to end with a slash when a filename is appended to it
+	if (!path.empty())
+		pathEndSlash(path);
+
+	if (batch)
+	{
+		if (!filenames.empty() || listFlag || !archiveName.empty() || options.range)
+		{
+			std::cerr << "ERROR: --batch and --recursive take the place of the file names. They can't be used with -l, -a or --range.\n";
+			return 1;
+		}
+
+		std::vector<BatchFile> files;
+		if (!batchList.empty() && !readBatchList(batchList, path, files))
+			return 1;
+		if (!batchDirectory.empty())
+			listBatchDirectory(batchDirectory, path, decompressFlag, files);
+
+		// A batch has failed when any of its files did, the rest of them are still run.
+		unsigned int threads = threadsOption->count() != 0 ? options.threads : std::max(std::thread::hardware_concurrency(), 1U);
+		return runBatch(files, decompressFlag, threads, options) == 0 ? 0 : 1;
+	}
+
+	if (!archiveName.empty() && !listFlag && !decompressFlag)
+	{
+		return compressArchive(filenames, path + archiveName, options) ? 0 : 1;
+	}
+
+	// Everything else works on a single file.
+	if (filenames.size() != 1 || isDirectory(filenames[0]))
+	{
+		std::cerr << "ERROR: Give one file, or add -a to compress several files or a directory into an archive.\n";
+		return 1;
+	}
+	std::string filename = filenames[0];
+
+	bool succeeded;
+	if (listFlag)
+	{
+		if (isArchive(filename))
+			succeeded = listArchive(filename);
+		else
+			succeeded = listContents(filename);
+	}
+	else if (decompressFlag)
+	{
+		if (isArchive(filename))
+			succeeded = extractArchive(filename, path, options);
+		else
+			succeeded = decompress(filename, path, options, std::cout, std::cerr);
+	}
+	else
+	{
+		succeeded = compress(filename, path, options, std::cout, std::cerr);
+	}
+
+	return succeeded ? 0 : 1;
+}
@@ -1,12 +1,33 @@
 #include "huffman.h"
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
 
 namespace huffman
 {
+    // Anonymous namespace to hide these functions from the rest of the program. Only the classes below use them.
+    namespace
+    {
+        // Builds a Huffman tree from a frequency table. The Decoder needs it for v1.1 files, which store the frequency table.
+        std::shared_ptr<Node> buildTree(const std::map<uint8_t, uint32_t>& freqTable);
+        // Copies the tree of a TreeBuilder into linked nodes, starting at index.
+        std::shared_ptr<Node> linkNodes(const TreeBuilder& builder, unsigned int index);
+
+        // Assigns canonical codes from the code lengths. Codes are handed out in order of length, then byte value,
+        // so the lengths alone are enough for the Encoder and the Decoder to agree on every code.
+        std::map<uint8_t, bitVector> canonicalCodes(const lengthTable& codeLengths);
+        // Shortens the longest codes until none are longer than maxCodeLength, keeping the code complete.
+        // The most frequent byte values are given the shortest codes.
+        void limitLengths(lengthTable& codeLengths, const std::map<uint8_t, uint64_t>& freqTable, unsigned int maxCodeLength);
+        // Builds the tree the canonical codes describe. Needed by the Decoder for files that only store code lengths.
+        std::shared_ptr<Node> buildCanonicalTree(const lengthTable& codeLengths);
+    }
+
     Node::Node(std::shared_ptr<Node> _left, std::shared_ptr<Node> _right)
         : left(_left)
         , right(_right)
         , character(NOT_A_CHAR)
-        , freq(left->freq + right->freq)
+        , freq(static_cast<int>(static_cast<unsigned int>(left->freq) + static_cast<unsigned int>(right->freq)))
     { }
 
     Node::Node(int _character, int _freq)
@@ -16,241 +37,1335 @@ namespace huffman
         , freq(_freq)
     { }
 
+    Histogram::Histogram()
+        : m_counts{ }
+    { }
+
+    void Histogram::add(const char* data, size_t size)
+    {
+        // The tables below count in 32 bits, which keeps them small enough for the cache. Anything bigger than this is
+        // added a piece at a time so they can't overflow.
+        constexpr size_t MAX_PIECE = size_t(1) << 30;
+        while (size > MAX_PIECE)
+        {
+            add(data, MAX_PIECE);
+            data += MAX_PIECE;
+            size -= MAX_PIECE;
+        }
+
+        // Incrementing the same counter twice in a row has to wait for the first store to finish. Spreading the bytes
+        // over four tables lets runs of the same byte increment four different counters instead.
+        uint32_t counts[4][256] = { };
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+
+        // Load 8 bytes at a time and pick them apart with shifts. Byte order doesn't matter, each byte is counted once either way.
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, bytes + i, sizeof(word));
+
+            counts[0][word & 0xFF]++;
+            counts[1][(word >> 8) & 0xFF]++;
+            counts[2][(word >> 16) & 0xFF]++;
+            counts[3][(word >> 24) & 0xFF]++;
+            counts[0][(word >> 32) & 0xFF]++;
+            counts[1][(word >> 40) & 0xFF]++;
+            counts[2][(word >> 48) & 0xFF]++;
+            counts[3][(word >> 56) & 0xFF]++;
+        }
+        for (; i < size; i++)
+        {
+            counts[0][bytes[i]]++;
+        }
+
+        for (unsigned int character = 0; character < 256; character++)
+        {
+            m_counts[character] += counts[0][character] + counts[1][character] + counts[2][character] + counts[3][character];
+        }
+    }
+
+    void Histogram::merge(const Histogram& other)
+    {
+        for (unsigned int character = 0; character < 256; character++)
+        {
+            m_counts[character] += other.m_counts[character];
+        }
+    }
+
+    std::map<uint8_t, uint64_t> Histogram::freqTable() const
+    {
+        std::map<uint8_t, uint64_t> table;
+        for (unsigned int character = 0; character < 256; character++)
+        {
+            if (m_counts[character] != 0)
+                table[character] = m_counts[character];
+        }
+        return table;
+    }
+
+    const std::array<uint64_t, 256>& Histogram::counts() const
+    {
+        return m_counts;
+    }
+
+    TreeBuilder::TreeBuilder()
+        : m_nodeCount(0)
+        , m_leafCount(0)
+    { }
+
+    void TreeBuilder::build(const std::array<uint64_t, 256>& counts)
+    {
+        m_leafCount = 0;
+        for (unsigned int character = 0; character < 256; character++)
+        {
+            if (counts[character] != 0)
+                m_nodes[m_leafCount++] = { counts[character], 0, 0, static_cast<uint16_t>(character) };
+        }
+        buildBranches();
+    }
+
+    void TreeBuilder::build(const std::map<uint8_t, uint32_t>& freqTable)
+    {
+        m_leafCount = 0;
+        for (auto& entry : freqTable)
+        {
+            m_nodes[m_leafCount++] = { entry.second, 0, 0, entry.first };
+        }
+        buildBranches();
+    }
+
+    void TreeBuilder::buildBranches()
+    {
+        // Ties go to the lower byte value, so the tree only depends on the counts and not on the order they were given in.
+        std::sort(m_nodes.begin(), m_nodes.begin() + m_leafCount, [](const FlatNode& a, const FlatNode& b)
+            {
+                return a.freq != b.freq ? a.freq < b.freq : a.character < b.character;
+            });
+
+        // The fronts of the leaf queue and the branch queue. Branches are made in order of frequency, so the array after
+        // the leaves is already sorted. On a tie the leaf is taken first, which gives the same tree v1.1 built.
+        unsigned int nextLeaf = 0;
+        unsigned int nextBranch = m_leafCount;
+        m_nodeCount = m_leafCount;
+
+        auto popSmallest = [&]() -> uint16_t
+        {
+            if (nextLeaf < m_leafCount && (nextBranch == m_nodeCount || m_nodes[nextLeaf].freq <= m_nodes[nextBranch].freq))
+                return nextLeaf++;
+            return nextBranch++;
+        };
+
+        // Each branch joins two nodes, so it takes one branch less than there are leaves to make a single tree.
+        while (m_nodeCount + 1 < 2 * m_leafCount)
+        {
+            uint16_t left = popSmallest();
+            uint16_t right = popSmallest();
+            m_nodes[m_nodeCount++] = { m_nodes[left].freq + m_nodes[right].freq, left, right, NOT_A_CHAR };
+        }
+    }
+
+    void TreeBuilder::codeLengths(lengthTable& codeLengths) const
+    {
+        codeLengths.fill(0);
+        if (m_nodeCount == 0)
+            return;
+
+        // Children always come before their parent, so walking back from the root visits every parent before its children.
+        std::array<uint8_t, MAX_NODES> depth;
+        depth[root()] = 0;
+        for (unsigned int i = m_nodeCount - 1; i >= m_leafCount; i--)
+        {
+            depth[m_nodes[i].left] = depth[i] + 1;
+            depth[m_nodes[i].right] = depth[i] + 1;
+        }
+
+        for (unsigned int i = 0; i < m_leafCount; i++)
+        {
+            codeLengths[m_nodes[i].character] = std::max<uint8_t>(depth[i], 1);
+        }
+    }
+
+    unsigned int TreeBuilder::size() const
+    {
+        return m_nodeCount;
+    }
+
+    unsigned int TreeBuilder::root() const
+    {
+        return m_nodeCount - 1;
+    }
+
+    const TreeBuilder::FlatNode& TreeBuilder::node(unsigned int index) const
+    {
+        return m_nodes[index];
+    }
+
     namespace
     {
-        std::shared_ptr<Node> buildTree(std::map<uint8_t, uint32_t> freqTable)
+        std::shared_ptr<Node> buildTree(const std::map<uint8_t, uint32_t>& freqTable)
+        {
+            TreeBuilder builder;
+            builder.build(freqTable);
+            return linkNodes(builder, builder.root());
+        }
+
+        std::shared_ptr<Node> linkNodes(const TreeBuilder& builder, unsigned int index)
         {
-            std::vector<std::shared_ptr<Node> > nodes;
+            const TreeBuilder::FlatNode& node = builder.node(index);
+            if (node.character != NOT_A_CHAR)
+                return std::make_shared<Node>(node.character, static_cast<int>(node.freq));
+
+            return std::make_shared<Node>(linkNodes(builder, node.left), linkNodes(builder, node.right));
+        }
 
-            // Populate the nodes vector from the frequency table
-            for (auto& node : freqTable)
+        std::map<uint8_t, bitVector> canonicalCodes(const lengthTable& codeLengths)
+        {
+            std::map<uint8_t, bitVector> codes;
+
+            // A lone byte value is stored with a length of 1 so it shows up in the table, but like the tree it came from
+            // it doesn't need any bits at all.
+            if (std::count_if(codeLengths.begin(), codeLengths.end(), [](uint8_t len) { return len != 0; }) == 1)
             {
-                nodes.push_back(std::make_shared<Node>(node.first, node.second));
+                auto character = std::find_if(codeLengths.begin(), codeLengths.end(), [](uint8_t len) { return len != 0; });
+                codes[character - codeLengths.begin()] = bitVector();
+                return codes;
             }
 
-            // Keep making a new Node as the parent of the two smallest nodes in the tree until there is only one Node left in the vector.
-            while (nodes.size() > 1)
+            // Count up through every length, shifting the code left each time the length grows.
+            uint8_t maxLen = *std::max_element(codeLengths.begin(), codeLengths.end());
+            uint32_t code = 0;
+            for (unsigned int len = 1; len <= maxLen; len++)
             {
-                auto left = popSmallest(nodes);
-                auto right = popSmallest(nodes);
-                nodes.push_back(std::make_shared<Node>(left, right));
+                for (unsigned int character = 0; character < codeLengths.size(); character++)
+                {
+                    if (codeLengths[character] != len)
+                        continue;
+
+                    bitVector path(len);
+                    for (unsigned int i = 0; i < len; i++)
+                    {
+                        path[i] = (code >> (len - 1 - i)) & 1U;
+                    }
+                    codes[character] = path;
+                    code++;
+                }
+                code <<= 1;
             }
 
-            return nodes[0];
+            return codes;
         }
 
-        std::shared_ptr<Node> popSmallest(std::vector<std::shared_ptr<Node>>& nodeVec)
+        void limitLengths(lengthTable& codeLengths, const std::map<uint8_t, uint64_t>& freqTable, unsigned int maxCodeLength)
         {
-            // Find the smallest node in the vector.
-            size_t smallest = 0;
-            for (size_t i = 0; i < nodeVec.size(); i++)
+            unsigned int maxLen = *std::max_element(codeLengths.begin(), codeLengths.end());
+            if (maxLen <= maxCodeLength)
+                return;
+
+            // Count how many codes there are of each length.
+            std::vector<unsigned int> lenCount(maxLen + 1, 0);
+            for (auto len : codeLengths)
+            {
+                if (len)
+                    lenCount[len]++;
+            }
+
+            // The deepest codes always come in pairs. Each pair is removed by moving one of them up a level and
+            // splitting a shorter code into two, which keeps the code complete (see JPEG Annex K.3).
+            for (unsigned int len = maxLen; len > maxCodeLength; len--)
             {
-                if (nodeVec[i]->freq < nodeVec[smallest]->freq)
-                    smallest = i;
+                while (lenCount[len] > 0)
+                {
+                    unsigned int shorter = len - 2;
+                    while (shorter > 0 && lenCount[shorter] == 0)
+                        shorter--;
+                    if (shorter == 0)
+                        return;
+
+                    lenCount[len] -= 2;
+                    lenCount[len - 1] += 1;
+                    lenCount[shorter + 1] += 2;
+                    lenCount[shorter] -= 1;
+                }
             }
 
-            // Make a new pointer for the smallest node and remove it from the vector
-            std::shared_ptr<Node> smallNode = nodeVec[smallest];
-            nodeVec.erase(nodeVec.begin() + smallest);
+            // Hand the new lengths back out, shortest first, to the byte values in order of frequency.
+            std::vector<uint8_t> characters;
+            for (auto& leaf : freqTable)
+            {
+                characters.push_back(leaf.first);
+            }
+            std::stable_sort(characters.begin(), characters.end(),
+                [&freqTable](uint8_t a, uint8_t b) { return freqTable.at(a) > freqTable.at(b); });
 
-            return smallNode;
+            unsigned int len = 1;
+            for (auto character : characters)
+            {
+                while (lenCount[len] == 0)
+                    len++;
+                codeLengths[character] = len;
+                lenCount[len]--;
+            }
         }
 
-        void progressBar(int& curPerc, int& prevPerc, int bytes, int fileLen)
+        std::shared_ptr<Node> buildCanonicalTree(const lengthTable& codeLengths)
         {
-            curPerc = round(float(bytes) / float(fileLen) * 100);
+            auto codes = canonicalCodes(codeLengths);
 
-            // Progress bar length is configurable.
-            const int barLen = 20;
+            // The root is the only leaf.
+            if (codes.size() == 1 && codes.begin()->second.empty())
+            {
+                return std::make_shared<Node>(codes.begin()->first, 0);
+            }
 
-            // Only print of the percentage has changed.
-            if (curPerc != prevPerc)
+            auto root = std::make_shared<Node>(NOT_A_CHAR, 0);
+            for (auto& code : codes)
             {
-                // Progress bar will display like this:
-                // 	[######----]
-                // Calculate how many "#" to print.
-                int progBar = (float)curPerc / (100.0f / (float)barLen);
-
-                std::cout << "[";
-                // Print "#"
-                for (int i = 0; i < progBar; i++)
-                    std::cout << "#";
-                // Fill the rest of the bar with "-"
-                for (int j = barLen; j > progBar; j--)
-                    std::cout << "-";
-
-                std::cout << "]";
-
-                // Print how many KB have been processed out of the total and carriage return.
-                std::cout << "\t" << bytes / 1024 << "/" << fileLen / 1024 << " KB\r";
+                // Walk down the path, creating branches where they don't exist yet, and hang the leaf off the last one.
+                std::shared_ptr<Node> curNode = root;
+                for (size_t i = 0; i + 1 < code.second.size(); i++)
+                {
+                    std::shared_ptr<Node>& next = code.second[i] ? curNode->right : curNode->left;
+                    if (!next)
+                        next = std::make_shared<Node>(NOT_A_CHAR, 0);
+                    curNode = next;
+                }
+                (code.second.back() ? curNode->right : curNode->left) = std::make_shared<Node>(code.first, 0);
             }
-            prevPerc = curPerc;
+
+            return root;
         }
     }
 
-    Encoder::Encoder(unsigned int fileLen)
-        : m_huffmanTree(nullptr)
-        , m_buffer(0)
-        , m_curBit(0)
+    Encoder::Encoder()
+        : m_codeLengths{ }
+        , m_maxCodeLength(MAX_CODE_LENGTH)
+        , m_codes{ }
+        , m_bitBuffer(0)
+        , m_bitCount(0)
         , m_compressedSize(0)
-        , m_fileLen(fileLen)
-        , m_bytesProcessed(0)
-        , m_percentCompressed(0)
-        , m_prevPercent(0)
+        , m_bytesIn(0)
+        , m_seekIndex{ 0, { } }
+        , m_nextSeek(0)
     { }
 
-    void Encoder::buildFreqTable(std::string input)
+    void Encoder::buildFreqTable(const std::string& input)
+    {
+        buildFreqTable(input.data(), input.size());
+    }
+
+    void Encoder::buildFreqTable(const char* data, size_t size)
+    {
+        m_histogram.add(data, size);
+    }
+
+    void Encoder::buildFreqTable(const Histogram& histogram)
+    {
+        m_histogram.merge(histogram);
+    }
+
+    void Encoder::buildEncodingTree(unsigned int maxCodeLength)
     {
-        for (uint8_t byte : input)
+        // Only the length of each path through the tree is kept. The codes themselves are replaced by canonical ones.
+        m_freqTable = m_histogram.freqTable();
+        m_treeBuilder.build(m_histogram.counts());
+        m_treeBuilder.codeLengths(m_codeLengths);
+
+        // 256 byte values need codes of at least 8 bits, so the limit can't go below what the table needs.
+        unsigned int minLength = 1;
+        while ((1U << minLength) < m_freqTable.size())
+            minLength++;
+        m_maxCodeLength = std::min(std::max(maxCodeLength, minLength), MAX_WRITER_CODE_LENGTH);
+
+        limitLengths(m_codeLengths, m_freqTable, m_maxCodeLength);
+        setCodeLengths(m_codeLengths, m_maxCodeLength);
+    }
+
+    void Encoder::setCodeLengths(const lengthTable& codeLengths, unsigned int maxCodeLength)
+    {
+        m_codeLengths = codeLengths;
+        m_maxCodeLength = std::min(maxCodeLength, MAX_WRITER_CODE_LENGTH);
+        m_binMap = canonicalCodes(m_codeLengths);
+
+        // Byte values without a length have no code. Clear any left over from an earlier table.
+        m_codes.fill({ 0, 0 });
+
+        // Pack each path into an integer for the bit writer.
+        for (auto& code : m_binMap)
         {
-            m_freqTable[byte] += 1;
+            CodeEntry entry = { 0, static_cast<uint8_t>(code.second.size()) };
+            for (auto bit : code.second)
+            {
+                entry.bits = (entry.bits << 1) | bit;
+            }
+            m_codes[code.first] = entry;
         }
     }
 
-    void Encoder::buildEncodingTree()
+    void Encoder::encode(std::string& data)
     {
-        // Call the shared buildTree function
-        m_huffmanTree = buildTree(m_freqTable);
+        encode(data.data(), data.size(), m_output);
 
-        // Create the binary map from the tree. 
-        bitVector path;
-        buildBinMap(m_huffmanTree, path);
+        // Hand the encoded data back through data. Its old buffer becomes the output buffer of the next call.
+        data.swap(m_output);
     }
 
-    void Encoder::buildBinMap(std::shared_ptr<Node>& curNode, bitVector& path)
+    void Encoder::encode(const char* data, size_t size, std::string& output)
     {
-        // Path is passed by reference through each call. Each time it reaches a leaf it saves that permutation of the
-        // path to the binary map. As the calls resolve it swaps or removes the last bit of the Path.
+        output.resize(encodeBound(size));
+        size_t written = encode(reinterpret_cast<const uint8_t*>(data), size, reinterpret_cast<uint8_t*>(&output[0]), output.size());
+        output.resize(written);
+    }
 
-        if (curNode->character != NOT_A_CHAR)
-        {
-            m_binMap[curNode->character] = path;
+    size_t Encoder::encode(const uint8_t* input, size_t size, uint8_t* output, size_t capacity)
+    {
+        if (capacity < encodeBound(size))
+            return BUFFER_TOO_SMALL;
 
-            // Debug code to print the path to each character
+        const char* data = reinterpret_cast<const char*>(input);
+        char* const begin = reinterpret_cast<char*>(output);
+        char* out = begin;
 
-            //std::cout << curNode->character << " : ";
-            //for (auto bit : path)
-            //{
-            //	std::cout << bit;
-            //}
-            //std::cout << "\n";
+        // Without a seek index the whole input is one run. Otherwise each run ends at the next seek point, where the
+        // position in the stream is recorded before the first byte after it is encoded.
+        size_t pos = 0;
+        while (pos < size)
+        {
+            size_t run = size - pos;
+            if (m_seekIndex.interval != 0)
+            {
+                if (m_bytesIn == m_nextSeek)
+                {
+                    m_seekIndex.bitOffsets.push_back((m_compressedSize + (out - begin)) * 8 + m_bitCount);
+                    m_nextSeek += m_seekIndex.interval;
+                }
+                run = static_cast<size_t>(std::min<uint64_t>(run, m_nextSeek - m_bytesIn));
+            }
 
-            return;
+            out = encodeRun(data + pos, run, out);
+            pos += run;
+            m_bytesIn += run;
         }
 
-        // 0 represents the left path
-        path.push_back(0);
-        buildBinMap(curNode->left, path);
+        // Write out any remaining whole bytes, only the bits that don't fill a byte are carried to the next call.
+        while (m_bitCount >= 8)
+        {
+            m_bitCount -= 8;
+            *out++ = static_cast<char>(m_bitBuffer >> m_bitCount);
+        }
 
-        // Swap the 0 to a 1
-        path.back() = 1;
-        buildBinMap(curNode->right, path);
+        m_compressedSize += out - begin;
+        return out - begin;
+    }
 
-        // Remove the 1 to return to the orignal value Path entered this function call with
-        path.pop_back();
+    size_t Encoder::encodeBound(size_t size) const
+    {
+        // Worst case every byte gets the longest code, on top of the bits left over from the last call. finish() pads what's
+        // left to a whole byte. Counting the leftover bits means the bounds of consecutive calls add up to the bound of all of them.
+        return (size * m_maxCodeLength + m_bitCount + 7) / 8 + 1;
     }
 
-    void Encoder::encode(std::string& data)
+    size_t Encoder::finish(uint8_t* output, size_t capacity)
     {
-        std::string encodedData;
-        for (const auto& character : data)
-        {
-            m_bytesProcessed++;
+        if (m_bitCount == 0)
+            return 0;
+        if (capacity < 1)
+            return BUFFER_TOO_SMALL;
 
-            // Terminal output of compression percentage.
+        // Pad the leftover bits with zeros to a full byte.
+        output[0] = static_cast<uint8_t>(m_bitBuffer << (8 - m_bitCount));
+        m_bitBuffer = 0;
+        m_bitCount = 0;
+        m_compressedSize++;
+        return 1;
+    }
 
-            progressBar(m_percentCompressed, m_prevPercent, m_bytesProcessed, m_fileLen);
+    size_t Encoder::interleavedBound(size_t size, unsigned int streams) const
+    {
+        // Every stream can end in a partly filled byte, and all but the last have their size in front.
+        streams = std::max(1U, std::min(streams, MAX_STREAMS));
+        return (size * m_maxCodeLength + 7) / 8 + streams + (streams - 1) * STREAM_SIZE_BYTES;
+    }
 
-            // Write the binary code that corresponds to the current character. 
-            for (auto bit : m_binMap[character])
+    size_t Encoder::encodeInterleaved(const uint8_t* input, size_t size, unsigned int streams, uint8_t* output, size_t capacity) const
+    {
+        streams = std::max(1U, std::min(streams, MAX_STREAMS));
+        if (capacity < interleavedBound(size, streams))
+            return BUFFER_TOO_SMALL;
+
+        // Each stream is written in one pass over its bytes, with the same bit writer encodeRun() uses.
+        uint8_t* out = output + (streams - 1) * STREAM_SIZE_BYTES;
+        for (unsigned int stream = 0; stream < streams; stream++)
+        {
+            uint8_t* start = out;
+            uint64_t bitBuffer = 0;
+            unsigned int bitCount = 0;
+            for (size_t i = stream; i < size; i += streams)
             {
-                m_curBit++;
-                m_buffer <<= 1;
-                m_buffer |= bit;
-                if (m_curBit == 8)
+                const CodeEntry& code = m_codes[input[i]];
+                bitBuffer = (bitBuffer << code.length) | code.bits;
+                bitCount += code.length;
+
+                if (bitCount >= 32)
                 {
-                    encodedData += m_buffer;
-                    m_curBit = 0;
-                    m_compressedSize += 1;
+                    bitCount -= 32;
+                    uint32_t word = static_cast<uint32_t>(bitBuffer >> bitCount);
+                    out[0] = static_cast<uint8_t>(word >> 24);
+                    out[1] = static_cast<uint8_t>(word >> 16);
+                    out[2] = static_cast<uint8_t>(word >> 8);
+                    out[3] = static_cast<uint8_t>(word);
+                    out += 4;
                 }
             }
+
+            while (bitCount >= 8)
+            {
+                bitCount -= 8;
+                *out++ = static_cast<uint8_t>(bitBuffer >> bitCount);
+            }
+            if (bitCount > 0)
+                *out++ = static_cast<uint8_t>(bitBuffer << (8 - bitCount));
+
+            // The last stream runs to the end of the block, so its size isn't needed.
+            if (stream + 1 < streams)
+            {
+                uint32_t streamSize = static_cast<uint32_t>(out - start);
+                uint8_t* entry = output + stream * STREAM_SIZE_BYTES;
+                entry[0] = static_cast<uint8_t>(streamSize >> 24);
+                entry[1] = static_cast<uint8_t>(streamSize >> 16);
+                entry[2] = static_cast<uint8_t>(streamSize >> 8);
+                entry[3] = static_cast<uint8_t>(streamSize);
+            }
         }
-        data = encodedData;
+
+        return out - output;
+    }
+
+    void Encoder::reset()
+    {
+        m_bitBuffer = 0;
+        m_bitCount = 0;
+        m_compressedSize = 0;
+        m_bytesIn = 0;
+        m_seekIndex.bitOffsets.clear();
+        m_nextSeek = 0;
+    }
+
+    char* Encoder::encodeRun(const char* data, size_t size, char* out)
+    {
+        // Work on local copies so the compiler can keep them in registers.
+        uint64_t bitBuffer = m_bitBuffer;
+        unsigned int bitCount = m_bitCount;
+
+        for (size_t i = 0; i < size; i++)
+        {
+            // Write the binary code that corresponds to the current character.
+            const CodeEntry& code = m_codes[static_cast<uint8_t>(data[i])];
+            bitBuffer = (bitBuffer << code.length) | code.bits;
+            bitCount += code.length;
+
+            // Write a whole 32 bit word once there is one, most significant byte first.
+            if (bitCount >= 32)
+            {
+                bitCount -= 32;
+                uint32_t word = static_cast<uint32_t>(bitBuffer >> bitCount);
+                out[0] = static_cast<char>(word >> 24);
+                out[1] = static_cast<char>(word >> 16);
+                out[2] = static_cast<char>(word >> 8);
+                out[3] = static_cast<char>(word);
+                out += 4;
+            }
+        }
+
+        m_bitBuffer = bitBuffer;
+        m_bitCount = bitCount;
+        return out;
+    }
+
+    void Encoder::setSeekInterval(uint64_t interval)
+    {
+        m_seekIndex.interval = interval;
+        m_seekIndex.bitOffsets.clear();
+        m_nextSeek = m_bytesIn;
+    }
+
+    const SeekIndex& Encoder::seekIndex() const
+    {
+        return m_seekIndex;
     }
 
     uint8_t Encoder::getBuffer()
     {
-        // Only increments compressed size if the buffer contained any data.
-        if (m_buffer != 0) m_compressedSize += 1;
+        // Only increments compressed size if the last 8 bits added contained any data.
+        if (static_cast<uint8_t>(m_bitBuffer) != 0) m_compressedSize += 1;
 
-        auto buffer = m_buffer << (8 - m_curBit);
-        m_buffer = 0;
+        // Pad the leftover bits with zeros to a full byte.
+        uint8_t buffer = static_cast<uint8_t>(m_bitBuffer << (8 - m_bitCount));
+        m_bitBuffer = 0;
+        m_bitCount = 0;
         return buffer;
     }
 
-    std::map<uint8_t, uint32_t> Encoder::freqTable()
+    std::map<uint8_t, uint64_t> Encoder::freqTable()
     {
-        return m_freqTable;
+        return m_histogram.freqTable();
     }
 
-    int Encoder::compressedSize()
+    uint64_t Encoder::encodedBits() const
+    {
+        uint64_t bits = 0;
+        const std::array<uint64_t, 256>& counts = m_histogram.counts();
+        for (unsigned int i = 0; i < 256; i++)
+            bits += counts[i] * m_codeLengths[i];
+        return bits;
+    }
+
+    lengthTable Encoder::codeLengths()
+    {
+        return m_codeLengths;
+    }
+
+    unsigned int Encoder::maxCodeLength()
+    {
+        return m_maxCodeLength;
+    }
+
+    uint64_t Encoder::compressedSize()
     {
         return m_compressedSize;
     }
 
 
-    Decoder::Decoder(std::map<uint8_t, uint32_t> freqTable, int fileLen)
+    Decoder::Decoder(std::map<uint8_t, uint32_t> freqTable, uint64_t fileLen)
         : m_hTree(buildTree(freqTable))
-        , m_curNode(m_hTree)
+        , m_table(1 << LOOKUP_BITS)
+        , m_tableBits(LOOKUP_BITS)
+        , m_curNode(nullptr)
+        , m_bitBuffer(0)
+        , m_bitCount(0)
         , m_curByte(0)
         , m_fileLen(fileLen)
-        , m_percentDecoded(0)
-        , m_prevPercent(0)
-    { }
+        , m_skipBits(0)
+    {
+        buildTable(m_hTree.get(), 0, 0);
+        selectKernels();
+    }
+
+    Decoder::Decoder(const lengthTable& codeLengths, unsigned int maxCodeLength, uint64_t fileLen)
+        : m_hTree(buildCanonicalTree(codeLengths))
+        , m_table(1 << std::min(std::max(maxCodeLength, 1U), LOOKUP_BITS))
+        , m_tableBits(std::min(std::max(maxCodeLength, 1U), LOOKUP_BITS))
+        , m_curNode(nullptr)
+        , m_bitBuffer(0)
+        , m_bitCount(0)
+        , m_curByte(0)
+        , m_fileLen(fileLen)
+        , m_skipBits(0)
+    {
+        buildTable(m_hTree.get(), 0, 0);
+        selectKernels();
+    }
+
+    void Decoder::buildTable(const Node* curNode, uint32_t code, unsigned int depth)
+    {
+        // Corrupt code lengths can leave a branch with only one child. Its missing side keeps an empty entry that decodes
+        // to nothing, so the block comes out short.
+        if (curNode == nullptr)
+            return;
+
+        if (curNode->character != NOT_A_CHAR)
+        {
+            // Every bit pattern that starts with this code decodes to this leaf, no matter what the remaining bits are.
+            uint32_t first = code << (m_tableBits - depth);
+            uint32_t last = (code + 1) << (m_tableBits - depth);
+            for (uint32_t i = first; i < last; i++)
+            {
+                m_table[i] = { static_cast<uint8_t>(curNode->character), static_cast<uint8_t>(depth), nullptr };
+            }
+            return;
+        }
+
+        // The code is longer than the table is wide. Store where the tree walk has to pick up.
+        if (depth == m_tableBits)
+        {
+            m_table[code] = { 0, 0, curNode };
+            return;
+        }
+
+        // 0 represents the left path
+        buildTable(curNode->left.get(), code << 1, depth + 1);
+        buildTable(curNode->right.get(), (code << 1) | 1, depth + 1);
+    }
 
     void Decoder::decode(std::string& data)
     {
-        std::string decodedData = "";
-        int bit = 0;
+        decode(data.data(), data.size(), m_output);
 
-        for (const auto& byte : data)
+        // Hand the decoded data back through data. Its old buffer becomes the output buffer of the next call.
+        data.swap(m_output);
+    }
+
+    void Decoder::decode(const char* data, size_t size, std::string& decodedData)
+    {
+        decodedData.resize(static_cast<size_t>(decodeBound(size)));
+        size_t written = decode(reinterpret_cast<const uint8_t*>(data), size, reinterpret_cast<uint8_t*>(&decodedData[0]), decodedData.size());
+        decodedData.resize(written);
+    }
+
+    uint64_t Decoder::decodeBound(size_t size) const
+    {
+        // A tree that is a single leaf decodes everything that's left, no matter how little input there is.
+        // Otherwise every code takes at least one bit.
+        uint64_t remaining = m_fileLen - std::min(m_curByte, m_fileLen);
+        if (m_hTree->character != NOT_A_CHAR)
+            return remaining;
+        return std::min<uint64_t>(remaining, static_cast<uint64_t>(size) * 8 + m_bitCount);
+    }
+
+    size_t Decoder::decode(const uint8_t* input, size_t size, uint8_t* output, size_t capacity)
+    {
+        if (capacity < decodeBound(size))
+            return BUFFER_TOO_SMALL;
+
+        const char* data = reinterpret_cast<const char*>(input);
+        uint8_t* out = output;
+        size_t pos = 0;
+
+        // A tree that is a single leaf has 0 bit codes. Every remaining byte is that character.
+        if (m_hTree->character != NOT_A_CHAR)
+        {
+            size_t remaining = static_cast<size_t>(m_fileLen - std::min(m_curByte, m_fileLen));
+            std::memset(output, m_hTree->character, remaining);
+            m_curByte = m_fileLen;
+            return remaining;
+        }
+
+        // After seek() the first byte can start in the middle of a code that belongs to the data before the seek point.
+        if (m_skipBits != 0 && size > 0)
+        {
+            m_bitBuffer = static_cast<uint8_t>(data[pos++]);
+            m_bitCount = 8 - m_skipBits;
+            m_skipBits = 0;
+        }
+
+        // Everything but the last few bytes of the input goes through the same loop as one lane of an interleaved block, which
+        // knows up front how many codes it can decode without running out of input and checks nothing per code.
+        // A bit buffer that is completely full has to give up a code first, see decodeLanes().
+        if (m_curNode == nullptr && m_bitCount < 64 && m_curByte < m_fileLen)
         {
-            for (int i = 7; i >= 0; i--)
+            Lane lane = { m_bitBuffer, m_bitCount, input + pos, input + size, 0 };
+            (this->*m_kernels[0])(&lane, out, static_cast<size_t>(std::min<uint64_t>(m_fileLen - m_curByte, SIZE_MAX)));
+            m_bitBuffer = lane.bitBuffer;
+            m_bitCount = lane.bitCount;
+            pos = lane.next - input;
+            out += lane.decoded;
+            m_curByte += lane.decoded;
+        }
+
+        const uint32_t mask = (1U << m_tableBits) - 1;
+
+        // The careful loop for the end of the input. Stop as soon as the file length is reached, anything after that is padding
+        // from the last byte.
+        while (m_curByte < m_fileLen)
+        {
+            // Keep the bit buffer topped up so a full window is available until the input runs out.
+            while (m_bitCount <= 56 && pos < size)
             {
-                // Check if the current Node is a leaf.
-                if (m_curNode->character != NOT_A_CHAR)
+                m_bitBuffer = (m_bitBuffer << 8) | static_cast<uint8_t>(data[pos++]);
+                m_bitCount += 8;
+            }
+
+            if (m_bitCount == 0)
+                break;
+
+            // Finish a code that is longer than the lookup table one bit at a time.
+            if (m_curNode != nullptr)
+            {
+                while (m_curNode != nullptr && m_curNode->character == NOT_A_CHAR && m_bitCount > 0)
                 {
-                    m_curByte++;
-                    // Don't add a character if it's past the end of the file.
-                    if (m_curByte <= m_fileLen)
-                    {
-                        // Add the leaf to the decoded string.
-                        decodedData += m_curNode->character;
-                        // Print the percentage to the terminal.
-                        progressBar(m_percentDecoded, m_prevPercent, m_curByte, m_fileLen);
-                    }
-                    // Reset the current node back to the root.
-                    m_curNode = m_hTree;
+                    m_bitCount--;
+                    m_curNode = ((m_bitBuffer >> m_bitCount) & 1U) ? m_curNode->right.get() : m_curNode->left.get();
+                }
+
+                // A walk that falls off the tree means the stream is corrupt. Nothing after it can be decoded.
+                if (m_curNode == nullptr)
+                {
+                    m_curByte = m_fileLen;
+                    break;
                 }
-                // Traverse the tree.
-                bit = (byte >> i) & 1U;
-                // Go left
-                if (bit == 0)
+
+                if (m_curNode->character != NOT_A_CHAR)
                 {
-                    m_curNode = m_curNode->left;
+                    *out++ = static_cast<uint8_t>(m_curNode->character);
+                    m_curByte++;
+                    m_curNode = nullptr;
                 }
-                // Go Right
-                else if (bit == 1)
+                continue;
+            }
+
+            // Peek at the next m_tableBits bits. Near the end of the input the window is padded with zeros, which is only
+            // safe to use if the code it resolves to fits in the bits that are actually there.
+            uint32_t window;
+            if (m_bitCount >= static_cast<int>(m_tableBits))
+                window = (m_bitBuffer >> (m_bitCount - m_tableBits)) & mask;
+            else
+                window = (m_bitBuffer << (m_tableBits - m_bitCount)) & mask;
+
+            const LookupEntry& entry = m_table[window];
+
+            if (entry.length == 0)
+            {
+                // Long code: skip the bits the table covers and continue the walk from the stored node.
+                if (m_bitCount < static_cast<int>(m_tableBits))
+                    break;
+
+                // A window that no code starts with is corrupt too, the same as a walk that falls off the tree.
+                if (entry.node == nullptr)
                 {
-                    m_curNode = m_curNode->right;
+                    m_curByte = m_fileLen;
+                    break;
                 }
+                m_bitCount -= m_tableBits;
+                m_curNode = entry.node;
+                continue;
             }
+
+            // Wait for the next decode() call if the code runs past the end of this chunk.
+            if (entry.length > m_bitCount)
+                break;
+
+            m_bitCount -= entry.length;
+            *out++ = entry.character;
+            m_curByte++;
         }
-        data = decodedData;
+
+        return out - output;
+    }
+
+    void Decoder::reset(uint64_t fileLen)
+    {
+        m_curNode = nullptr;
+        m_bitBuffer = 0;
+        m_bitCount = 0;
+        m_curByte = 0;
+        m_fileLen = fileLen;
+        m_skipBits = 0;
     }
 
     bool Decoder::done()
     {
         return m_curByte >= m_fileLen;
     }
-}
\ No newline at end of file
+
+    void Decoder::seek(uint64_t position, uint64_t bitOffset)
+    {
+        m_curByte = position;
+        m_curNode = nullptr;
+        m_bitBuffer = 0;
+        m_bitCount = 0;
+        m_skipBits = static_cast<unsigned int>(bitOffset % 8);
+    }
+
+    void Decoder::decodeRange(const char* data, size_t size, const SeekIndex& index, uint64_t offset, uint64_t length, std::string& output)
+    {
+        output.clear();
+        uint64_t end = std::min(m_fileLen, offset + std::min(length, m_fileLen));
+        if (offset >= end || index.interval == 0 || index.bitOffsets.empty())
+            return;
+
+        // Start at the last seek point before the range and stop decoding where the range ends.
+        size_t point = static_cast<size_t>(std::min<uint64_t>(offset / index.interval, index.bitOffsets.size() - 1));
+        uint64_t start = point * index.interval;
+        seek(start, index.bitOffsets[point]);
+
+        uint64_t fileLen = m_fileLen;
+        m_fileLen = end;
+        decode(data, size, m_output);
+        m_fileLen = fileLen;
+
+        // Drop what was decoded between the seek point and the start of the range.
+        size_t skip = static_cast<size_t>(std::min<uint64_t>(offset - start, m_output.size()));
+        output.assign(m_output, skip, std::string::npos);
+    }
+
+    void SeekIndex::streamRange(uint64_t offset, uint64_t length, uint64_t streamSize, uint64_t& first, uint64_t& last) const
+    {
+        first = 0;
+        last = streamSize;
+        if (interval == 0 || bitOffsets.empty())
+            return;
+
+        // The byte that holds the first bit of the seek point before the range, up to the byte that holds the first bit of the
+        // seek point after it. Any code that ends in the range starts before that bit.
+        size_t point = static_cast<size_t>(std::min<uint64_t>(offset / interval, bitOffsets.size() - 1));
+        first = std::min(bitOffsets[point] / 8, streamSize);
+
+        uint64_t end = length > UINT64_MAX - offset ? UINT64_MAX : offset + length;
+        uint64_t after = end / interval + 1;
+        if (after < bitOffsets.size())
+            last = std::min(bitOffsets[static_cast<size_t>(after)] / 8 + 1, streamSize);
+        last = std::max(first, last);
+    }
+
+    // The kernels share one body. Everything it calls is inlined into each kernel so it's compiled for the kernel's instruction
+    // set, apart from the tree walk for long codes, which would only take registers from the common case.
+#if defined(_MSC_VER)
+#define HUFFMAN_FLATTEN
+#define HUFFMAN_NOINLINE __declspec(noinline)
+#else
+#define HUFFMAN_FLATTEN __attribute__((flatten))
+#define HUFFMAN_NOINLINE __attribute__((noinline))
+#endif
+
+    namespace
+    {
+        // Calls step(i) for every lane from First up to Last, with i a constant each time. That lets the compiler keep every
+        // lane's state in registers where a loop over them would leave it in memory.
+        template<unsigned int First, unsigned int Last>
+        struct ForLanes
+        {
+            template<typename Step>
+            static void run(Step& step)
+            {
+                step(First);
+                ForLanes<First + 1, Last>::run(step);
+            }
+        };
+
+        template<unsigned int Last>
+        struct ForLanes<Last, Last>
+        {
+            template<typename Step>
+            static void run(Step&)
+            { }
+        };
+
+        // Compilers turn this into a single load and byte swap.
+        inline uint64_t loadBigEndian(const uint8_t* data)
+        {
+            return (static_cast<uint64_t>(data[0]) << 56) | (static_cast<uint64_t>(data[1]) << 48)
+                | (static_cast<uint64_t>(data[2]) << 40) | (static_cast<uint64_t>(data[3]) << 32)
+                | (static_cast<uint64_t>(data[4]) << 24) | (static_cast<uint64_t>(data[5]) << 16)
+                | (static_cast<uint64_t>(data[6]) << 8) | static_cast<uint64_t>(data[7]);
+        }
+    }
+
+    namespace
+    {
+        // Finds the streams of an interleaved block from the size table in front of them. The last stream takes the rest of
+        // the block. Returns false if the sizes don't fit in the block.
+        bool streamBounds(const uint8_t* input, size_t size, unsigned int streams, const uint8_t** starts, const uint8_t** ends)
+        {
+            size_t tableSize = (streams - 1) * STREAM_SIZE_BYTES;
+            if (size < tableSize)
+                return false;
+
+            const uint8_t* next = input + tableSize;
+            const uint8_t* end = input + size;
+            for (unsigned int stream = 0; stream < streams; stream++)
+            {
+                size_t streamSize = end - next;
+                if (stream + 1 < streams)
+                {
+                    const uint8_t* entry = input + stream * STREAM_SIZE_BYTES;
+                    streamSize = (static_cast<uint32_t>(entry[0]) << 24) | (entry[1] << 16) | (entry[2] << 8) | entry[3];
+                    if (streamSize > static_cast<size_t>(end - next))
+                        return false;
+                }
+                starts[stream] = next;
+                ends[stream] = next + streamSize;
+                next += streamSize;
+            }
+            return true;
+        }
+    }
+
+    bool useBmi2Kernels()
+    {
+#ifdef HUFFMAN_BMI2_KERNELS
+        static const bool bmi2 = __builtin_cpu_supports("bmi2");
+        return bmi2;
+#else
+        return false;
+#endif
+    }
+
+    bool emptyCodeLengths(const lengthTable& codeLengths)
+    {
+        return std::all_of(codeLengths.begin(), codeLengths.end(), [](uint8_t len) { return len == 0; });
+    }
+
+    bool validCodeLengths(const lengthTable& codeLengths)
+    {
+        // Every code of length len takes up 2^(MAX_WRITER_CODE_LENGTH - len) of the 2^MAX_WRITER_CODE_LENGTH longest codes
+        // there are room for. That never overflows 64 bits, even with all 256 codes 1 bit long.
+        uint64_t used = 0;
+        for (uint8_t len : codeLengths)
+        {
+            if (len > MAX_WRITER_CODE_LENGTH)
+                return false;
+            if (len != 0)
+                used += 1ULL << (MAX_WRITER_CODE_LENGTH - len);
+        }
+        return used != 0 && used <= (1ULL << MAX_WRITER_CODE_LENGTH);
+    }
+
+    size_t Decoder::decodeBounded(const uint8_t* input, size_t size, uint8_t* output, size_t length) const
+    {
+        // A plain stream is an interleaved block of one stream, without the size table.
+        return decodeInterleaved(input, size, 1, output, length);
+    }
+
+    size_t Decoder::decodeInterleaved(const uint8_t* input, size_t size, unsigned int streams, uint8_t* output, size_t length) const
+    {
+        if (streams == 0 || streams > MAX_STREAMS)
+            return 0;
+
+        // A tree that is a single leaf has 0 bit codes, every stream is empty.
+        if (m_hTree->character != NOT_A_CHAR)
+        {
+            std::memset(output, m_hTree->character, length);
+            return length;
+        }
+
+        const uint8_t* starts[MAX_STREAMS];
+        const uint8_t* ends[MAX_STREAMS];
+        if (!streamBounds(input, size, streams, starts, ends))
+            return 0;
+
+        Lane lanes[MAX_STREAMS];
+        for (unsigned int stream = 0; stream < streams; stream++)
+            lanes[stream] = { 0, 0, starts[stream], ends[stream], 0 };
+
+        // Every stream has at least length / streams bytes. The first length % streams streams have one more.
+        size_t rounds = length / streams;
+        (this->*m_kernels[streams - 1])(lanes, output, rounds);
+
+        // The ends of the streams are decoded one at a time.
+        size_t decoded = 0;
+        for (unsigned int stream = 0; stream < streams; stream++)
+        {
+            size_t count = rounds + (stream < length % streams ? 1 : 0);
+            finishLane(lanes[stream], streams, stream, output, count);
+            decoded += lanes[stream].decoded;
+        }
+        return decoded;
+    }
+
+    void Decoder::selectKernels()
+    {
+        // A table without an entry that continues into the tree holds every code whole. Tables of codes no longer than
+        // LOOKUP_BITS always do, longer codes only leave the entries they start with.
+        bool complete = std::all_of(m_table.begin(), m_table.end(), [](const LookupEntry& entry) { return entry.length != 0; });
+        m_kernels = complete ? laneKernels<true>(useBmi2Kernels()) : laneKernels<false>(useBmi2Kernels());
+    }
+
+    template<bool Complete>
+    std::array<Decoder::LaneKernel, MAX_STREAMS> Decoder::laneKernels(bool bmi2)
+    {
+#ifdef HUFFMAN_BMI2_KERNELS
+        if (bmi2)
+        {
+            return { { &Decoder::decodeLanesBmi2<1, Complete>, &Decoder::decodeLanesBmi2<2, Complete>, &Decoder::decodeLanesBmi2<3, Complete>,
+                &Decoder::decodeLanesBmi2<4, Complete>, &Decoder::decodeLanesBmi2<5, Complete>, &Decoder::decodeLanesBmi2<6, Complete>,
+                &Decoder::decodeLanesBmi2<7, Complete>, &Decoder::decodeLanesBmi2<8, Complete> } };
+        }
+#endif
+        (void)bmi2;
+        return { { &Decoder::decodeLanes<1, Complete>, &Decoder::decodeLanes<2, Complete>, &Decoder::decodeLanes<3, Complete>,
+            &Decoder::decodeLanes<4, Complete>, &Decoder::decodeLanes<5, Complete>, &Decoder::decodeLanes<6, Complete>,
+            &Decoder::decodeLanes<7, Complete>, &Decoder::decodeLanes<8, Complete> } };
+    }
+
+    template<unsigned int Streams, bool Complete>
+    HUFFMAN_FLATTEN void Decoder::decodeLanes(Lane* lanes, uint8_t* output, size_t rounds) const
+    {
+        runLanes<Streams, Complete>(lanes, output, rounds);
+    }
+
+#ifdef HUFFMAN_BMI2_KERNELS
+    template<unsigned int Streams, bool Complete>
+    HUFFMAN_FLATTEN __attribute__((target("bmi2"))) void Decoder::decodeLanesBmi2(Lane* lanes, uint8_t* output, size_t rounds) const
+    {
+        runLanes<Streams, Complete>(lanes, output, rounds);
+    }
+#endif
+
+    template<unsigned int Streams, bool Complete>
+    void Decoder::runLanes(Lane* lanes, uint8_t* output, size_t rounds) const
+    {
+        const LookupEntry* table = m_table.data();
+        const unsigned int tableBits = m_tableBits;
+
+        // The fast loop keeps its bits at the top of the buffer, so refilling and consuming are a shift each with no branches.
+        // The lanes keep theirs at the bottom, finishLane() gets them back that way.
+        uint64_t bitBuffer[Streams];
+        unsigned int bitCount[Streams];
+        const uint8_t* next[Streams];
+        for (unsigned int i = 0; i < Streams; i++)
+        {
+            bitBuffer[i] = lanes[i].bitCount == 0 ? 0 : lanes[i].bitBuffer << (64 - lanes[i].bitCount);
+            bitCount[i] = lanes[i].bitCount;
+            next[i] = lanes[i].next;
+        }
+
+        size_t round = 0;
+        bool corrupt = false;
+        uint8_t* out = output;
+
+        // Top up a lane to at least 56 bits and decode one code from it. The bytes that don't fit whole are loaded again next time.
+        auto step = [&](unsigned int i)
+        {
+            bitBuffer[i] |= loadBigEndian(next[i]) >> bitCount[i];
+            next[i] += (63 - bitCount[i]) >> 3;
+            bitCount[i] |= 56;
+
+            const LookupEntry& entry = table[bitBuffer[i] >> (64 - tableBits)];
+            unsigned int length = entry.length;
+            int character = entry.character;
+            if (!Complete && length == 0)
+            {
+                character = walkLongCode(entry.node, bitBuffer[i], length);
+                corrupt |= character == NOT_A_CHAR;
+            }
+            out[i] = static_cast<uint8_t>(character);
+            bitBuffer[i] <<= length;
+            bitCount[i] -= length;
+        };
+
+        while (round < rounds && !corrupt)
+        {
+            // A refill reads 8 bytes and moves on by at most 4 after a round, since no code is longer than 32 bits. That gives the
+            // number of rounds every lane can run before it gets close to its end, without checking anything in between.
+            size_t safeRounds = rounds - round;
+            for (unsigned int i = 0; i < Streams; i++)
+            {
+                size_t left = lanes[i].end - next[i];
+                safeRounds = std::min(safeRounds, left < 8 ? 0 : (left - 8) / 4);
+            }
+            if (safeRounds == 0)
+                break;
+
+            // One code from every lane per round. The lookups don't depend on each other, so they overlap.
+            for (size_t end = round + safeRounds; round < end && !corrupt; round++)
+            {
+                out = output + round * Streams;
+                ForLanes<0, Streams>::run(step);
+            }
+        }
+
+        // A corrupt round is left for finishLane() to fail on, it starts again from the lanes as they were handed in.
+        for (unsigned int i = 0; i < Streams; i++)
+        {
+            if (corrupt)
+            {
+                lanes[i].decoded = 0;
+                continue;
+            }
+            lanes[i].bitBuffer = bitCount[i] == 0 ? 0 : bitBuffer[i] >> (64 - bitCount[i]);
+            lanes[i].bitCount = static_cast<int>(bitCount[i]);
+            lanes[i].next = next[i];
+            lanes[i].decoded = round;
+        }
+    }
+
+    HUFFMAN_NOINLINE int Decoder::walkLongCode(const Node* node, uint64_t bitBuffer, unsigned int& length) const
+    {
+        bitBuffer <<= m_tableBits;
+        length = m_tableBits;
+
+        // decodeLanes() only has the input to spare for codes up to MAX_WRITER_CODE_LENGTH bits.
+        while (node != nullptr && node->character == NOT_A_CHAR && length < MAX_WRITER_CODE_LENGTH)
+        {
+            node = (bitBuffer >> 63) ? node->right.get() : node->left.get();
+            bitBuffer <<= 1;
+            length++;
+        }
+        return node != nullptr ? node->character : NOT_A_CHAR;
+    }
+
+    bool Decoder::finishLane(Lane& lane, unsigned int streams, unsigned int index, uint8_t* output, size_t count) const
+    {
+        const uint32_t mask = (1U << m_tableBits) - 1;
+        while (lane.decoded < count)
+        {
+            while (lane.bitCount <= 56 && lane.next < lane.end)
+            {
+                lane.bitBuffer = (lane.bitBuffer << 8) | *lane.next++;
+                lane.bitCount += 8;
+            }
+            if (lane.bitCount == 0)
+                return false;
+
+            // Near the end of the stream the window is padded with zeros, see decode().
+            uint32_t window;
+            if (lane.bitCount >= static_cast<int>(m_tableBits))
+                window = (lane.bitBuffer >> (lane.bitCount - m_tableBits)) & mask;
+            else
+                window = (lane.bitBuffer << (m_tableBits - lane.bitCount)) & mask;
+
+            const LookupEntry& entry = m_table[window];
+            uint8_t character;
+            if (entry.length != 0)
+            {
+                if (entry.length > lane.bitCount)
+                    return false;
+                lane.bitCount -= entry.length;
+                character = entry.character;
+            }
+            else
+            {
+                if (lane.bitCount < static_cast<int>(m_tableBits))
+                    return false;
+                lane.bitCount -= m_tableBits;
+
+                const Node* node = entry.node;
+                while (node != nullptr && node->character == NOT_A_CHAR)
+                {
+                    if (lane.bitCount == 0)
+                        return false;
+                    lane.bitCount--;
+                    node = ((lane.bitBuffer >> lane.bitCount) & 1U) ? node->right.get() : node->left.get();
+                }
+                if (node == nullptr)
+                    return false;
+                character = static_cast<uint8_t>(node->character);
+            }
+
+            output[lane.decoded * streams + index] = character;
+            lane.decoded++;
+        }
+        return true;
+    }
+
+    CompactDecoder::CompactDecoder(const lengthTable& codeLengths)
+        : m_characters{ }
+        , m_lastCode{ }
+        , m_index{ }
+        , m_minLength(0)
+        , m_maxLength(0)
+        , m_single(false)
+    {
+        std::array<unsigned int, MAX_WRITER_CODE_LENGTH + 1> counts{ };
+        unsigned int used = 0;
+        for (uint8_t len : codeLengths)
+        {
+            if (len == 0)
+                continue;
+            if (len > MAX_WRITER_CODE_LENGTH)
+                return;
+            counts[len]++;
+            used++;
+        }
+
+        // Same as canonicalCodes(): a lone byte value has a 0 bit code, whatever length it was stored with.
+        if (used == 1)
+        {
+            m_characters[0] = static_cast<uint8_t>(std::find_if(codeLengths.begin(), codeLengths.end(), [](uint8_t len) { return len != 0; }) - codeLengths.begin());
+            m_single = true;
+            return;
+        }
+        if (used == 0)
+            return;
+
+        // The first code of every length follows on from the last one of the length before, shifted left. More codes than a
+        // length has room for aren't a prefix code.
+        std::array<unsigned int, MAX_WRITER_CODE_LENGTH + 1> offsets{ };
+        uint64_t code = 0;
+        unsigned int index = 0;
+        unsigned int minLength = 0;
+        unsigned int maxLength = 0;
+        for (unsigned int len = 1; len <= MAX_WRITER_CODE_LENGTH; len++)
+        {
+            if (counts[len] != 0)
+            {
+                minLength = minLength != 0 ? minLength : len;
+                maxLength = len;
+            }
+            if (code + counts[len] > (1ULL << len))
+                return;
+
+            offsets[len] = index;
+            m_index[len] = static_cast<uint32_t>(index - code);
+            index += counts[len];
+            code += counts[len];
+            if (minLength != 0)
+                m_lastCode[len] = static_cast<uint32_t>((code << (MAX_WRITER_CODE_LENGTH - len)) - 1);
+            code <<= 1;
+        }
+
+        for (unsigned int character = 0; character < codeLengths.size(); character++)
+        {
+            if (codeLengths[character] != 0)
+                m_characters[offsets[codeLengths[character]]++] = static_cast<uint8_t>(character);
+        }
+        m_minLength = static_cast<uint8_t>(minLength);
+        m_maxLength = static_cast<uint8_t>(maxLength);
+    }
+
+    size_t CompactDecoder::decodeBounded(const uint8_t* input, size_t size, uint8_t* output, size_t length) const
+    {
+        return decodeInterleaved(input, size, 1, output, length);
+    }
+
+    size_t CompactDecoder::decodeInterleaved(const uint8_t* input, size_t size, unsigned int streams, uint8_t* output, size_t length) const
+    {
+        if (streams == 0 || streams > MAX_STREAMS)
+            return 0;
+
+        if (m_single)
+        {
+            std::memset(output, m_characters[0], length);
+            return length;
+        }
+
+        const uint8_t* starts[MAX_STREAMS];
+        const uint8_t* ends[MAX_STREAMS];
+        if (!streamBounds(input, size, streams, starts, ends))
+            return 0;
+
+        // Stream i has byte i of the block and every streams-th byte after it.
+        size_t decoded = 0;
+        for (unsigned int stream = 0; stream < streams; stream++)
+        {
+            size_t count = length / streams + (stream < length % streams ? 1 : 0);
+            decoded += decodeStream(starts[stream], ends[stream], streams, output + stream, count);
+        }
+        return decoded;
+    }
+
+    size_t CompactDecoder::decodeStream(const uint8_t* input, const uint8_t* end, unsigned int streams, uint8_t* output, size_t count) const
+    {
+        if (m_maxLength == 0)
+            return 0;
+
+        // The bits are kept at the top of bitBuffer, with zeros below them past the end of the stream.
+        uint64_t bitBuffer = 0;
+        unsigned int bitCount = 0;
+        for (size_t decoded = 0; decoded < count; decoded++)
+        {
+            while (bitCount <= 56 && input < end)
+            {
+                bitBuffer |= static_cast<uint64_t>(*input++) << (56 - bitCount);
+                bitCount += 8;
+            }
+
+            // Codes of each length are numbered on from the ones before, so the code's length is the first length whose
+            // last code it doesn't go past.
+            uint32_t window = static_cast<uint32_t>(bitBuffer >> (64 - MAX_WRITER_CODE_LENGTH));
+            unsigned int len = m_minLength;
+            while (window > m_lastCode[len])
+            {
+                if (++len > m_maxLength)
+                    return decoded;
+            }
+            if (len > bitCount)
+                return decoded;
+
+            output[decoded * streams] = m_characters[(window >> (MAX_WRITER_CODE_LENGTH - len)) + m_index[len]];
+            bitBuffer <<= len;
+            bitCount -= len;
+        }
+        return count;
+    }
+}
@@ -2,8 +2,8 @@
 #include <iostream>
 #include <vector>
 #include <map>
-#include <cmath>
 #include <memory>
+#include <array>
 
 /*
 Classes and functions for Huffman compression.
@@ -18,11 +18,52 @@ flexibility in implementation.
 // boolean vectors have inconsistent behavior to other vectors, but for this use case they work well and use very little memory. 
 typedef std::vector<bool> bitVector;
 
+// Length in bits of the code for every byte value. 0 means the byte doesn't occur in the input.
+typedef std::array<uint8_t, 256> lengthTable;
+
 namespace huffman
 {
     // Constant used in branch nodes as a non-character.
     constexpr unsigned int NOT_A_CHAR = 256;
 
+    // Number of bits the Decoder resolves with a single lookup table probe. Codes up to this length are decoded
+    // in one step, longer codes fall back to walking the tree from the node the table points at.
+    constexpr unsigned int LOOKUP_BITS = 10;
+
+    // Default limit on the length of a code. Limiting the length costs a tiny bit of compression on very skewed input,
+    // but guarantees that a code always fits in a 64 bit buffer no matter how many bits are already in it.
+    constexpr unsigned int MAX_CODE_LENGTH = 15;
+
+    // The longest code the Encoder's bit writer can take. Up to 31 bits may be waiting in its 64 bit buffer when a code is added.
+    constexpr unsigned int MAX_WRITER_CODE_LENGTH = 32;
+
+    // Returned by the buffer based encode(), decode() and finish() when the output buffer is smaller than their bound.
+    // Nothing is read or written in that case.
+    constexpr size_t BUFFER_TOO_SMALL = static_cast<size_t>(-1);
+
+    // The most streams encodeInterleaved() splits a block into.
+    constexpr unsigned int MAX_STREAMS = 8;
+
+    // Size of each entry of the stream size table in front of an interleaved block.
+    constexpr unsigned int STREAM_SIZE_BYTES = 4;
+
+    // GCC and Clang on x86-64 build a second set of decode kernels for CPUs with BMI2, whose shifts by a variable amount
+    // don't need the count in cl and don't touch the flags. The Decoder picks the set the CPU can run when it's built.
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define HUFFMAN_BMI2_KERNELS 1
+#endif
+
+    // True if the CPU has BMI2 and the kernels for it were built. Checked once.
+    bool useBmi2Kernels();
+
+    // True if codeLengths make a prefix code the decoders can take: at least one code, none longer than MAX_WRITER_CODE_LENGTH,
+    // and no more codes of any length than the shorter ones leave room for. Lengths read from a file are checked with this
+    // before a decoder is built from them. A code that leaves room unused is fine, its streams just never hold the missing codes.
+    bool validCodeLengths(const lengthTable& codeLengths);
+
+    // True if no byte value has a code, like the table of an empty file or of blocks that were all stored.
+    bool emptyCodeLengths(const lengthTable& codeLengths);
+
     struct Node
     {
         std::shared_ptr<Node> left;
@@ -38,93 +79,386 @@ namespace huffman
         Node(int _character, int _freq);
     };
 
-    // Anonymous namespace to hide these two functions from the rest of the program.
-    namespace
+    // A code as the Encoder writes it. The lowest length bits of bits are the code, first bit highest.
+    struct CodeEntry
     {
-        // Builds a Huffman tree from a frequency table. Needed for both the Encoder and the Decoder.
-        std::shared_ptr<Node> buildTree(std::map<uint8_t, int> freqTable);
-        // Pops the smallest node from the vector.
-        std::shared_ptr<Node> popSmallest(std::vector<std::shared_ptr<Node>>& nodeVec);
+        uint32_t bits;
+        uint8_t length;
+    };
+
+    // One entry of the Decoder's lookup table, indexed by the next bits of the stream.
+    struct LookupEntry
+    {
+        // The decoded character. Only valid when length isn't 0.
+        uint8_t character;
 
-        void progressBar(int& curPerc, int& prevPerc, int bytes, int fileLen);
-    }
+        // Length of the code in bits. 0 means the code is longer than the table is wide and decoding continues from node.
+        uint8_t length;
+
+        // The branch reached after the table's bits for codes that don't fit in the table.
+        const Node* node;
+    };
+
+    // Points where decoding can start in the middle of a stream. Entry i is the offset in bits into the stream of the code of byte
+    // i * interval of the original data, so entry 0 is always 0. An interval of 0 means there is no index.
+    struct SeekIndex
+    {
+        uint64_t interval;
+        std::vector<uint64_t> bitOffsets;
+
+        // The bytes of a stream of streamSize bytes that Decoder::decodeRange() needs for a range of the original data,
+        // from first up to but not including last. The whole stream if there is no index.
+        void streamRange(uint64_t offset, uint64_t length, uint64_t streamSize, uint64_t& first, uint64_t& last) const;
+    };
+
+    // Counts how often each byte value occurs. Histograms built over separate parts of the input, for example
+    // on separate threads, can be merged afterwards.
+    class Histogram
+    {
+    public:
+        Histogram();
+
+        // Adds every byte of data to the counts.
+        void add(const char* data, size_t size);
+
+        // Adds the counts of another histogram to this one.
+        void merge(const Histogram& other);
+
+        // The counts as a frequency table. Only byte values that occur are in the table.
+        std::map<uint8_t, uint64_t> freqTable() const;
+
+        // The count of every byte value, indexed directly by the byte. 64 bits, a single byte value can occur more than 4G times.
+        const std::array<uint64_t, 256>& counts() const;
+
+    private:
+        std::array<uint64_t, 256> m_counts;
+    };
+
+    // Builds Huffman trees with the two-queue method. The leaves are sorted by frequency once, and branches are made in order of
+    // frequency, so the two smallest nodes are always at the front of one of the two queues. Nodes live in a fixed array owned by
+    // the builder and refer to each other by index, so one builder can build the tree of every block without allocating.
+    class TreeBuilder
+    {
+    public:
+        // One node of the tree. Leaves come first in the array, sorted by frequency. Branches follow in the order they were made.
+        struct FlatNode
+        {
+            uint64_t freq;
+
+            // Indices of the children. Only valid for branches.
+            uint16_t left;
+            uint16_t right;
+
+            // NOT_A_CHAR for branches.
+            uint16_t character;
+        };
+
+        // 256 leaves and the 255 branches that join them.
+        static constexpr unsigned int MAX_NODES = 2 * 256 - 1;
+
+        TreeBuilder();
+
+        // Builds the tree for every byte value with a count that isn't 0. Replaces the tree of the previous call.
+        void build(const std::array<uint64_t, 256>& counts);
+        void build(const std::map<uint8_t, uint32_t>& freqTable);
+
+        // Fills codeLengths with the depth of every leaf, 0 for byte values that aren't in the tree. A lone leaf is the root
+        // and has no depth, but is given a length of 1 so it still shows up in the table.
+        void codeLengths(lengthTable& codeLengths) const;
+
+        // Number of nodes in the tree. 0 if no byte value had a count.
+        unsigned int size() const;
+
+        // Index of the root. Only valid when size() isn't 0.
+        unsigned int root() const;
+
+        const FlatNode& node(unsigned int index) const;
+
+    private:
+        std::array<FlatNode, MAX_NODES> m_nodes;
+        unsigned int m_nodeCount;
+        unsigned int m_leafCount;
+
+        // Called by build() once the leaves are in place. Sorts them and joins them into branches.
+        void buildBranches();
+    };
 
     // Handles Huffman encoding
     class Encoder
     {
     public:
-        // fileLen is used for progress output.
-        Encoder(unsigned int fileLen);
+        // Progress isn't reported by the Encoder. The caller knows how much it has passed to encode().
+        Encoder();
 
         // Can be called in mutliple times. Adds every character in the input string to the frequency table.
-        void buildFreqTable(std::string input);
+        void buildFreqTable(const std::string& input);
+        void buildFreqTable(const char* data, size_t size);
 
-        // Uses the frequency table to build the Huffman Tree.
-        void buildEncodingTree();
+        // Adds counts that were gathered elsewhere, for example on other threads, to the frequency table.
+        void buildFreqTable(const Histogram& histogram);
 
-        // Overwrites the input string. Used to encode in chunks and writes leftover bits to the buffer.
+        // Uses the frequency table to build the Huffman Tree, then replaces the tree's codes with canonical codes of the same length.
+        // No code will be longer than maxCodeLength, unless there are too many byte values to fit in codes that short.
+        void buildEncodingTree(unsigned int maxCodeLength = MAX_CODE_LENGTH);
+
+        // Uses code lengths that were built elsewhere, for example a prebuilt table, instead of the frequency table.
+        // Every byte value that will be encoded needs a length. No code may be longer than maxCodeLength.
+        void setCodeLengths(const lengthTable& codeLengths, unsigned int maxCodeLength);
+
+        // Overwrites the input string. Used to encode in chunks and keeps leftover bits (less than a byte) for the next call.
         void encode(std::string& data);
 
-        // Returns the remaing bits.
+        // Same as above, but reads the input from memory the caller owns and replaces the contents of output.
+        void encode(const char* data, size_t size, std::string& output);
+
+        // Encodes size bytes of input into output, which the caller owns, and returns the number of bytes written. Bits that don't
+        // fill a byte are kept for the next call or finish(). capacity has to be at least encodeBound(size). Doesn't allocate,
+        // unless a seek interval is set.
+        size_t encode(const uint8_t* input, size_t size, uint8_t* output, size_t capacity);
+
+        // The most bytes encode() and a following finish() can write for size bytes of input.
+        size_t encodeBound(size_t size) const;
+
+        // Writes the leftover bits padded to a whole byte. Returns 0 if there were none, otherwise 1.
+        size_t finish(uint8_t* output, size_t capacity);
+
+        // Returns the remaing bits. Unlike finish() it always returns a byte, even if no bits were left.
         uint8_t getBuffer();
 
-        // getter method for m_freqTable
-        std::map<uint8_t, uint32_t> freqTable();
+        // Starts a new stream with the same codes. The compressed size and the seek points start over.
+        void reset();
+
+        // Encodes a whole block on its own, split round robin into streams bitstreams: byte i goes to stream i % streams.
+        // The output starts with the size of every stream but the last (STREAM_SIZE_BYTES each, big endian), followed by the
+        // streams, each padded to a whole byte. The streams can then be decoded side by side, see Decoder::decodeInterleaved().
+        // capacity has to be at least interleavedBound() and every stream has to come out under 4 GB. Returns the bytes written.
+        // Doesn't touch the state of encode().
+        size_t encodeInterleaved(const uint8_t* input, size_t size, unsigned int streams, uint8_t* output, size_t capacity) const;
+
+        // The most bytes encodeInterleaved() can write.
+        size_t interleavedBound(size_t size, unsigned int streams) const;
+
+        // Records a seek point every interval bytes from the next byte encoded on. 0 stops recording.
+        void setSeekInterval(uint64_t interval);
+
+        // The seek points recorded so far.
+        const SeekIndex& seekIndex() const;
+
+        // Returns the frequency table of everything added so far.
+        std::map<uint8_t, uint64_t> freqTable();
+
+        // The size in bits of the stream everything added so far codes to with the current code lengths, without padding.
+        // Lets the caller see what coding would save before spending a pass on it. Byte values without a code count for nothing.
+        uint64_t encodedBits() const;
+
+        // getter method for m_codeLengths
+        lengthTable codeLengths();
+
+        // getter method for m_maxCodeLength
+        unsigned int maxCodeLength();
 
         // getter method for m_compressedSize
-        int compressedSize();
+        uint64_t compressedSize();
 
     private:
+        // Counts every byte of the input as it's added. Turned into m_freqTable when the tree is built.
+        Histogram m_histogram;
+
         // Table of the frequency with which each byte in the input occurs.
-        std::map<uint8_t, uint32_t> m_freqTable;
+        std::map<uint8_t, uint64_t> m_freqTable;
 
-        // The path to each leaf in the tree.
+        // The canonical code of each byte value.
         std::map<uint8_t, bitVector> m_binMap;
 
-        // The root Node of the Huffman tree
-        std::shared_ptr<Node> m_huffmanTree;
+        // The length of each code. This is all a v2 file stores about the tree.
+        lengthTable m_codeLengths;
+
+        // The limit buildEncodingTree() applied to m_codeLengths.
+        unsigned int m_maxCodeLength;
+
+        // The canonical code of every byte value, indexed directly by the byte.
+        std::array<CodeEntry, 256> m_codes;
+
+        // Builds the Huffman tree the code lengths are taken from. Kept so building the tree again doesn't allocate.
+        TreeBuilder m_treeBuilder;
 
-        // Buffer for storing leftover bits after each encode() call
-        uint8_t m_buffer;
+        // Bits are shifted in at the bottom and written out from the top a word at a time. Only the lowest m_bitCount bits
+        // are waiting to be written, but the bits above them are kept as getBuffer() looks at the last 8 bits added.
+        uint64_t m_bitBuffer;
+        unsigned int m_bitCount;
 
-        int m_curBit;
-        int m_bytesProcessed;
-        int m_fileLen;
-        int m_compressedSize;
+        // Reused between encode() calls so the encoded data doesn't need a new allocation every chunk.
+        std::string m_output;
 
-        // Used to output progress
-        int m_percentCompressed;
-        int m_prevPercent;
+        uint64_t m_compressedSize;
 
-        // Called by buildEncodingTree() as there is no situation that doesn't require this to be called following that step.
-        void buildBinMap(std::shared_ptr<Node>& curNode, bitVector& path);
+        // Bytes passed to encode() so far, and the byte the next seek point is recorded before.
+        uint64_t m_bytesIn;
+        SeekIndex m_seekIndex;
+        uint64_t m_nextSeek;
+
+        // Encodes bytes with the codes alone, with no seek points in between. Returns the end of what was written.
+        char* encodeRun(const char* data, size_t size, char* out);
     };
 
     // Handles Huffman decoding
     class Decoder
     {
     public:
-        Decoder(std::map<uint8_t, uint32_t> freqTable, int fileLen);
+        // Rebuilds the tree from the frequency table stored in v1.1 files.
+        Decoder(std::map<uint8_t, uint32_t> freqTable, uint64_t fileLen);
+
+        // Rebuilds the canonical codes from the code lengths stored in v2 files. maxCodeLength sizes the lookup table.
+        Decoder(const lengthTable& codeLengths, unsigned int maxCodeLength, uint64_t fileLen);
 
         // Overwrites input string. Used to decode in chunks.
         void decode(std::string& input);
 
+        // Same as above, but reads the input from memory the caller owns and replaces the contents of output.
+        void decode(const char* data, size_t size, std::string& output);
+
+        // Decodes all size bytes of input into output, which the caller owns, and returns the number of bytes written.
+        // capacity has to be at least decodeBound(size). Doesn't allocate.
+        size_t decode(const uint8_t* input, size_t size, uint8_t* output, size_t capacity);
+
+        // The most bytes decode() can write for size bytes of input. Never more than what's left of the file length.
+        uint64_t decodeBound(size_t size) const;
+
+        // Starts decoding a new stream of fileLen bytes with the same codes, without building the tables again.
+        void reset(uint64_t fileLen);
+
+        // Decodes a whole stream of exactly length bytes, when the input and output sizes are known up front. Only the last
+        // few bytes of input are checked as they're decoded. Returns the bytes decoded, less than length if the stream is
+        // corrupt. Doesn't touch the state of decode(), so one Decoder can decode many streams with the same codes at once.
+        size_t decodeBounded(const uint8_t* input, size_t size, uint8_t* output, size_t length) const;
+
+        // Decodes a whole block written by Encoder::encodeInterleaved() into length bytes of output. The streams are decoded
+        // in lock step, so the next code of every stream can be looked up while the others are still in flight. Returns the
+        // bytes decoded, less than length if the block is corrupt. Doesn't touch the state of decode().
+        size_t decodeInterleaved(const uint8_t* input, size_t size, unsigned int streams, uint8_t* output, size_t length) const;
+
         // Returns true when the decoder has processed bytes equal to the file length.
         bool done();
 
+        // Continues decoding at byte position of the original data, whose code starts bitOffset bits into the stream.
+        // The next call to decode() has to pass the stream from byte bitOffset / 8 on.
+        void seek(uint64_t position, uint64_t bitOffset);
+
+        // Decodes length bytes of the original data from offset on into output, without decoding anything before the last seek
+        // point in front of it. data and size are the part of the stream SeekIndex::streamRange() gives for the same range.
+        void decodeRange(const char* data, size_t size, const SeekIndex& index, uint64_t offset, uint64_t length, std::string& output);
+
     private:
-        // The root node of the huffman tree
+        // The root node of the huffman tree. Owns the nodes the lookup table points into.
         std::shared_ptr<huffman::Node> m_hTree;
 
-        // Stores the current node during and between decode() calls
-        std::shared_ptr<huffman::Node> m_curNode;
+        // Maps every m_tableBits wide bit pattern to the code it starts with. The table is never wider than LOOKUP_BITS,
+        // or than the longest code when that's known up front.
+        std::vector<LookupEntry> m_table;
+        unsigned int m_tableBits;
+
+        // Stores the current node between decode() calls while in the middle of a code longer than m_tableBits.
+        // nullptr when the next bit starts a new code.
+        const Node* m_curNode;
+
+        // Reused between decode() calls so the decoded data doesn't need a new allocation every chunk.
+        std::string m_output;
+
+        // Bits that have been read from the input but not decoded yet. Only the lowest m_bitCount bits are valid.
+        uint64_t m_bitBuffer;
+        int m_bitCount;
+
+        uint64_t m_curByte;
+        uint64_t m_fileLen;
+
+        // Bits at the start of the next decode() call that belong to the code before the seek point.
+        unsigned int m_skipBits;
+
+        // Called by the constructor. Fills the table entries for every code below curNode.
+        void buildTable(const Node* curNode, uint32_t code, unsigned int depth);
+
+        // One stream of an interleaved block.
+        struct Lane
+        {
+            uint64_t bitBuffer;
+            int bitCount;
+            const uint8_t* next;
+            const uint8_t* end;
+            size_t decoded;
+        };
+
+        // Decodes every lane in lock step for as long as all of them have a full word of input left. Complete kernels are for
+        // tables that hold every code whole, they leave out the tree walk. decodeLanesBmi2() is the same code built for BMI2.
+        template<unsigned int Streams, bool Complete>
+        void decodeLanes(Lane* lanes, uint8_t* output, size_t rounds) const;
+#ifdef HUFFMAN_BMI2_KERNELS
+        template<unsigned int Streams, bool Complete>
+        void decodeLanesBmi2(Lane* lanes, uint8_t* output, size_t rounds) const;
+#endif
+
+        // The body of both, inlined into each so it's compiled for its instruction set.
+        template<unsigned int Streams, bool Complete>
+        void runLanes(Lane* lanes, uint8_t* output, size_t rounds) const;
+
+        // The kernel for each stream count, 1 to MAX_STREAMS, picked by selectKernels() for the table and the CPU.
+        typedef void (Decoder::*LaneKernel)(Lane* lanes, uint8_t* output, size_t rounds) const;
+        std::array<LaneKernel, MAX_STREAMS> m_kernels;
+
+        // Called by the constructor once the table is built.
+        void selectKernels();
+
+        template<bool Complete>
+        static std::array<LaneKernel, MAX_STREAMS> laneKernels(bool bmi2);
+
+        // Continues a code from the branch the table stopped at, for decodeLanes(). The code is at the top of bitBuffer,
+        // its full length is returned through length. Returns NOT_A_CHAR if the walk falls off the tree, or goes on past
+        // MAX_WRITER_CODE_LENGTH bits, which only the tree of a corrupt v1.1 frequency table can.
+        int walkLongCode(const Node* node, uint64_t bitBuffer, unsigned int& length) const;
+
+        // Finishes one lane a code at a time, careful about the end of its input. Returns false if the input runs out first.
+        bool finishLane(Lane& lane, unsigned int streams, unsigned int index, uint8_t* output, size_t count) const;
+    };
+
+    // Decodes canonical codes with a few hundred bytes of state, for when thousands of decoders are alive at once or one is
+    // made for every message. Everything it needs is held in the object itself: the byte values in code order and, for every
+    // code length, the last code of that length and where its byte values start. It never allocates, so it can be built on
+    // the stack, copied and thrown away for free.
+    //
+    // Each code is found by comparing the next bits against the last code of every length in turn, instead of with a table,
+    // so Decoder is several times faster on long streams. Only whole streams and blocks are decoded, the same way as
+    // Decoder::decodeBounded() and Decoder::decodeInterleaved().
+    class CompactDecoder
+    {
+    public:
+        // Builds the code from the code lengths stored in v2 files. Lengths that don't make a valid code, or with codes
+        // longer than MAX_WRITER_CODE_LENGTH, decode nothing.
+        CompactDecoder(const lengthTable& codeLengths);
+
+        // Same as Decoder::decodeBounded().
+        size_t decodeBounded(const uint8_t* input, size_t size, uint8_t* output, size_t length) const;
+
+        // Same as Decoder::decodeInterleaved(). The streams are decoded one after another.
+        size_t decodeInterleaved(const uint8_t* input, size_t size, unsigned int streams, uint8_t* output, size_t length) const;
+
+    private:
+        // Byte values ordered by their codes, which is by code length and then by value.
+        std::array<uint8_t, 256> m_characters;
+
+        // The last code of each length, left aligned in 32 bits with every bit below it set. Only valid from m_minLength on.
+        std::array<uint32_t, MAX_WRITER_CODE_LENGTH + 1> m_lastCode;
+
+        // Added to a code of each length, right aligned, to give its index in m_characters.
+        std::array<uint32_t, MAX_WRITER_CODE_LENGTH + 1> m_index;
+
+        // Shortest and longest code length. A m_maxLength of 0 means the code lengths were invalid.
+        uint8_t m_minLength;
+        uint8_t m_maxLength;
 
-        int m_curByte;
-        int m_fileLen;
+        // Set when a single byte value has a 0 bit code, which every byte of a stream then is.
+        bool m_single;
 
-        // Used to print the percentage of the file decompressed.
-        int m_percentDecoded;
-        int m_prevPercent;
+        // Decodes count bytes of one stream into every streams-th byte of output. Returns the bytes decoded.
+        size_t decodeStream(const uint8_t* input, const uint8_t* end, unsigned int streams, uint8_t* output, size_t count) const;
     };
 }
 
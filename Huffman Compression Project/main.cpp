@@ -1,326 +1,1850 @@
 #include "main.h"
+#include "tables.h"
+#include "rle.h"
 
-/*
-This program is a command line based Huffman compressor. It was created as a portfolio piece for the SMU Guildhall Fall 2022 application.
-It uses two external resources: md5.h (and its associated .cpp file) by Stephan Brumme https://create.stephan-brumme.com/ and CLI11, a command line parser https://github.com/CLIUtils/CLI11
+bool compress(std::string filename, std::string path, const Options& options, std::ostream& messages, std::ostream& errors)
+{
+	// A prebuilt table replaces the frequency pass. Blocks build their own codes, so it only works for a single stream.
+	CodeTable table;
+	bool staticTable = !options.tableName.empty() || !options.tableFile.empty();
+	if (staticTable)
+	{
+		if (options.blockSize != 0 || filename == "-")
+		{
+			errors << "ERROR: Code tables only work for single stream files. They can't be used with stdin, --threads, --block-size, --streams, --split or --rle.\n";
+			return false;
+		}
+		if (!options.tableFile.empty())
+		{
+			if (!readTableFile(options.tableFile, table, errors))
+				return false;
+		}
+		else
+		{
+			table = *findTable(options.tableName);
+		}
+	}
+
+	// "-" compresses stdin to stdout. Neither can seek, so the file is compressed in one pass as a stream of blocks.
+	if (filename == "-")
+	{
+		setBinaryStdio();
+
+		Header header;
+		header.fileVersion = curFileVersion;
+		header.checksumType = options.checksum;
+		header.maxCodeLength = huffman::MAX_CODE_LENGTH;
+		header.flags = FLAG_STREAMED;
+		header.blockSize = options.blockSize != 0 ? static_cast<uint32_t>(options.blockSize) : DEFAULT_BLOCK_SIZE;
+		header.streams = options.streams;
+		if (header.streams > 1)
+			header.flags |= FLAG_INTERLEAVED;
+		if (options.rle)
+			header.flags |= FLAG_RLE;
+
+		// stdout carries the compressed data, so progress and stats go to stderr. The size isn't known up front.
+		Stats stats(options.stats, "compress");
+		Progress progress(0, options.progress, errors);
+		bool written = compressStream(std::cin, std::cout, header, options.threads, options.split, progress, stats);
+		progress.finish();
+		stats.print(errors, options.statsJson);
+		if (!written)
+		{
+			errors << "ERROR: The output could not be written.\n";
+			return false;
+		}
+		return true;
+	}
+
+	std::ifstream input(filename, std::ios::binary);
+	if (!input.good())
+	{
+		errors << "ERROR: File \" " << filename << " \"was not able to be opened.\n";
+		return false;
+	}
+
+	Stats stats(options.stats, "compress");
+
+	// Map the input if possible so every pass reads it in place. Otherwise it's read through the stream.
+	MappedFile mapped;
+	if (options.useMmap)
+	{
+		Stats::Timer timer(stats, Stats::Phase::Read);
+		mapped.open(filename);
+	}
+	const char* data = mapped.isOpen() ? mapped.data() : nullptr;
+
+	input.seekg(0, input.end);
+	uint64_t fileLen = static_cast<uint64_t>(input.tellg());
+	input.seekg(0, input.beg);
+
+	// Remove the path from the filename, if it has one, replace the extension on the output name and add the path for writing.
+	// A .huf file would be written over itself, which truncates it while it's still being read.
+	std::string inFilename = filename;
+	filename = removePath(filename);
+	std::string outFilename = path + replaceExtension(filename);
+	if (outFilename == inFilename)
+	{
+		errors << "ERROR: The output would overwrite \"" << inFilename << "\" itself.\n";
+		return false;
+	}
+	std::ofstream output(outFilename, std::ios::binary);
+
+	// Make sure output file created.
+	if (!output.good())
+	{
+		errors << "ERROR: output file failed to create.\n";
+		return false;
+	}
+
+	Header header;
+	header.fileVersion = curFileVersion;
+	header.checksumType = options.checksum;
+	header.fileSize = fileLen;
+	header.filename = filename;
+	header.maxCodeLength = huffman::MAX_CODE_LENGTH;
+	header.blockSize = static_cast<uint32_t>(options.blockSize);
+
+	Progress progress(fileLen, options.progress, messages);
+
+	if (header.blockSize != 0)
+	{
+		header.streams = options.streams;
+		if (header.streams > 1)
+			header.flags |= FLAG_INTERLEAVED;
+		if (options.rle)
+			header.flags |= FLAG_RLE;
+		bool written = compressBlocks(input, data, fileLen, output, header, options.threads, options.split, progress, stats);
+		progress.finish();
+		stats.print(messages, options.statsJson);
+		if (!written)
+			return removeOutput(output, outFilename, errors);
+		return true;
+	}
+
+	// A single stream needs the whole file twice: once for the frequency table and once to encode it.
+	// If it isn't mapped but fits the memory limit, read it once and run both passes from memory.
+	std::string resident;
+	if (data == nullptr && !staticTable && fileLen != 0 && fileLen <= options.memLimit && fileLen <= SIZE_MAX)
+	{
+		Stats::Timer timer(stats, Stats::Phase::Read);
+		timer.bytes(fileLen, fileLen);
+
+		resident.resize(static_cast<size_t>(fileLen));
+		if (input.read(&resident[0], fileLen))
+			data = resident.data();
+		else
+			input.clear();
+	}
+
+	huffman::Encoder encoder;
+	Checksum checksum(header.checksumType);
+
+	// Create the frequency table and checksum. With a prebuilt table the checksum is taken while encoding instead,
+	// its place in the header is filled in when the header is written again.
+	if (staticTable)
+	{
+		Stats::Timer timer(stats, Stats::Phase::Tree);
+		encoder.setCodeLengths(table.codeLengths, table.maxCodeLength);
+		header.flags |= FLAG_STATIC_TABLE;
+		header.tableId = table.id;
+	}
+	else if (data != nullptr)
+	{
+		{
+			Stats::Timer timer(stats, Stats::Phase::Hash);
+			timer.bytes(fileLen, 0);
+			checksum.add(data, fileLen);
+		}
+		Stats::Timer timer(stats, Stats::Phase::Histogram);
+		timer.bytes(fileLen, 0);
+		encoder.buildFreqTable(data, fileLen);
+	}
+	else
+	{
+		createPrefix(input, fileLen, encoder, checksum, stats, options.chunkSize);
+	}
+
+	if (!staticTable)
+	{
+		Stats::Timer timer(stats, Stats::Phase::Tree);
+		encoder.buildEncodingTree(header.maxCodeLength);
+	}
+
+	header.hash = staticTable ? std::string(Checksum::size(header.checksumType), '0') : checksum.getHash();
+	header.maxCodeLength = encoder.maxCodeLength();
+	header.codeLengths = encoder.codeLengths();
+
+	// The seek index gets one entry per interval. They are written as 0 now and filled in with the compressed size.
+	if (options.seekInterval != 0 && fileLen != 0)
+	{
+		header.flags |= FLAG_SEEK_INDEX;
+		header.seekIndex.interval = options.seekInterval;
+		header.seekIndex.bitOffsets.assign(static_cast<size_t>((fileLen - 1) / options.seekInterval + 1), 0);
+		encoder.setSeekInterval(options.seekInterval);
+	}
+	{
+		Stats::Timer timer(stats, Stats::Phase::Header);
+		writeHeader(output, header);
+	}
+
+	// Reset the head of the input stream and encode the whole thing.
+	Checksum* encodeChecksum = staticTable ? &checksum : nullptr;
+	bool written;
+	if (data != nullptr)
+	{
+		written = encodeFile(data, fileLen, output, encoder, progress, stats, options.chunkSize, encodeChecksum);
+	}
+	else
+	{
+		input.seekg(0, input.beg);
+		written = encodeFile(input, fileLen, output, encoder, progress, stats, options.chunkSize, encodeChecksum);
+	}
+	header.hash = checksum.getHash();
 
-Commands:
-			Filename
--d			Decompress
--o			Overwrite
--p, --path	Path for output
--k          Debug tool. Prevents the program from deleting unencoded files when the hash is incorrect
--l          List the contents of a .huf file.
+	// Write the header again now that the compressed size and the seek points are known.
+	header.compressedSize = encoder.compressedSize();
+	if (header.flags & FLAG_SEEK_INDEX)
+	{
+		size_t count = header.seekIndex.bitOffsets.size();
+		header.seekIndex = encoder.seekIndex();
+		header.seekIndex.bitOffsets.resize(count);
+	}
+	{
+		Stats::Timer timer(stats, Stats::Phase::Header);
+		output.seekp(0, output.beg);
+		writeHeader(output, header);
+		output.flush();
+	}
+	progress.finish();
+	stats.print(messages, options.statsJson);
+	if (!written || !output.good())
+		return removeOutput(output, outFilename, errors);
+	return true;
+}
 
-*/
+bool removeOutput(std::ofstream& output, const std::string& outFilename, std::ostream& errors)
+{
+	// Whatever made it to the disk before the write failed is no use without the rest, or without the header written again.
+	errors << "ERROR: The output could not be written.\n";
+	output.close();
+	std::remove(outFilename.c_str());
+	return false;
+}
 
-int main(int argc, char** argv)
+bool compressBlocks(std::ifstream& input, const char* data, uint64_t fileLen, std::ofstream& output, Header& header, unsigned int threads, bool split, Progress& progress, Stats& stats)
 {
-	// CLI app object that parses the command line.
-	CLI::App app{ "Huffman Compression algorithm" };
+	// The checksums and the block index are only known at the end. Write placeholders of the same size for now.
+	size_t blockCount = static_cast<size_t>((fileLen + header.blockSize - 1) / header.blockSize);
+	size_t checksumSize = Checksum::size(header.checksumType);
+	header.blockSizes.assign(blockCount, 0);
+	header.blockChecksums.assign(blockCount, std::string(checksumSize, '0'));
+	header.hash.assign(checksumSize, '0');
+	{
+		Stats::Timer timer(stats, Stats::Phase::Header);
+		writeHeader(output, header);
+	}
 
-	// Filename
-	std::string filename = "default";
-	app.add_option("filename", filename, "The name of the file to be compressed/decompressed")->check(CLI::ExistingFile);
+	ThreadPool pool(threads);
+	std::deque<std::future<Block>> pending;
+
+	// Every block is hashed on the thread that encodes it. The file's checksum only has to cover the block checksums.
+	Checksum checksum(header.checksumType);
+	Checksum::Type checksumType = header.checksumType;
+
+	uint64_t curByte = 0;
+	unsigned int maxCodeLength = header.maxCodeLength;
+	unsigned int streams = header.streams;
+	bool rle = (header.flags & FLAG_RLE) != 0;
+
+	for (size_t written = 0; written < blockCount; written++)
+	{
+		// Keep a couple of blocks per thread queued so the workers don't run dry while the next block is read.
+		// The input only has to be read once, every block gets its own frequency table.
+		while (curByte < fileLen && pending.size() < 2 * pool.size())
+		{
+			unsigned int blockLen = static_cast<unsigned int>(std::min<uint64_t>(header.blockSize, fileLen - curByte));
+
+			if (data != nullptr)
+			{
+				// Mapped input: the workers read their block straight out of the mapping.
+				const char* block = data + curByte;
+
+				pending.push_back(pool.submit([block, blockLen, maxCodeLength, streams, split, rle, checksumType, &progress]()
+					{
+						Block encoded = encodeBlock(block, blockLen, maxCodeLength, checksumType, streams, split, rle);
+						progress.add(blockLen);
+						return encoded;
+					}));
+			}
+			else
+			{
+				std::string block(blockLen, '\0');
+				{
+					Stats::Timer timer(stats, Stats::Phase::Read);
+					timer.bytes(blockLen, blockLen);
+					input.read(&block[0], block.size());
+				}
+
+				pending.push_back(pool.submit([block = std::move(block), maxCodeLength, streams, split, rle, checksumType, &progress]()
+					{
+						Block encoded = encodeBlock(block.data(), block.size(), maxCodeLength, checksumType, streams, split, rle);
+						progress.add(block.size());
+						return encoded;
+					}));
+			}
+			curByte += blockLen;
+		}
+
+		// Blocks finish in any order, but are written in the order they appear in the file.
+		Block encoded;
+		{
+			Stats::Timer timer(stats, Stats::Phase::Encode);
+			encoded = pending.front().get();
+			timer.bytes(0, encoded.data.size());
+		}
+		pending.pop_front();
+
+		{
+			Stats::Timer timer(stats, Stats::Phase::Write);
+			timer.bytes(encoded.data.size(), encoded.data.size());
+			output.write(encoded.data.data(), encoded.data.size());
+		}
+		checksum.add(encoded.checksum.data(), encoded.checksum.size());
+		header.blockSizes[written] = encoded.data.size();
+		header.blockChecksums[written] = encoded.checksum;
+		header.compressedSize += encoded.data.size();
+	}
 
+	header.hash = checksum.getHash();
+	Stats::Timer timer(stats, Stats::Phase::Header);
+	output.seekp(0, output.beg);
+	writeHeader(output, header);
+	output.flush();
+	return output.good();
+}
 
-	// Path: -p, --path        Specify output file path
-	std::string path = "";
-	app.add_option("-p, --path", path, "Optional. Specifies path that new file will be written to")->check(CLI::ExistingPath);
+bool compressStream(std::istream& input, std::ostream& output, Header& header, unsigned int threads, bool split, Progress& progress, Stats& stats)
+{
+	// The checksum and sizes are unknown until the input ends, so they are left empty here and written in the trailer instead.
+	header.hash.assign(Checksum::size(header.checksumType), '0');
+	{
+		Stats::Timer timer(stats, Stats::Phase::Header);
+		writeHeader(output, header);
+	}
 
-	// Flags
-	// Decompress: -d
-	bool decompressFlag = false;
-	app.add_flag("-d", decompressFlag, "Include to decompress");
+	ThreadPool pool(threads);
+	std::deque<std::future<Block>> pending;
+	std::deque<unsigned int> pendingLens;
 
-	// Overwrite: -o
-	bool overwriteFlag = false;
-	app.add_flag("-o", overwriteFlag, "Include to overwrite existing file");
+	// Same as compressBlocks(), the file's checksum covers the block checksums.
+	Checksum checksum(header.checksumType);
+	Checksum::Type checksumType = header.checksumType;
 
-	// Keep file if faulty. Used for debug purposes
-	bool keepFlag = false;
-	app.add_flag("-k", keepFlag, "Include to prevent bad files from being deleted on hash checking");
+	unsigned int maxCodeLength = header.maxCodeLength;
+	unsigned int streams = header.streams;
+	bool rle = (header.flags & FLAG_RLE) != 0;
+	bool inputDone = false;
 
-	// List: -l                Lists contents of .huf file header.
-	bool listFlag = false;
-	app.add_flag("-l, --list", listFlag, "Include to list the contents of decompressed file");
+	while (!inputDone || !pending.empty())
+	{
+		// Same queueing as compressBlocks(), except the number of blocks isn't known until the input runs out.
+		while (!inputDone && pending.size() < 2 * pool.size())
+		{
+			std::string block(header.blockSize, '\0');
+			{
+				Stats::Timer timer(stats, Stats::Phase::Read);
+				input.read(&block[0], block.size());
+				block.resize(static_cast<size_t>(input.gcount()));
+				timer.bytes(block.size(), block.size());
+			}
+
+			if (block.size() < header.blockSize)
+				inputDone = true;
+			if (block.empty())
+				break;
+
+			header.fileSize += block.size();
+
+			pendingLens.push_back(block.size());
+			pending.push_back(pool.submit([block = std::move(block), maxCodeLength, streams, split, rle, checksumType, &progress]()
+				{
+					Block encoded = encodeBlock(block.data(), block.size(), maxCodeLength, checksumType, streams, split, rle);
+					progress.add(block.size());
+					return encoded;
+				}));
+		}
 
-	// Macro that tells CLI to parse the command line.
-	CLI11_PARSE(app, argc, argv);
+		if (pending.empty())
+			break;
 
-	// path needs to end with a slash when a filename is appended to it
-	if (!path.empty())
-		pathEndSlash(path);
+		// Each block is written with its own sizes and checksum in front of it, so the reader never needs the index.
+		Block encoded;
+		{
+			Stats::Timer timer(stats, Stats::Phase::Encode);
+			encoded = pending.front().get();
+			timer.bytes(0, encoded.data.size());
+		}
+		pending.pop_front();
+
+		Stats::Timer timer(stats, Stats::Phase::Write);
+		timer.bytes(encoded.data.size(), encoded.data.size() + varintSize(pendingLens.front()) + varintSize(encoded.data.size()) + encoded.checksum.size());
+		writeVarint(output, pendingLens.front());
+		writeVarint(output, encoded.data.size());
+		output.write(encoded.checksum.data(), encoded.checksum.size());
+		output.write(encoded.data.data(), encoded.data.size());
+		checksum.add(encoded.checksum.data(), encoded.checksum.size());
+		header.compressedSize += encoded.data.size();
+		pendingLens.pop_front();
+	}
 
-	if (listFlag)
+	// A block of length 0 marks the end, followed by the trailer.
+	header.hash = checksum.getHash();
+	Stats::Timer timer(stats, Stats::Phase::Header);
+	writeVarint(output, 0);
+	writeTrailer(output, header);
+	output.flush();
+	return output.good();
+}
+
+Block encodeBlock(const char* data, size_t size, unsigned int maxCodeLength, Checksum::Type checksumType, unsigned int streams, bool split, bool rle)
+{
+	Block block;
+	block.checksum = Checksum::of(checksumType, data, size);
+
+	// With rle the runs are shortened first and the block starts with the length that came out. A block it doesn't shorten
+	// is coded as it is and starts with its own length instead.
+	std::string runs;
+	std::ostringstream runsLen;
+	if (rle)
 	{
-		listContents(filename);
+		if (rleEncode(data, size, runs) < size)
+		{
+			data = runs.data();
+			size = runs.size();
+		}
+		writeVarint(runsLen, size);
 	}
-	else if (decompressFlag)
+
+	// Split blocks count their bytes a unit at a time to find where the statistics change, see splitBlock().
+	if (split && size > SPLIT_UNIT)
 	{
-		decompress(filename, path, overwriteFlag, keepFlag);
+		block.data = splitBlock(data, size, maxCodeLength, streams);
 	}
 	else
 	{
-		compress(filename, path);
+		huffman::Histogram histogram;
+		histogram.add(data, size);
+		block.data = packBlock(data, size, histogram, maxCodeLength, streams);
 	}
 
-	return 0;
+	if (rle)
+		block.data.insert(0, runsLen.str());
+	return block;
 }
 
-void compress(std::string filename, std::string path)
+std::string packBlock(const char* data, size_t size, const huffman::Histogram& histogram, unsigned int maxCodeLength, unsigned int streams)
 {
-	std::ifstream input(filename, std::ios::binary);
-	if (!input.good())
+	huffman::Encoder encoder;
+	encoder.buildFreqTable(histogram);
+	encoder.buildEncodingTree(maxCodeLength);
+
+	// The code lengths give the size of the stream before anything is coded. Data that's about as likely to be any byte
+	// value, like data that's already compressed, doesn't get any smaller, so it's stored as it is and skips the coding pass.
+	std::string packed = packCodeLengths(encoder.codeLengths(), encoder.maxCodeLength());
+	if (packed.size() + codedSize(encoder.encodedBits(), streams) >= size + 1)
 	{
-		std::cerr << "ERROR: File \" " << filename << " \"was not able to be opened.\n";
-		return;
+		packed.assign(1, static_cast<char>(BLOCK_STORED));
+		packed.append(data, size);
+		return packed;
 	}
 
-	input.seekg(0, input.end);
-	unsigned int fileLen = input.tellg();
-	input.seekg(0, input.beg);
+	// Every block ends on a byte boundary so it can be decoded on its own. The stream goes straight in after the code lengths.
+	size_t lengthsSize = packed.size();
+	if (streams > 1)
+	{
+		packed.resize(lengthsSize + encoder.interleavedBound(size, streams));
+		size_t written = encoder.encodeInterleaved(reinterpret_cast<const uint8_t*>(data), size, streams, reinterpret_cast<uint8_t*>(&packed[lengthsSize]), packed.size() - lengthsSize);
+		packed.resize(lengthsSize + written);
+		return packed;
+	}
+
+	packed.resize(lengthsSize + encoder.encodeBound(size));
+	uint8_t* out = reinterpret_cast<uint8_t*>(&packed[lengthsSize]);
+	size_t capacity = packed.size() - lengthsSize;
+	size_t written = encoder.encode(reinterpret_cast<const uint8_t*>(data), size, out, capacity);
+	written += encoder.finish(out + written, capacity - written);
+	packed.resize(lengthsSize + written);
+	return packed;
+}
+
+uint64_t codedSize(uint64_t bits, unsigned int streams)
+{
+	// Each interleaved stream may end with a padding byte, and all but the last have their size in front.
+	return (bits + 7) / 8 + (streams - 1) * (1 + huffman::STREAM_SIZE_BYTES);
+}
 
-	huffman::Encoder encoder(fileLen);
-	MD5 md5;
+uint64_t packedSize(const huffman::Histogram& histogram, uint64_t size, unsigned int maxCodeLength, unsigned int streams)
+{
+	huffman::Encoder encoder;
+	encoder.buildFreqTable(histogram);
+	encoder.buildEncodingTree(maxCodeLength);
 
-	// Create the frequency table and MD5 hash
-	createPrefix(input, fileLen, encoder, md5);
-	encoder.buildEncodingTree();
+	uint64_t coded = packCodeLengths(encoder.codeLengths(), encoder.maxCodeLength()).size() + codedSize(encoder.encodedBits(), streams);
+	return std::min(coded, size + 1);
+}
 
-	// Remove the path from the filename, if it has one, replace the extension on the output name and add the path for writing.
-	filename = removePath(filename);
-	std::string outFilename = path + replaceExtension(filename);
-	std::ofstream output(outFilename, std::ios::binary);
+std::string splitBlock(const char* data, size_t size, unsigned int maxCodeLength, unsigned int streams)
+{
+	/*
+	Split block layout:
+	0		1		BLOCK_SPLIT
+	1		v		number of parts (p)
+	...		...		p entries of the original size of the part (v) followed by its packed size (v)
+	...		...		the parts, each packed the same as a whole block (see packBlock)
+	*/
 
-	// Make sure output file created.
-	if (!output.good())
+	// Greedy: each unit joins the part before it unless coding the two apart is cheaper, counting the part's entry and code
+	// lengths. Only histograms are compared, nothing is coded until the parts are known.
+	std::vector<size_t> partSizes;
+	std::vector<huffman::Histogram> partHistograms;
+	uint64_t partCost = 0;
+	for (size_t offset = 0; offset < size; offset += SPLIT_UNIT)
+	{
+		size_t unitLen = std::min(SPLIT_UNIT, size - offset);
+		huffman::Histogram unit;
+		unit.add(data + offset, unitLen);
+		uint64_t unitCost = packedSize(unit, unitLen, maxCodeLength, streams);
+
+		if (!partSizes.empty())
+		{
+			huffman::Histogram merged = partHistograms.back();
+			merged.merge(unit);
+			uint64_t mergedCost = packedSize(merged, partSizes.back() + unitLen, maxCodeLength, streams);
+			if (mergedCost <= partCost + unitCost + SPLIT_PART_OVERHEAD)
+			{
+				partSizes.back() += unitLen;
+				partHistograms.back() = merged;
+				partCost = mergedCost;
+				continue;
+			}
+		}
+
+		partSizes.push_back(unitLen);
+		partHistograms.push_back(unit);
+		partCost = unitCost;
+	}
+
+	// Statistics that never change leave one part, which is just a normal block.
+	if (partSizes.size() == 1)
+		return packBlock(data, size, partHistograms[0], maxCodeLength, streams);
+
+	std::vector<std::string> parts;
+	const char* part = data;
+	for (size_t i = 0; i < partSizes.size(); i++)
+	{
+		parts.push_back(packBlock(part, partSizes[i], partHistograms[i], maxCodeLength, streams));
+		part += partSizes[i];
+	}
+
+	std::ostringstream packed;
+	packed.put(static_cast<char>(BLOCK_SPLIT));
+	writeVarint(packed, parts.size());
+	for (size_t i = 0; i < parts.size(); i++)
+	{
+		writeVarint(packed, partSizes[i]);
+		writeVarint(packed, parts[i].size());
+	}
+	for (const std::string& packedPart : parts)
+		packed.write(packedPart.data(), packedPart.size());
+	return packed.str();
+}
+
+void createPrefix(std::ifstream& input, uint64_t fileLen, huffman::Encoder& encoder, Checksum& checksum, Stats& stats, size_t chunkSize)
+{
+	// The next chunk is read on the reader's thread while this one is counted.
+	AsyncReader reader(input, fileLen, chunkSize);
+	while (true)
+	{
+		const std::string* chunk;
+		{
+			Stats::Timer timer(stats, Stats::Phase::Read);
+			chunk = &reader.next();
+			timer.bytes(chunk->size(), chunk->size());
+		}
+		if (chunk->empty())
+			break;
+
+		// Checksum
+		{
+			Stats::Timer timer(stats, Stats::Phase::Hash);
+			timer.bytes(chunk->size(), 0);
+			checksum.add(chunk->data(), chunk->size());
+		}
+
+		Stats::Timer timer(stats, Stats::Phase::Histogram);
+		timer.bytes(chunk->size(), 0);
+		encoder.buildFreqTable(*chunk);
+	}
+}
+
+void writeHeader(std::ostream& output, const Header& header)
+{
+	/*
+	Header format:
+
+	offset	bytes	description
+	0		4		uniqueSig
+	4		2		version
+	6		1		checksum type, see Checksum::Type
+	7		k		checksum, k is Checksum::size() of the type
+	7+k		v		original file size
+	...		v		compressed file size
+	...		1		filename length (n)
+	...		n		filename
+	...		1		maximum code length
+	...		1		flags (f)
+	...		v		block size (s), 0 for a single stream
+	...		1		stream count (n), only when f has FLAG_INTERLEAVED set (since v2.8)
+	...		...		code lengths (see packCodeLengths), followed by the stream when s is 0
+
+	v is a varint (see writeVarint), 1 to 10 bytes long. Sizes were 4 byte integers before v2.5.
+
+	When s is 0 and f has FLAG_SEEK_INDEX set (since v2.6), the seek index comes before the code lengths:
+	...		v		interval (i), the original bytes between seek points
+	...		v		seek point count (p)
+	...		...		p bit offsets into the stream (v) of the code of byte 0, i, 2i and so on
+
+	When s is 0 and f has FLAG_STATIC_TABLE set (since v2.7), the code lengths are replaced by the ID of a prebuilt table:
+	...		v		table ID, see tables.h
+
+	When s isn't 0, the file is split into blocks of s bytes (the last one may be shorter), each compressed on its own:
+	...		v		block count (b)
+	...		...		b entries of the compressed size of the block (v) followed by its checksum (k)
+	...		...		the blocks. Each block is its code lengths followed by its stream, padded to a whole byte.
+	With FLAG_INTERLEAVED the stream is split in n, see Encoder::encodeInterleaved(). Since v2.9 a block can also be stored
+	or split in parts, see packBlock() and splitBlock(). With FLAG_RLE (since v2.10) every block starts with a varint, see
+	encodeBlock().
+
+	When f has FLAG_STREAMED set, the checksum and both sizes are left empty and there is no block count or index.
+	Each block is instead written as:
+	0		v		original size of the block (u). 0 marks the end of the blocks.
+	...		v		compressed size of the block (c)
+	...		k		checksum of the block
+	...		c		the block
+	After the end marker comes the trailer, see writeTrailer.
+
+	For blocked files the checksum in the header is the checksum of the block checksums, in order. That way every block
+	is checked on the thread that decodes it and the file's checksum costs next to nothing.
+	*/
+
+	// Unique identifier and version number to prevent running the code on incorrectly formatted files when decompressing.
+	output.write(uniqueSig.data(), uniqueSig.size());
+	output.put(header.fileVersion.major);
+	output.put(header.fileVersion.minor);
+
+	// Checksum to verify file integrity.
+	output.put(static_cast<char>(header.checksumType));
+	output.write(header.hash.data(), header.hash.size());
+
+	// Write the uncompressed and compressed file size. The compressed size is 0 until the header is written again after compression,
+	// so it's padded to the width the largest possible compressed size would need. That keeps the header the same length both times.
+	uint64_t pieces = header.blockSize == 0 ? 1 : header.blockSizes.size();
+	writeVarint(output, header.fileSize);
+	writeVarint(output, header.compressedSize, varintSize(maxEncodedSize(header.fileSize, pieces)));
+
+	// Write the original filename.
+	uint8_t fnsize = header.filename.size();
+	output.write(reinterpret_cast<char*>(&fnsize), sizeof(fnsize));
+	output.write(header.filename.data(), fnsize);
+
+	// The length limit lets the decoder size its tables before reading the lengths.
+	output.put(header.maxCodeLength);
+	output.put(header.flags);
+
+	writeVarint(output, header.blockSize);
+	if (header.flags & FLAG_INTERLEAVED)
+		output.put(static_cast<char>(header.streams));
+
+	if (header.flags & FLAG_STREAMED)
+	{
+		// Streamed blocks carry their own sizes.
+	}
+	else if (header.blockSize == 0)
+	{
+		// The bit offsets are only known after encoding, they are padded like the compressed size.
+		if (header.flags & FLAG_SEEK_INDEX)
+		{
+			unsigned int offsetWidth = varintSize(maxEncodedSize(header.fileSize, 1) * 8);
+			writeVarint(output, header.seekIndex.interval);
+			writeVarint(output, header.seekIndex.bitOffsets.size());
+			for (uint64_t bitOffset : header.seekIndex.bitOffsets)
+				writeVarint(output, bitOffset, offsetWidth);
+		}
+
+		// Write the code lengths for decompressing, the canonical codes are rebuilt from the lengths alone.
+		if (header.flags & FLAG_STATIC_TABLE)
+		{
+			writeVarint(output, header.tableId);
+		}
+		else
+		{
+			std::string lengths = packCodeLengths(header.codeLengths, header.maxCodeLength);
+			output.write(lengths.data(), lengths.size());
+		}
+	}
+	else
+	{
+		// Same as the compressed size, the index is written before the sizes are known.
+		unsigned int sizeWidth = varintSize(maxEncodedSize(header.blockSize, 1));
+		writeVarint(output, header.blockSizes.size());
+		for (size_t i = 0; i < header.blockSizes.size(); i++)
+		{
+			writeVarint(output, header.blockSizes[i], sizeWidth);
+			output.write(header.blockChecksums[i].data(), header.blockChecksums[i].size());
+		}
+	}
+}
+
+void writeTrailer(std::ostream& output, const Header& header)
+{
+	/*
+	Trailer format, only written at the end of streamed files:
+
+	offset	bytes	description
+	0		8		original file size
+	8		8		compressed file size
+	16		k		checksum, the same as in the header
+
+	The trailer is found by seeking back from the end of the file, so unlike the rest of the format its sizes have a fixed width.
+	Before v2.5 both sizes were 4 bytes.
+	*/
+
+	writeLong(output, header.fileSize);
+	writeLong(output, header.compressedSize);
+	output.write(header.hash.data(), header.hash.size());
+}
+
+void readTrailer(std::istream& input, Header& header)
+{
+	bool wide = header.fileVersion >= FileVersion{ 2,5 };
+	header.fileSize = wide ? readLong(input) : readInt(input);
+	header.compressedSize = wide ? readLong(input) : readInt(input);
+	header.hash.resize(Checksum::size(header.checksumType));
+	input.read(&header.hash[0], header.hash.size());
+}
+
+std::string packCodeLengths(const lengthTable& codeLengths, unsigned int maxCodeLength)
+{
+	/*
+	Code length layouts:
+	l		bytes	description
+	0		1		layout (l)
+			1		number of byte values with a code, minus 1 (c)
+			2*(c+1)	byte value and code length pairs
+	1		1		layout (l)
+			1		first byte value with a code (a)
+			1		last byte value with a code (b)
+			b-a+1	code lengths of a through b
+	2		1		layout (l)
+			1		first byte value with a code (a)
+			1		last byte value with a code (b)
+			(b-a+2)/2	code lengths of a through b, two per byte, high nibble first. Only when the maximum code length is at most 15.
+	Blocks use 3 and 4 for data that isn't preceded by code lengths, see BLOCK_STORED and BLOCK_SPLIT.
+	*/
+
+	// Small inputs only use a few byte values, which are cheaper to list as pairs than as one dense range.
+	auto isUsed = [](uint8_t len) { return len != 0; };
+	uint8_t first = std::find_if(codeLengths.begin(), codeLengths.end(), isUsed) - codeLengths.begin();
+	uint8_t last = codeLengths.rend() - std::find_if(codeLengths.rbegin(), codeLengths.rend(), isUsed) - 1;
+	unsigned int count = std::count_if(codeLengths.begin(), codeLengths.end(), isUsed);
+	unsigned int rangeSize = last - first + 1;
+
+	// Without any codes the count of pairs can't be written, it would read back as 256. An empty range reads back as no codes.
+	if (count == 0)
+		return std::string("\1\1\0", 3);
+
+	std::string packed;
+	if (2 * count < 2 + (maxCodeLength <= 15 ? (rangeSize + 1) / 2 : rangeSize))
+	{
+		packed += static_cast<char>(0);
+		packed += static_cast<char>(count - 1);
+		for (unsigned int i = first; i <= last; i++)
+		{
+			if (!codeLengths[i])
+				continue;
+			packed += static_cast<char>(i);
+			packed += static_cast<char>(codeLengths[i]);
+		}
+	}
+	else if (maxCodeLength <= 15)
+	{
+		packed += static_cast<char>(2);
+		packed += static_cast<char>(first);
+		packed += static_cast<char>(last);
+		for (unsigned int i = first; i <= last; i += 2)
+		{
+			uint8_t low = i + 1 <= last ? codeLengths[i + 1] : 0;
+			packed += static_cast<char>((codeLengths[i] << 4) | low);
+		}
+	}
+	else
+	{
+		packed += static_cast<char>(1);
+		packed += static_cast<char>(first);
+		packed += static_cast<char>(last);
+		packed.append(reinterpret_cast<const char*>(&codeLengths[first]), rangeSize);
+	}
+
+	return packed;
+}
+
+bool encodeFile(std::ifstream& input, uint64_t fileLen, std::ofstream& output, huffman::Encoder& encoder, Progress& progress, Stats& stats, size_t chunkSize, Checksum* checksum)
+{
+	// Reading, encoding and writing each get their own thread. The encoder works straight from the reader's buffers into the writer's.
+	AsyncReader reader(input, fileLen, chunkSize);
+	AsyncWriter writer(output);
+	while (true)
+	{
+		const std::string* chunk;
+		{
+			Stats::Timer timer(stats, Stats::Phase::Read);
+			chunk = &reader.next();
+			timer.bytes(chunk->size(), chunk->size());
+		}
+		if (chunk->empty())
+			break;
+		progress.add(chunk->size());
+
+		if (checksum != nullptr)
+		{
+			Stats::Timer timer(stats, Stats::Phase::Hash);
+			timer.bytes(chunk->size(), 0);
+			checksum->add(chunk->data(), chunk->size());
+		}
+
+		encodeToWriter(encoder, chunk->data(), chunk->size(), writer, stats);
+	}
+
+	// Retrieve remaining bits from the buffer and write to the output.
+	encodeToWriter(encoder, nullptr, 0, writer, stats);
+	Stats::Timer timer(stats, Stats::Phase::Write);
+	return writer.finish();
+}
+
+bool encodeFile(const char* data, uint64_t fileLen, std::ofstream& output, huffman::Encoder& encoder, Progress& progress, Stats& stats, size_t chunkSize, Checksum* checksum)
+{
+	uint64_t curByte = 0;
+	AsyncWriter writer(output);
+
+	// Same as above, except the encoder reads each chunk straight from the mapped input.
+	while (curByte < fileLen)
+	{
+		size_t chunk = static_cast<size_t>(std::min<uint64_t>(fileLen - curByte, chunkSize));
+		if (checksum != nullptr)
+		{
+			Stats::Timer timer(stats, Stats::Phase::Hash);
+			timer.bytes(chunk, 0);
+			checksum->add(data + curByte, chunk);
+		}
+
+		encodeToWriter(encoder, data + curByte, chunk, writer, stats);
+		curByte += chunk;
+		progress.add(chunk);
+	}
+
+	// Retrieve remaining bits from the buffer and write to the output.
+	encodeToWriter(encoder, nullptr, 0, writer, stats);
+	Stats::Timer timer(stats, Stats::Phase::Write);
+	return writer.finish();
+}
+
+void encodeToWriter(huffman::Encoder& encoder, const char* data, size_t size, AsyncWriter& writer, Stats& stats)
+{
+	// Waiting for a free buffer is time spent on the writes.
+	std::string* buffer;
+	{
+		Stats::Timer timer(stats, Stats::Phase::Write);
+		buffer = &writer.acquire();
+	}
+
+	size_t written;
+	{
+		Stats::Timer timer(stats, Stats::Phase::Encode);
+		written = encodeChunk(encoder, data, size, *buffer);
+		timer.bytes(size, written);
+	}
+
+	Stats::Timer timer(stats, Stats::Phase::Write);
+	timer.bytes(written, written);
+	writer.submit(written);
+}
+
+size_t encodeChunk(huffman::Encoder& encoder, const char* data, size_t size, std::string& buffer)
+{
+	// The buffer only grows, so once it has reached the size of a full chunk encoding doesn't allocate any more.
+	size_t bound = encoder.encodeBound(size);
+	if (buffer.size() < bound)
+		buffer.resize(bound);
+
+	uint8_t* out = reinterpret_cast<uint8_t*>(&buffer[0]);
+	if (size == 0)
+		return encoder.finish(out, buffer.size());
+	return encoder.encode(reinterpret_cast<const uint8_t*>(data), size, out, buffer.size());
+}
+
+size_t decodeChunk(huffman::Decoder& decoder, const char* data, size_t size, std::string& buffer)
+{
+	size_t bound = static_cast<size_t>(decoder.decodeBound(size));
+	if (buffer.size() < bound)
+		buffer.resize(bound);
+	return decoder.decode(reinterpret_cast<const uint8_t*>(data), size, reinterpret_cast<uint8_t*>(&buffer[0]), buffer.size());
+}
+
+
+bool decompress(std::string filename, std::string path, const Options& options, std::ostream& messages, std::ostream& errors)
+{
+	// "-" reads the compressed file from stdin and writes the original to stdout. Messages go to stderr so they don't end up in the data.
+	bool piped = filename == "-";
+	std::ostream& status = piped ? errors : messages;
+
+	// create the File Stream and check that it is a valid file.
+	std::ifstream inputFile;
+	if (piped)
+	{
+		setBinaryStdio();
+	}
+	else
+	{
+		inputFile.open(filename, std::ios::binary);
+		if (!inputFile.good())
+		{
+			errors << "ERROR: File \"" << filename << "\"was not able to be opened.\n";
+			return false;
+		}
+	}
+	std::istream& input = piped ? std::cin : inputFile;
+
+	Stats stats(options.stats, "decompress");
+
+	// Map the input if possible so the decoder reads the compressed data in place. The header is still read through the stream.
+	MappedFile mapped;
+	if (options.useMmap && !piped)
+	{
+		Stats::Timer timer(stats, Stats::Phase::Read);
+		mapped.open(filename);
+	}
+
+	// Check that the file has the correct signature. If it wasn't compressed by this program the signature will be missing.
+	if (!checkSig(input, errors)) return false;
+
+	Header header;
+	{
+		Stats::Timer timer(stats, Stats::Phase::Header);
+		header = readHeader(input);
+	}
+
+	// Nothing is created until the header adds up.
+	if (!checkHeader(input, header, options.tableFile, errors))
+		return false;
+
+	// The name of the output file with the path to write to. Files compressed from stdin don't have a name, they are named after the compressed file.
+	if (header.filename.empty())
+		header.filename = removeExtension(removePath(filename));
+	std::string outputName = path + header.filename;
+
+	//  Check if the file already exists to prevent overwriting.
+	if (!options.overwrite && !piped)
+	{
+		std::ifstream tempStream(outputName);
+		if (tempStream.good())
+		{
+			messages << "File already exists. Add -o to command line to overwrite.\n";
+			return false;
+		}
+		tempStream.close();
+	}
+
+	std::ofstream outputFile;
+	if (!piped)
+	{
+		outputFile.open(outputName, std::ios::binary);
+		if (!outputFile.good())
+		{
+			errors << "Output file failed to create\n";
+			return false;
+		}
+	}
+	std::ostream& output = piped ? std::cout : outputFile;
+
+	// Checksum to verify the integrity of the file. Files before v2.4 always use MD5.
+	Checksum checksum(header.checksumType);
+
+	// Everything after the header is compressed data.
+	const char* data = nullptr;
+	size_t dataLen = 0;
+	if (mapped.isOpen() && input.good())
+	{
+		size_t dataStart = static_cast<size_t>(input.tellg());
+		if (dataStart <= mapped.size())
+		{
+			data = mapped.data() + dataStart;
+			dataLen = mapped.size() - dataStart;
+		}
+	}
+
+	// Streamed files don't know their size until the trailer, so their progress has no total.
+	uint64_t progressTotal = header.fileSize;
+	if (options.range && !(header.flags & FLAG_STREAMED))
+		progressTotal = header.fileSize > options.rangeOffset ? std::min(options.rangeLength, header.fileSize - options.rangeOffset) : 0;
+	Progress progress(progressTotal, options.progress, status);
+
+	bool intact = decompressData(input, data, dataLen, output, header, checksum, options, progress, stats, errors);
+	bool written;
+	{
+		Stats::Timer timer(stats, Stats::Phase::Write);
+		output.flush();
+		written = output.good();
+	}
+	progress.finish();
+	stats.print(status, options.statsJson);
+
+	// Confirm the hash matches and delete the file if it doesn't. A streamed file that was cut short has no hash to compare.
+	// Only the blocks of a range are checked, and decompressRange() reports those itself.
+	std::string hash = checksum.getHash();
+	if (!written)
+	{
+		errors << "ERROR: The output could not be written.\n";
+		intact = false;
+	}
+	else if (intact && !options.range && header.hash != hash)
+	{
+		errors << "Corruption ERROR: New hash does not match saved hash\n";
+		status << hash << "\n";
+		intact = false;
+	}
+
+	if (!intact)
+	{
+		// Whatever already went down the pipe can't be taken back.
+		if (piped)
+			return false;
+
+		outputFile.close();
+		if (options.keep)
+		{
+			messages << "Keeping bad file.\n";
+		}
+		else if (std::remove(outputName.c_str()) == 0)
+		{
+			messages << outputName << " was deleted.\n";
+		}
+		else
+		{
+			messages << outputName << " could not be deleted.\n";
+		}
+		return false;
+	}
+
+	status << (options.range ? "Range decompressed.\n" : "File decompressed successfully.\n");
+	return true;
+}
+
+bool checkHeader(const std::istream& input, Header& header, const std::string& tableFile, std::ostream& errors)
+{
+	// Check if the file version is correct
+	if (!supportedVersion(header.fileVersion))
+	{
+		errors << "ERROR: Invalid file version.\n";
+		return false;
+	}
+
+	// readHeader() stops at the first thing that doesn't add up, and at the end of a file that was cut short.
+	if (input.fail())
+	{
+		errors << "ERROR: The header is corrupt.\n";
+		return false;
+	}
+
+	// A checksum added by a later version can't be checked.
+	if (Checksum::name(header.checksumType) == nullptr)
+	{
+		errors << "ERROR: Unknown checksum type.\n";
+		return false;
+	}
+
+	// Files coded with a prebuilt table only have its ID. Tables that aren't built in come from --table-file.
+	if (header.flags & FLAG_STATIC_TABLE)
+	{
+		CodeTable table;
+		if (const CodeTable* builtin = findTable(header.tableId))
+		{
+			table = *builtin;
+		}
+		else if (tableFile.empty() || !readTableFile(tableFile, table, errors) || table.id != header.tableId)
+		{
+			errors << "ERROR: The file was compressed with code table " << std::hex << header.tableId << std::dec << ", give its table file with --table-file.\n";
+			return false;
+		}
+		header.codeLengths = table.codeLengths;
+		header.maxCodeLength = table.maxCodeLength;
+	}
+
+	// Check if the Frequency Table has at least one entry. The program crashes when it tries to build a huffman tree from an empty table.
+	// Blocked files keep their code lengths in each block, decodeBlock() checks those. Empty files don't have any.
+	bool legacy = header.fileVersion == legacyFileVersion;
+	if (legacy ? header.freqTable.empty() : header.blockSize == 0 && header.fileSize != 0 && huffman::emptyCodeLengths(header.codeLengths))
+	{
+		errors << "ERROR: Frequency Table was empty.";
+		return false;
+	}
+	return true;
+}
+
+bool decompressData(std::istream& input, const char* data, size_t dataLen, std::ostream& output, Header& header, Checksum& checksum, const Options& options, Progress& progress, Stats& stats, std::ostream& errors)
+{
+	if (options.range)
+	{
+		return decompressRange(input, data, dataLen, output, header, options, progress, stats, errors);
+	}
+	else if (header.flags & FLAG_STREAMED)
+	{
+		return decompressStream(input, output, header, checksum, options.threads, progress, stats, errors);
+	}
+	else if (header.blockSize != 0)
+	{
+		return decompressBlocks(input, data, dataLen, output, header, checksum, options.threads, progress, stats, errors);
+	}
+	else
+	{
+		return decodeFile(input, data, dataLen, output, header, checksum, progress, stats, options.chunkSize, errors);
+	}
+}
+
+bool decodeFile(std::istream& input, const char* data, size_t dataLen, std::ostream& output, const Header& header, Checksum& checksum, Progress& progress, Stats& stats, size_t chunkSize, std::ostream& errors)
+{
+	huffman::Decoder decoder = makeDecoder(header, stats);
+
+	// The output is written behind on the writer's thread, and unmapped input is read ahead on the reader's.
+	// Only the stream itself is read, nothing past its end.
+	AsyncWriter writer(output);
+	uint64_t streamLen = streamSize(header);
+	uint64_t decoded = 0;
+
+	// Mapped input: decode it in place, a chunk at a time so the output buffers stay small.
+	// A stream of 0 bit codes can be empty and still decode to the whole file.
+	if (data != nullptr)
+	{
+		dataLen = static_cast<size_t>(std::min<uint64_t>(dataLen, streamLen));
+		size_t pos = 0;
+		while (!decoder.done() && (pos < dataLen || decoder.decodeBound(0) != 0))
+		{
+			size_t chunk = std::min<size_t>(dataLen - pos, chunkSize);
+			size_t written = decodeToWriter(decoder, data + pos, chunk, writer, checksum, progress, stats);
+			decoded += written;
+			pos += chunk;
+
+			// Bits left over at the end that don't make a code never will. The stream is corrupt or cut short.
+			if (chunk == 0 && written == 0)
+				break;
+		}
+	}
+	else
+	{
+		// Read the file in chunks and write it to the output file. Also generates the checksum.
+		// A file that ends early stops here and is left for the hash check.
+		AsyncReader reader(input, streamLen, chunkSize);
+		while (!decoder.done())
+		{
+			const std::string* chunk;
+			{
+				Stats::Timer timer(stats, Stats::Phase::Read);
+				chunk = &reader.next();
+				timer.bytes(chunk->size(), chunk->size());
+			}
+			if (chunk->empty() && decoder.decodeBound(0) == 0)
+				break;
+
+			size_t written = decodeToWriter(decoder, chunk->data(), chunk->size(), writer, checksum, progress, stats);
+			decoded += written;
+			if (written == 0 && chunk->empty())
+				break;
+		}
+	}
+
+	// A failed write is reported by decompress(), which checks the output once everything is flushed.
+	bool written;
+	{
+		Stats::Timer timer(stats, Stats::Phase::Write);
+		written = writer.finish();
+	}
+	if (!written)
+		return false;
+
+	// Most streams that end early are caught by the hash check, but not one whose start hashes the same as the file, like nothing at all.
+	if (decoded != header.fileSize)
+	{
+		errors << "Corruption ERROR: The file could not be decoded\n";
+		return false;
+	}
+	return true;
+}
+
+size_t decodeToWriter(huffman::Decoder& decoder, const char* data, size_t size, AsyncWriter& writer, Checksum& checksum, Progress& progress, Stats& stats)
+{
+	std::string* buffer;
+	{
+		Stats::Timer timer(stats, Stats::Phase::Write);
+		buffer = &writer.acquire();
+	}
+
+	size_t written;
 	{
-		std::cerr << "ERROR: output file failed to create.\n";
-		return;
+		Stats::Timer timer(stats, Stats::Phase::Decode);
+		written = decodeChunk(decoder, data, size, *buffer);
+		timer.bytes(size, written);
 	}
 
-	// Write the header and return the offset of the compressed size bytes.
-	int cmprSizeOffset = writeHeader(output, fileLen, filename, encoder.freqTable(), md5);
+	{
+		Stats::Timer timer(stats, Stats::Phase::Hash);
+		timer.bytes(written, 0);
+		checksum.add(buffer->data(), written);
+	}
 
-	// Reset the head of the input stream and encode the whole thing.
-	input.seekg(0, input.beg);
-	encodeFile(input, fileLen, output, encoder);
+	Stats::Timer timer(stats, Stats::Phase::Write);
+	timer.bytes(written, written);
+	writer.submit(written);
+	progress.add(written);
+	return written;
+}
 
-	// Write the compressed size to the saved location.
-	auto compressedSize = encoder.compressedSize();
-	output.seekp(cmprSizeOffset, output.beg);
-	writeInt(output, compressedSize);
-	std::cout << "\n";
+huffman::Decoder makeDecoder(const Header& header, Stats& stats)
+{
+	// The decoder generates the Huffman tree from the frequency table or the code lengths. fileSize tells it when to stop.
+	Stats::Timer timer(stats, Stats::Phase::Tree);
+	return header.fileVersion == legacyFileVersion
+		? huffman::Decoder(header.freqTable, header.fileSize)
+		: huffman::Decoder(header.codeLengths, header.maxCodeLength, header.fileSize);
 }
 
-void createPrefix(std::ifstream& input, unsigned int fileLen, huffman::Encoder& encoder, MD5& md5)
+bool decompressBlocks(std::istream& input, const char* data, size_t dataLen, std::ostream& output, const Header& header, Checksum& checksum, unsigned int threads, Progress& progress, Stats& stats, std::ostream& errors)
 {
-	unsigned int curByte = 0;
-	std::string buffer;
+	ThreadPool pool(threads);
+	std::deque<std::future<Block>> pending;
 
-	while (curByte < fileLen)
+	// Since v2.4 each block is checked by the worker that decodes it.
+	Checksum::Type blockChecksum = blockChecksumType(header);
+
+	size_t blockCount = header.blockSizes.size();
+	size_t curBlock = 0;
+	size_t blockOffset = 0;
+	unsigned int maxCodeLength = header.maxCodeLength;
+	unsigned int streams = header.streams;
+	bool rle = (header.flags & FLAG_RLE) != 0;
+	bool intact = true;
+
+	for (size_t written = 0; written < blockCount; written++)
 	{
-		// Reads the file in chunks
-		buffer.resize(fileLen - curByte > MAX_BUFFER ? MAX_BUFFER : fileLen - curByte);
-		input.read(&buffer[0], buffer.size());
-		curByte += buffer.size();
+		// The index gives the size of every block, so each one can be read whole and decoded without looking at the others.
+		while (curBlock < blockCount && pending.size() < 2 * pool.size())
+		{
+			size_t blockSize = header.blockSizes[curBlock];
+
+			// Every block but the last holds exactly blockSize bytes.
+			unsigned int blockLen = static_cast<unsigned int>(std::min<uint64_t>(header.blockSize, header.fileSize - static_cast<uint64_t>(curBlock) * header.blockSize));
+			curBlock++;
+
+			if (data != nullptr)
+			{
+				// Mapped input: the workers decode their block straight out of the mapping. A block that runs
+				// past the end of the file is decoded as empty and left for the hash check to catch. The blocks
+				// after it still start where the index puts them.
+				const char* block = data + std::min(blockOffset, dataLen);
+				size_t available = blockOffset + blockSize > dataLen ? 0 : blockSize;
+
+				pending.push_back(pool.submit([block, available, maxCodeLength, streams, rle, blockLen, blockChecksum, &progress]()
+					{
+						Block decoded = decodeBlock(block, available, maxCodeLength, blockLen, blockChecksum, streams, rle);
+						progress.add(decoded.data.size());
+						return decoded;
+					}));
+			}
+			else
+			{
+				std::string block(blockSize, '\0');
+				{
+					Stats::Timer timer(stats, Stats::Phase::Read);
+					timer.bytes(blockSize, blockSize);
+					input.read(&block[0], block.size());
+				}
+
+				// Like a mapped block, a block cut short by the end of the file is decoded as empty. The rest of it would be zeros.
+				if (static_cast<size_t>(input.gcount()) != block.size())
+					block.clear();
+
+				pending.push_back(pool.submit([block = std::move(block), maxCodeLength, streams, rle, blockLen, blockChecksum, &progress]()
+					{
+						Block decoded = decodeBlock(block.data(), block.size(), maxCodeLength, blockLen, blockChecksum, streams, rle);
+						progress.add(decoded.data.size());
+						return decoded;
+					}));
+			}
+			blockOffset += blockSize;
+		}
 
-		// MD5 hashing
-		md5.add(buffer.data(), buffer.size());
+		// The hash has to see the blocks in order, so they are collected and written in order as well.
+		Block decoded;
+		{
+			Stats::Timer timer(stats, Stats::Phase::Decode);
+			decoded = pending.front().get();
+			timer.bytes(0, decoded.data.size());
+		}
+		pending.pop_front();
 
-		encoder.buildFreqTable(buffer);
+		uint64_t length = std::min<uint64_t>(header.blockSize, header.fileSize - static_cast<uint64_t>(written) * header.blockSize);
+		if (!writeDecoded(output, header, decoded, length, header.blockChecksums[written], written, checksum, stats, errors))
+			intact = false;
 	}
+	return intact;
 }
 
-int writeHeader(std::ofstream& output, unsigned int fileLen, std::string filename, std::map<uint8_t, uint32_t> freqTable, MD5& md5)
+bool decompressStream(std::istream& input, std::ostream& output, Header& header, Checksum& checksum, unsigned int threads, Progress& progress, Stats& stats, std::ostream& errors)
 {
-	/*
-	Header format:
+	ThreadPool pool(threads);
+	std::deque<std::future<Block>> pending;
+	std::deque<std::string> expected;
+	std::deque<unsigned int> lengths;
+
+	Checksum::Type blockChecksum = blockChecksumType(header);
+	size_t index = 0;
+
+	unsigned int maxCodeLength = header.maxCodeLength;
+	unsigned int streams = header.streams;
+	bool rle = (header.flags & FLAG_RLE) != 0;
+	bool inputDone = false;
+	bool complete = true;
+	bool intact = true;
+
+	while (!inputDone || !pending.empty())
+	{
+		// Read blocks until the end marker. Each one says how big it is, so no index is needed.
+		while (!inputDone && pending.size() < 2 * pool.size())
+		{
+			Stats::Timer timer(stats, Stats::Phase::Read);
+			uint64_t blockLen = readSize(input, header.fileVersion);
+			if (blockLen == 0 && input.good())
+			{
+				inputDone = true;
+				break;
+			}
+
+			// No block holds more than the block size, or codes to more than any block of its length can. Anything bigger is
+			// corrupt and isn't allocated. A file that ends before the end marker is cut short. The trailer can't be found in
+			// either case, so there is no hash to leave them to.
+			uint64_t blockSize = readSize(input, header.fileVersion);
+			if (!input.good() || blockLen > header.blockSize || blockSize > maxEncodedSize(blockLen, 1))
+			{
+				errors << "Corruption ERROR: Block " << index + pending.size() << " is corrupt\n";
+				inputDone = true;
+				complete = false;
+				break;
+			}
+
+			std::string block(static_cast<size_t>(blockSize), '\0');
+			std::string blockHash(Checksum::size(blockChecksum), '\0');
+			input.read(&blockHash[0], blockHash.size());
+			input.read(&block[0], block.size());
+			if (!input.good())
+			{
+				errors << "Corruption ERROR: Block " << index + pending.size() << " is cut short\n";
+				inputDone = true;
+				complete = false;
+				break;
+			}
+			timer.bytes(block.size() + blockHash.size(), block.size());
+
+			// The checks above keep the length to the 32 bit block size.
+			unsigned int len = static_cast<unsigned int>(blockLen);
+			expected.push_back(std::move(blockHash));
+			lengths.push_back(len);
+			pending.push_back(pool.submit([block = std::move(block), maxCodeLength, streams, rle, len, blockChecksum, &progress]()
+				{
+					Block decoded = decodeBlock(block.data(), block.size(), maxCodeLength, len, blockChecksum, streams, rle);
+					progress.add(decoded.data.size());
+					return decoded;
+				}));
+		}
 
-	offset	bytes	description
-	0		4		uniqueSig
-	4		2		version
-	6		32		MD5 hash
-	38		4		original file size
-	42		4		compressed file size
-	46		1		filename length (n)
-	47		n		filename
-	47+n	4		freqTable size (f)
-	51+n	(1+4)*f freqTable
-	*/
+		if (pending.empty())
+			break;
 
-	// Unique identifier and version number to prevent running the code on incorrectly formatted files when decompressing.
-	output.write(uniqueSig.data(), uniqueSig.size());
-	output.put(curFileVersion.major);
-	output.put(curFileVersion.minor);
+		Block decoded;
+		{
+			Stats::Timer timer(stats, Stats::Phase::Decode);
+			decoded = pending.front().get();
+			timer.bytes(0, decoded.data.size());
+		}
+		pending.pop_front();
+
+		if (!writeDecoded(output, header, decoded, lengths.front(), expected.front(), index++, checksum, stats, errors))
+			intact = false;
+		expected.pop_front();
+		lengths.pop_front();
+	}
 
-	// MD5 hashing to verify file integrity.
-	output.write(md5.getHash().data(), md5.getHash().size());
+	if (!complete)
+		return false;
 
-	// Write the uncompressed file size.
-	writeInt(output, fileLen);
+	// The sizes and the hash the header left empty are in the trailer.
+	Stats::Timer timer(stats, Stats::Phase::Header);
+	readTrailer(input, header);
+	return intact;
+}
 
-	// Save the location of the compressed size bytes and skip them.
-	uint32_t cmprSizeOffset = output.tellp();
-	output.seekp(sizeof(cmprSizeOffset), output.cur);
+bool decompressRange(std::istream& input, const char* data, size_t dataLen, std::ostream& output, const Header& header, const Options& options, Progress& progress, Stats& stats, std::ostream& errors)
+{
+	uint64_t rangeStart = options.rangeOffset;
+	uint64_t rangeEnd = options.rangeLength > UINT64_MAX - rangeStart ? UINT64_MAX : rangeStart + options.rangeLength;
 
-	// Write the original filename.
-	uint8_t fnsize = filename.size();
-	output.write(reinterpret_cast<char*>(&fnsize), sizeof(fnsize));
-	output.write(filename.data(), filename.size());
+	// Writes the part of decoded, the original data from position on, that lies in the range.
+	auto writeOverlap = [&](const char* decoded, size_t size, uint64_t position)
+	{
+		uint64_t first = std::max(rangeStart, position);
+		uint64_t last = std::min(rangeEnd, position + size);
+		if (first >= last)
+			return;
 
-	// Write the size of the frequency table and the table for decompressing.
-	uint32_t tableSize = freqTable.size();
-	writeInt(output, tableSize);
+		Stats::Timer timer(stats, Stats::Phase::Write);
+		timer.bytes(last - first, last - first);
+		output.write(decoded + (first - position), static_cast<std::streamsize>(last - first));
+		progress.add(last - first);
+	};
 
-	for (auto& leaf : freqTable)
+	if ((header.flags & FLAG_STREAMED) || header.blockSize != 0)
 	{
-		output.put(leaf.first);
-		writeInt(output, leaf.second);
-	}
+		// Blocks in front of the range are skipped without being decoded, the ones that overlap it are decoded on the pool.
+		struct PendingBlock
+		{
+			std::future<Block> decoded;
+			uint64_t position;
+			uint64_t length;
+			std::string expected;
+			size_t index;
+		};
+		ThreadPool pool(options.threads);
+		std::deque<PendingBlock> pending;
+
+		Checksum::Type blockChecksum = blockChecksumType(header);
+		unsigned int maxCodeLength = header.maxCodeLength;
+		unsigned int streams = header.streams;
+		bool rle = (header.flags & FLAG_RLE) != 0;
+		bool streamed = (header.flags & FLAG_STREAMED) != 0;
+		bool intact = true;
+
+		auto finishBlock = [&]()
+		{
+			PendingBlock& front = pending.front();
+			Block decoded;
+			{
+				Stats::Timer timer(stats, Stats::Phase::Decode);
+				decoded = front.decoded.get();
+				timer.bytes(0, decoded.data.size());
+			}
+
+			// Blocks before v2.4 don't have a checksum, a corrupt one can only be told by coming out short.
+			if (blockChecksum != Checksum::Type::None && decoded.checksum != front.expected)
+			{
+				errors << "Corruption ERROR: Block " << front.index << " does not match its checksum\n";
+				intact = false;
+			}
+			else if (decoded.data.size() != front.length)
+			{
+				errors << "Corruption ERROR: Block " << front.index << " could not be decoded\n";
+				intact = false;
+			}
+			writeOverlap(decoded.data.data(), decoded.data.size(), front.position);
+			pending.pop_front();
+		};
+
+		uint64_t position = 0;
+		size_t blockOffset = 0;
+		for (size_t index = 0; position < rangeEnd; index++)
+		{
+			uint64_t blockLen = 0;
+			size_t blockSize = 0;
+			std::string expected;
+			if (streamed)
+			{
+				Stats::Timer timer(stats, Stats::Phase::Read);
+				blockLen = readSize(input, header.fileVersion);
+				if (blockLen == 0 && input.good())
+					break;
+
+				// Same limits as decompressStream(). A file that ends before its end marker is cut short.
+				uint64_t encodedSize = readSize(input, header.fileVersion);
+				if (!input.good() || blockLen > header.blockSize || encodedSize > maxEncodedSize(blockLen, 1))
+				{
+					errors << "Corruption ERROR: Block " << index << " is corrupt\n";
+					intact = false;
+					break;
+				}
+
+				blockSize = static_cast<size_t>(encodedSize);
+				expected.resize(Checksum::size(blockChecksum));
+				input.read(&expected[0], expected.size());
+			}
+			else
+			{
+				if (index >= header.blockSizes.size())
+					break;
+
+				blockLen = std::min<uint64_t>(header.blockSize, header.fileSize - position);
+				blockSize = static_cast<size_t>(header.blockSizes[index]);
+				expected = header.blockChecksums[index];
+			}
+
+			uint64_t blockStart = position;
+			position += blockLen;
+
+			// Mapped blocked files are read in place, everything else is read forward so stdin works too.
+			bool inPlace = data != nullptr && !streamed;
+			if (position <= rangeStart)
+			{
+				if (!inPlace)
+					input.ignore(static_cast<std::streamsize>(blockSize));
+				blockOffset += blockSize;
+				continue;
+			}
+
+			unsigned int len = static_cast<unsigned int>(blockLen);
+			if (inPlace)
+			{
+				// Like decompressBlocks(), a block past the end of the file is empty and the ones after it keep their place.
+				const char* block = data + std::min(blockOffset, dataLen);
+				size_t available = blockOffset + blockSize > dataLen ? 0 : blockSize;
+
+				pending.push_back({ pool.submit([block, available, maxCodeLength, streams, rle, len, blockChecksum]()
+					{
+						return decodeBlock(block, available, maxCodeLength, len, blockChecksum, streams, rle);
+					}), blockStart, blockLen, std::move(expected), index });
+			}
+			else
+			{
+				std::string block(blockSize, '\0');
+				{
+					Stats::Timer timer(stats, Stats::Phase::Read);
+					timer.bytes(blockSize, blockSize);
+					input.read(&block[0], block.size());
+				}
+				if (!input.good())
+				{
+					errors << "Corruption ERROR: Block " << index << " is cut short\n";
+					intact = false;
+					break;
+				}
+
+				pending.push_back({ pool.submit([block = std::move(block), maxCodeLength, streams, rle, len, blockChecksum]()
+					{
+						return decodeBlock(block.data(), block.size(), maxCodeLength, len, blockChecksum, streams, rle);
+					}), blockStart, blockLen, std::move(expected), index });
+			}
+			blockOffset += blockSize;
+
+			if (pending.size() >= 2 * pool.size())
+				finishBlock();
+		}
 
-	// Return the compressed size byte location. This gets written after compression.
-	return cmprSizeOffset;
-}
+		while (!pending.empty())
+			finishBlock();
+		return intact;
+	}
 
-void encodeFile(std::ifstream& input, unsigned int fileLen, std::ofstream& output, huffman::Encoder& encoder)
-{
-	unsigned int curByte = 0;
+	huffman::Decoder decoder = makeDecoder(header, stats);
 	std::string buffer;
+	rangeEnd = std::min(rangeEnd, header.fileSize);
 
-	// Feeds MAX_BUFFER size chunks of the input file to the encoder until it's done.
-	while (curByte < fileLen)
+	if (header.flags & FLAG_SEEK_INDEX)
 	{
-		buffer.resize(fileLen - curByte > MAX_BUFFER ? MAX_BUFFER : fileLen - curByte);
-
-		input.read(&buffer[0], buffer.size());
-		curByte += buffer.size();
+		// The range is decoded in pieces of whole seek intervals. Every piece starts at a seek point, only the first one has to
+		// decode the bytes between the seek point and the start of the range.
+		const huffman::SeekIndex& index = header.seekIndex;
+		uint64_t pieceSize = std::max<uint64_t>(index.interval, RANGE_PIECE_SIZE / index.interval * index.interval);
 
-		// encode() overwrites the buffer. Write the encoded string to the output.
-		encoder.encode(buffer);
-		output.write(buffer.data(), buffer.size());
-	}
+		uint64_t streamLen = streamSize(header);
+		if (data != nullptr)
+			streamLen = std::min<uint64_t>(streamLen, dataLen);
 
-	// Retrieve remaining bits from the buffer and write to the output.
-	buffer = encoder.getBuffer();
-	output.write(buffer.data(), buffer.size());
-}
+		// Unmapped input keeps whatever part of the stream the next piece still needs. Pieces next to each other share a byte.
+		std::string window;
+		uint64_t windowStart = 0;
 
+		for (uint64_t position = rangeStart; position < rangeEnd;)
+		{
+			uint64_t pieceEnd = std::min(rangeEnd, (position / pieceSize + 1) * pieceSize);
+			uint64_t first, last;
+			index.streamRange(position, pieceEnd - position, streamLen, first, last);
+
+			const char* slice = data + first;
+			if (data == nullptr)
+			{
+				Stats::Timer timer(stats, Stats::Phase::Read);
+				uint64_t windowEnd = windowStart + window.size();
+				if (first >= windowEnd)
+				{
+					input.ignore(static_cast<std::streamsize>(first - windowEnd));
+					window.clear();
+				}
+				else
+				{
+					window.erase(0, static_cast<size_t>(first - windowStart));
+				}
+				windowStart = first;
+
+				size_t have = window.size();
+				window.resize(static_cast<size_t>(last - first));
+				input.read(&window[have], window.size() - have);
+				window.resize(have + static_cast<size_t>(input.gcount()));
+				timer.bytes(window.size() - have, window.size() - have);
+				slice = window.data();
+				last = first + window.size();
+			}
+
+			{
+				Stats::Timer timer(stats, Stats::Phase::Decode);
+				decoder.decodeRange(slice, static_cast<size_t>(last - first), index, position, pieceEnd - position, buffer);
+				timer.bytes(last - first, buffer.size());
+			}
+			writeOverlap(buffer.data(), buffer.size(), position);
+
+			// A piece that comes up short is corrupt, nothing after it can be trusted either.
+			if (buffer.size() != pieceEnd - position)
+			{
+				errors << "Corruption ERROR: The range could not be decoded\n";
+				return false;
+			}
+			position = pieceEnd;
+		}
+		return true;
+	}
 
-void decompress(std::string filename, std::string path, bool overwriteFlag, bool keepFlag)
-{
-	// create the File Stream and check that it is a valid file.
-	std::ifstream input(filename, std::ios::binary);
-	if (!input.good())
+	// Files without a seek index are decoded from the start, and everything in front of the range is thrown away.
+	std::string decoded;
+	uint64_t position = 0;
+	size_t pos = 0;
+	if (data == nullptr)
+		buffer.resize(MAX_BUFFER);
+	while (!decoder.done() && position < rangeEnd)
 	{
-		std::cerr << "ERROR: File \"" << filename << "\"was not able to be opened.\n";
-		return;
-	}
+		const char* chunkData = data + pos;
+		size_t chunk;
+		if (data != nullptr)
+		{
+			chunk = std::min<size_t>(dataLen - pos, MAX_BUFFER);
+			pos += chunk;
+		}
+		else
+		{
+			Stats::Timer timer(stats, Stats::Phase::Read);
+			input.read(&buffer[0], buffer.size());
+			chunk = static_cast<size_t>(input.gcount());
+			timer.bytes(chunk, chunk);
+			chunkData = buffer.data();
+		}
+		if (chunk == 0 && decoder.decodeBound(0) == 0)
+			break;
 
-	// Check that the file has the correct signature. If it wasn't compressed by this program the signature will be missing.
-	if (!checkSig(input)) return;
+		size_t written;
+		{
+			Stats::Timer timer(stats, Stats::Phase::Decode);
+			written = decodeChunk(decoder, chunkData, chunk, decoded);
+			timer.bytes(chunk, written);
+		}
 
-	Header header = readHeader(input);
+		writeOverlap(decoded.data(), written, position);
+		position += written;
+		if (chunk == 0 && written == 0)
+			break;
+	}
 
-	// Check if the file version is correct
-	if (header.fileVersion.major != curFileVersion.major || header.fileVersion.minor != curFileVersion.minor)
+	// Same as a piece of a file with seek points, a stream that ends before the range does is corrupt.
+	if (position < rangeEnd)
 	{
-		std::cerr << "ERROR: Invalid file version.\n";
-		return;
+		errors << "Corruption ERROR: The range could not be decoded\n";
+		return false;
 	}
+	return true;
+}
 
-	// Check if the Frequency Table has at least one entry. The program crashes when it tries to build a huffman tree from an empty table.
-	if (header.freqTable.empty())
+bool writeDecoded(std::ostream& output, const Header& header, const Block& decoded, uint64_t length, const std::string& expected, size_t index, Checksum& checksum, Stats& stats, std::ostream& errors)
+{
+	// A corrupt length isn't covered by any checksum. The block can decode to what its checksum says and still come out short.
+	bool complete = decoded.data.size() == length;
+	if (!complete)
+		errors << "Corruption ERROR: Block " << index << " could not be decoded\n";
+
+	if (blockChecksumType(header) == Checksum::Type::None)
 	{
-		std::cerr << "ERROR: Frequency Table was empty.";
-		return;
+		// Before v2.4 blocks have no checksums of their own, the file's checksum covers the data itself.
+		writeChunk(output, decoded.data.data(), decoded.data.size(), checksum, stats);
+		return complete;
 	}
 
-	// The name of the output file with the path to write to.
-	std::string outputName = path + header.filename;
-
-	//  Check if the file already exists to prevent overwriting.
-	if (!overwriteFlag)
+	// The file's checksum covers the block checksums the threads computed, not the stored ones. A block whose stored checksum
+	// is what's corrupt would still pass it, so a mismatch fails the file on its own.
+	bool matched = decoded.checksum == expected;
 	{
-		std::ifstream tempStream(outputName);
-		if (tempStream.good())
-		{
-			std::cout << "File already exists. Add -o to command line to overwrite.\n";
-			return;
-		}
-		tempStream.close();
+		Stats::Timer timer(stats, Stats::Phase::Hash);
+		if (!matched)
+			errors << "Corruption ERROR: Block " << index << " does not match its checksum\n";
+		checksum.add(decoded.checksum.data(), decoded.checksum.size());
 	}
 
-	std::ofstream output(outputName, std::ios::binary);
-	if (!output.good())
+	Stats::Timer timer(stats, Stats::Phase::Write);
+	timer.bytes(decoded.data.size(), decoded.data.size());
+	output.write(decoded.data.data(), decoded.data.size());
+	return complete && matched;
+}
+
+void writeChunk(std::ostream& output, const char* decoded, size_t size, Checksum& checksum, Stats& stats)
+{
 	{
-		std::cerr << "Output file failed to create\n";
-		return;
+		Stats::Timer timer(stats, Stats::Phase::Hash);
+		timer.bytes(size, 0);
+		checksum.add(decoded, size);
 	}
 
-	// MD5 hashing to verify the integrity of the file.
-	MD5 md5;
+	Stats::Timer timer(stats, Stats::Phase::Write);
+	timer.bytes(size, size);
+	output.write(decoded, size);
+}
 
-	// Create a decoder object. It generates the Huffman tree from the frequency table. fileSize tells it when to stop.
-	huffman::Decoder decoder(header.freqTable, header.fileSize);
+Checksum::Type blockChecksumType(const Header& header)
+{
+	return header.fileVersion >= FileVersion{ 2,4 } ? header.checksumType : Checksum::Type::None;
+}
 
-	// Read the file in chunks and write it to the output file. Also generates the MD5 hash.
-	std::string buffer;
-	while (!decoder.done())
+Block decodeBlock(const char* block, size_t size, unsigned int maxCodeLength, unsigned int blockLen, Checksum::Type checksumType, unsigned int streams, bool rle)
+{
+	// See encodeBlock() for the length in front of rle blocks. Any length short of the block's own is run length output.
+	const char* end = block + size;
+	uint64_t runsLen = blockLen;
+	if (rle && !readVarint(block, end, runsLen))
+		runsLen = 0;
+	size = end - block;
+
+	// The block's length is known, so it's decoded straight into a buffer of that size.
+	Block decoded;
+	decoded.data.resize(blockLen);
+	size_t written = 0;
+	if (runsLen < blockLen)
 	{
-		buffer.resize(MAX_BUFFER);
-		input.read(&buffer[0], buffer.size());
+		std::string runs(static_cast<size_t>(runsLen), '\0');
+		size_t unpacked = unpackBlock(block, size, maxCodeLength, streams, &runs[0], runs.size());
+		written = rleDecode(runs.data(), unpacked, &decoded.data[0], decoded.data.size());
+	}
+	else
+	{
+		written = unpackBlock(block, size, maxCodeLength, streams, &decoded.data[0], decoded.data.size());
+	}
 
-		decoder.decode(buffer);
+	// A corrupt block comes out short, which the hash check catches.
+	decoded.data.resize(written);
+	decoded.checksum = Checksum::of(checksumType, decoded.data.data(), decoded.data.size());
+	return decoded;
+}
 
-		md5.add(buffer.data(), buffer.size());
+size_t unpackBlock(const char* block, size_t size, unsigned int maxCodeLength, unsigned int streams, char* output, size_t length)
+{
+	if (size == 0)
+		return 0;
 
-		output.write(buffer.data(), buffer.size());
-	}
+	if (static_cast<uint8_t>(block[0]) == BLOCK_SPLIT)
+		return unpackSplit(block, size, maxCodeLength, streams, output, length);
 
-	// Confirm the hash matches and delete the file if it doesn't.
-	if (header.hash != md5.getHash())
+	// Stored data is copied as it is.
+	if (static_cast<uint8_t>(block[0]) == BLOCK_STORED)
 	{
-		output.close();
-		std::cerr << "Corruption ERROR: New hash does not match saved hash\n";
-		std::cout << md5.getHash();
+		size_t stored = std::min(size - 1, length);
+		std::memcpy(output, block + 1, stored);
+		return stored;
+	}
 
-		if (keepFlag)
-		{
-			std::cout << "Keeping bad file.\n";
-		}
-		else if (std::remove(outputName.c_str()))
-		{
-			std::cout << outputName << " was deleted.\n";
-		}
-		else
-		{
-			std::cout << outputName << " could not be deleted.\n";
-		}
+	// Only the code lengths at the start of the block are copied for parsing.
+	std::istringstream stream(std::string(block, std::min<size_t>(size, MAX_PACKED_LENGTHS_SIZE)));
+	lengthTable codeLengths{ };
+	readCodeLengths(stream, codeLengths);
+
+	// A block without any codes, or with lengths that aren't a prefix code, is corrupt.
+	if (!stream.good() || !huffman::validCodeLengths(codeLengths))
+		return 0;
+
+	size_t lengthsSize = static_cast<size_t>(stream.tellg());
+	huffman::Decoder decoder(codeLengths, maxCodeLength, length);
+	const uint8_t* in = reinterpret_cast<const uint8_t*>(block + lengthsSize);
+	uint8_t* out = reinterpret_cast<uint8_t*>(output);
+	return streams > 1
+		? decoder.decodeInterleaved(in, size - lengthsSize, streams, out, length)
+		: decoder.decodeBounded(in, size - lengthsSize, out, length);
+}
+
+size_t unpackSplit(const char* block, size_t size, unsigned int maxCodeLength, unsigned int streams, char* output, size_t length)
+{
+	// See splitBlock() for the layout. Parts that don't fit the block or the output are corrupt.
+	const char* next = block + 1;
+	const char* end = block + size;
+	uint64_t count = 0;
+	if (!readVarint(next, end, count) || count > static_cast<uint64_t>(end - next) / 2)
+		return 0;
+
+	std::vector<uint64_t> lens(static_cast<size_t>(count));
+	std::vector<uint64_t> sizes(static_cast<size_t>(count));
+	for (size_t i = 0; i < lens.size(); i++)
+	{
+		if (!readVarint(next, end, lens[i]) || !readVarint(next, end, sizes[i]))
+			return 0;
 	}
-	else
+
+	size_t written = 0;
+	for (size_t i = 0; i < lens.size(); i++)
 	{
-		std::cout << "\nFile decompressed successfully.\n";
+		if (sizes[i] > static_cast<uint64_t>(end - next) || lens[i] > length - written)
+			return written;
+
+		// A part is never split again.
+		if (sizes[i] != 0 && static_cast<uint8_t>(next[0]) == BLOCK_SPLIT)
+			return written;
+
+		size_t partLen = static_cast<size_t>(lens[i]);
+		size_t decoded = unpackBlock(next, static_cast<size_t>(sizes[i]), maxCodeLength, streams, output + written, partLen);
+		written += decoded;
+		if (decoded != partLen)
+			return written;
+		next += sizes[i];
 	}
+	return written;
 }
 
-Header readHeader(std::ifstream& input)
+Header readHeader(std::istream& input)
 {
 	/*
 	Header format:
 	offset	bytes	description
 	0		4		uniqueSig
 	4		2		version
-	6		32		MD5 hash
-	38		4		original file size
-	42		4		compressed file size
+	6		32		MD5 hash (before v2.4, see writeHeader for the checksum since then)
+	38		4		original file size (a varint since v2.5)
+	42		4		compressed file size (a varint since v2.5)
 	46		1		filename length (n)
 	47		n		filename
+	47+n	...		length limit, block size, code lengths or block index (v2, see writeHeader) or:
 	47+n	4		freqTable size (f)
-	51+n	(1+4)*f freqTable
+	51+n	(1+4)*f freqTable (v1.1)
 
 	The signature is read before this function is called. If the signature is not the expected characters the program is terminated.
+
+	Nothing in the header is trusted. Anything that doesn't add up sets the failbit of input and the header is returned as far as it
+	was read, so a corrupt or made up file can't make the program allocate more than the file holds, write outside the output
+	directory, or build a decoder from code lengths that aren't a prefix code.
 	*/
 
 	Header header;
@@ -329,12 +1853,20 @@ Header readHeader(std::ifstream& input)
 	header.fileVersion.major = input.get();
 	header.fileVersion.minor = input.get();
 
-	// MD5 hash
-	header.hash.resize(32);
+	if (!supportedVersion(header.fileVersion))
+		return header;
+
+	// Checksum. Before v2.4 it's always an MD5 hash.
+	header.checksumType = Checksum::Type::MD5;
+	if (header.fileVersion >= FileVersion{ 2,4 })
+		header.checksumType = static_cast<Checksum::Type>(input.get());
+
+	header.hash.resize(Checksum::size(header.checksumType));
 	input.read(&header.hash[0], header.hash.size());
 
-	header.fileSize = readInt(input);
-	header.compressedSize = readInt(input);
+	// Sizes are varints since v2.5.
+	header.fileSize = readSize(input, header.fileVersion);
+	header.compressedSize = readSize(input, header.fileVersion);
 
 	// Filename
 	uint8_t nameLen;
@@ -342,22 +1874,203 @@ Header readHeader(std::ifstream& input)
 	header.filename.resize(nameLen);
 	input.read(&header.filename[0], header.filename.size());
 
-	// Frequency table
+	// compress() only stores the name without its path, the output goes wherever the user asked. Older versions could leave a Windows path in
+	// the name, so only its last part is kept. A name that is still unusable is dropped, decompress() then names the output after the input.
+	// Empty for files compressed from stdin.
+	header.filename = removePath(header.filename);
+	if (header.filename.find('\0') != std::string::npos || header.filename == "." || header.filename == "..")
+	{
+		header.filename.clear();
+	}
+
+	if (header.fileVersion != legacyFileVersion)
+	{
+		// v2.0 didn't record the length limit, the longest code is just as good for sizing the decoder.
+		if (header.fileVersion >= FileVersion{ 2,1 })
+		{
+			header.maxCodeLength = input.get();
+			if (header.maxCodeLength == 0 || header.maxCodeLength > huffman::MAX_WRITER_CODE_LENGTH)
+			{
+				input.setstate(std::ios::failbit);
+				return header;
+			}
+		}
+
+		// Flags were added in v2.3.
+		if (header.fileVersion >= FileVersion{ 2,3 })
+			header.flags = input.get();
+
+		// Blocks were added in v2.2.
+		if (header.fileVersion >= FileVersion{ 2,2 })
+			header.blockSize = static_cast<uint32_t>(readSize(input, header.fileVersion));
+
+		// Run lengths were added in v2.10. They're shortened per block too.
+		if ((header.flags & FLAG_RLE) && (header.fileVersion < FileVersion{ 2,10 } || (header.blockSize == 0 && !(header.flags & FLAG_STREAMED))))
+		{
+			input.setstate(std::ios::failbit);
+			return header;
+		}
+
+		// Interleaved streams were added in v2.8. They only split blocks.
+		if (header.fileVersion >= FileVersion{ 2,8 } && (header.flags & FLAG_INTERLEAVED))
+		{
+			header.streams = static_cast<uint8_t>(input.get());
+			if (header.streams < 2 || header.streams > huffman::MAX_STREAMS || (header.blockSize == 0 && !(header.flags & FLAG_STREAMED)))
+			{
+				input.setstate(std::ios::failbit);
+				return header;
+			}
+		}
+
+		if (header.flags & FLAG_STREAMED)
+			return header;
+
+		if (header.blockSize != 0)
+		{
+			// Every block but the last holds exactly blockSize bytes, so the file size gives the count. The index is read an entry
+			// at a time rather than sized up front, a file that's cut short only costs what it holds.
+			uint64_t count = readSize(input, header.fileVersion);
+			if (count != header.fileSize / header.blockSize + (header.fileSize % header.blockSize != 0 ? 1 : 0))
+			{
+				input.setstate(std::ios::failbit);
+				return header;
+			}
+
+			// Block checksums were added in v2.4.
+			size_t checksumSize = Checksum::size(blockChecksumType(header));
+			uint64_t maxBlockSize = maxEncodedSize(header.blockSize, 1);
+			for (uint64_t i = 0; i < count && input.good(); i++)
+			{
+				header.blockSizes.push_back(readSize(input, header.fileVersion));
+				header.blockChecksums.emplace_back(checksumSize, '\0');
+				input.read(&header.blockChecksums.back()[0], checksumSize);
+				if (header.blockSizes.back() > maxBlockSize)
+					input.setstate(std::ios::failbit);
+			}
+			return header;
+		}
+
+		// The seek index was added in v2.6.
+		if (header.fileVersion >= FileVersion{ 2,6 } && (header.flags & FLAG_SEEK_INDEX))
+		{
+			header.seekIndex.interval = readVarint(input);
+			uint64_t count = readVarint(input);
+
+			// compress() writes one seek point for every interval of the file. The checksum doesn't cover them, a range would
+			// decode from the wrong place without a word.
+			if (header.seekIndex.interval == 0 || header.fileSize == 0 || count != (header.fileSize - 1) / header.seekIndex.interval + 1)
+			{
+				input.setstate(std::ios::failbit);
+				return header;
+			}
+
+			// The first seek point is the start of the stream, every one after it lies further on, and none past its end.
+			for (uint64_t i = 0; i < count && input.good(); i++)
+			{
+				uint64_t bitOffset = readVarint(input);
+				uint64_t previous = i == 0 ? 0 : header.seekIndex.bitOffsets.back();
+				if ((i == 0 && bitOffset != 0) || bitOffset < previous || bitOffset / 8 > header.compressedSize)
+				{
+					input.setstate(std::ios::failbit);
+					return header;
+				}
+				header.seekIndex.bitOffsets.push_back(bitOffset);
+			}
+		}
+
+		// Prebuilt tables were added in v2.7. The lengths are filled in by decompress(), which knows where to find the table.
+		if (header.fileVersion >= FileVersion{ 2,7 } && (header.flags & FLAG_STATIC_TABLE))
+		{
+			header.tableId = static_cast<uint32_t>(readVarint(input));
+			return header;
+		}
+
+		// An empty file has no codes. Older files have them as a count of pairs that reads back as 256, and the file ends before
+		// those. There is nothing to decode either way.
+		if (header.fileSize == 0)
+			return header;
+
+		readCodeLengths(input, header.codeLengths);
+		if (!huffman::validCodeLengths(header.codeLengths))
+		{
+			input.setstate(std::ios::failbit);
+			return header;
+		}
+
+		if (header.fileVersion < FileVersion{ 2,1 })
+			header.maxCodeLength = *std::max_element(header.codeLengths.begin(), header.codeLengths.end());
+		return header;
+	}
+
+	// Frequency table. There is at most one entry for every byte value.
 	uint32_t freqTableSize = readInt(input);
+	if (freqTableSize > 256)
+	{
+		input.setstate(std::ios::failbit);
+		return header;
+	}
 
-	for (unsigned int i = 0; i < freqTableSize; i++)
+	uint64_t total = 0;
+	for (unsigned int i = 0; i < freqTableSize && input.good(); i++)
 	{
 		char key;
 		input.get(key);
 		int value = readInt(input);
 
 		header.freqTable[key] = value;
+		total += static_cast<uint32_t>(value);
 	}
 
+	// The frequencies count every byte of the file once.
+	if (total != header.fileSize)
+		input.setstate(std::ios::failbit);
+
 	return header;
 }
 
-bool checkSig(std::ifstream& input)
+void readCodeLengths(std::istream& input, lengthTable& codeLengths)
+{
+	// See packCodeLengths for the layouts. Every byte value that isn't listed has no code.
+	uint8_t layout = input.get();
+
+	if (layout == 0)
+	{
+		unsigned int count = static_cast<uint8_t>(input.get()) + 1;
+		for (unsigned int i = 0; i < count; i++)
+		{
+			uint8_t character = input.get();
+			codeLengths[character] = input.get();
+		}
+	}
+	else if (layout == 1)
+	{
+		uint8_t first = input.get();
+		uint8_t last = input.get();
+		if (last < first)
+			return;
+
+		input.read(reinterpret_cast<char*>(&codeLengths[first]), last - first + 1);
+	}
+	else if (layout == 2)
+	{
+		uint8_t first = input.get();
+		uint8_t last = input.get();
+		for (unsigned int i = first; i <= last; i += 2)
+		{
+			uint8_t lengths = input.get();
+			codeLengths[i] = lengths >> 4;
+			if (i + 1 <= last)
+				codeLengths[i + 1] = lengths & 0x0F;
+		}
+	}
+}
+
+bool supportedVersion(FileVersion version)
+{
+	return version == legacyFileVersion || (version.major == curFileVersion.major && version.minor <= curFileVersion.minor);
+}
+
+bool checkSig(std::istream& input, std::ostream& errors)
 {
 	std::string signature;
 	signature.resize(uniqueSig.size());
@@ -365,26 +2078,55 @@ bool checkSig(std::ifstream& input)
 
 	if (signature != uniqueSig)
 	{
-		std::cerr << "ERROR: Invalid file.\n";
+		errors << "ERROR: Invalid file.\n";
 		return false;
 	}
 
 	return true;
 }
 
-void listContents(std::string filename)
+bool listContents(std::string filename)
 {
-	std::ifstream input(filename);
+	std::ifstream input(filename, std::ios::binary);
 
-	if (!checkSig(input)) return;
+	if (!checkSig(input, std::cerr)) return false;
 
 	Header header = readHeader(input);
+	if (!supportedVersion(header.fileVersion) || input.fail())
+	{
+		std::cerr << "ERROR: The header is corrupt.\n";
+		return false;
+	}
+
+	// Streamed files keep the sizes and hash in the trailer at the very end.
+	if (header.flags & FLAG_STREAMED)
+	{
+		input.seekg(-static_cast<int>(trailerSize(header.fileVersion) + header.hash.size()), input.end);
+		readTrailer(input, header);
+	}
 
 	std::cout << "Huffman Compression version: " << static_cast<unsigned int>(header.fileVersion.major) << "." << static_cast<unsigned int>(header.fileVersion.minor) << "\n"
 		<< "Original file name:          " << header.filename << "\n"
 		<< "Original file size:          " << (float)header.fileSize / 1024 << " KB" << "\n"
 		<< "Compressed file size:        " << (float)header.compressedSize / 1024 << " KB" << "\n"
-		<< "MD5 hash:                    " << header.hash << "\n";
+		<< "Checksum:                    " << (Checksum::name(header.checksumType) ? Checksum::name(header.checksumType) : "unknown") << " " << header.hash << "\n";
+
+	if (header.flags & FLAG_STATIC_TABLE)
+	{
+		const CodeTable* table = findTable(header.tableId);
+		std::cout << "Code table:                  " << (table ? table->name : "from a table file") << " " << std::hex << header.tableId << std::dec << "\n";
+	}
+
+	if (header.flags & FLAG_INTERLEAVED)
+		std::cout << "Streams per block:           " << header.streams << "\n";
+
+	if (header.flags & FLAG_RLE)
+		std::cout << "Run lengths:                 shortened before coding\n";
+
+	if (header.flags & FLAG_SEEK_INDEX)
+		std::cout << "Seek points:                 " << header.seekIndex.bitOffsets.size() << " every " << (float)header.seekIndex.interval / 1024 << " KB" << "\n";
+
+	return true;
 }
 
 
@@ -405,10 +2147,25 @@ std::string replaceExtension(std::string filename)
 	return filename;
 }
 
+std::string removeExtension(std::string filename)
+{
+	// Drop a trailing ".huf", or append ".out" so the output never has the same name as the input.
+	const std::string ext = ".huf";
+	if (filename.size() > ext.size() && filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0)
+	{
+		filename.erase(filename.size() - ext.size());
+	}
+	else
+	{
+		filename += ".out";
+	}
+	return filename;
+}
+
 std::string removePath(const std::string& filename)
 {
-	// Find the last "/" and return the sub string following it. Return the full string if there wasn't a "/".
-	size_t pathDiv = filename.find_last_of('/');
+	// Find the last "/" or "\" and return the sub string following it. Return the full string if there wasn't either.
+	size_t pathDiv = filename.find_last_of("/\\");
 	if (pathDiv != std::string::npos)
 	{
 		return filename.substr(pathDiv + 1);
@@ -426,7 +2183,18 @@ void pathEndSlash(std::string& path)
 
 
 
-bool writeInt(std::ofstream& output, uint32_t num)
+void setBinaryStdio()
+{
+	// Windows translates line endings on stdin and stdout unless they are switched to binary.
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+}
+
+
+
+bool writeInt(std::ostream& output, uint32_t num)
 {
 	// Write a 4 byte integer in Big Endian
 
@@ -446,7 +2214,7 @@ bool writeInt(std::ofstream& output, uint32_t num)
 	return true;
 }
 
-uint32_t readInt(std::ifstream& input)
+uint32_t readInt(std::istream& input)
 {
 	// Read a 4 byte integer in Big Endian
 
@@ -464,4 +2232,145 @@ uint32_t readInt(std::ifstream& input)
 		| (data[0] << 24);
 
 	return num;
-}
\ No newline at end of file
+}
+bool writeLong(std::ostream& output, uint64_t num)
+{
+	// Write an 8 byte integer in Big Endian, the high half first.
+	writeInt(output, static_cast<uint32_t>(num >> 32));
+	return writeInt(output, static_cast<uint32_t>(num));
+}
+
+uint64_t readLong(std::istream& input)
+{
+	uint64_t high = readInt(input);
+	uint64_t low = readInt(input);
+	return (high << 32) | low;
+}
+
+bool writeVarint(std::ostream& output, uint64_t num, unsigned int width)
+{
+	// 7 bits per byte, lowest bits first. The top bit is set on every byte but the last. Padding the number out to width
+	// bytes only adds bytes with no bits set other than the top one, so readVarint() reads it back the same either way.
+	unsigned int length = std::max(varintSize(num), width);
+
+	for (unsigned int i = 0; i + 1 < length; i++)
+	{
+		output.put(static_cast<char>((num & 0x7F) | 0x80));
+		num >>= 7;
+	}
+	output.put(static_cast<char>(num & 0x7F));
+
+	return true;
+}
+
+uint64_t readVarint(std::istream& input)
+{
+	uint64_t num = 0;
+	for (unsigned int shift = 0; shift < 64; shift += 7)
+	{
+		int byte = input.get();
+		if (byte == EOF)
+			return 0;
+
+		num |= static_cast<uint64_t>(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+			return num;
+	}
+
+	// More than 10 bytes can't be a 64 bit number.
+	input.setstate(std::ios::failbit);
+	return 0;
+}
+
+bool readVarint(const char*& data, const char* end, uint64_t& num)
+{
+	// Same as above, for a varint in memory. Stops at end instead of reading past it.
+	num = 0;
+	for (unsigned int shift = 0; shift < 64 && data < end; shift += 7)
+	{
+		uint8_t byte = static_cast<uint8_t>(*data++);
+		num |= static_cast<uint64_t>(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+			return true;
+	}
+	return false;
+}
+
+unsigned int varintSize(uint64_t num)
+{
+	unsigned int length = 1;
+	while (num >= 0x80)
+	{
+		num >>= 7;
+		length++;
+	}
+	return length;
+}
+
+uint64_t readSize(std::istream& input, FileVersion version)
+{
+	return version >= FileVersion{ 2,5 } ? readVarint(input) : readInt(input);
+}
+
+uint64_t maxEncodedSize(uint64_t size, uint64_t pieces)
+{
+	// No code is longer than the bit writer takes, and every piece adds its code lengths, a padding byte for each of its streams
+	// and the sizes of all but one of them.
+	return size * (huffman::MAX_WRITER_CODE_LENGTH / 8) + pieces * (MAX_PACKED_LENGTHS_SIZE + huffman::MAX_STREAMS * (1 + huffman::STREAM_SIZE_BYTES));
+}
+
+size_t trailerSize(FileVersion version)
+{
+	return version >= FileVersion{ 2,5 } ? 8 + 8 : 4 + 4;
+}
+
+uint64_t streamSize(const Header& header)
+{
+	return header.compressedSize + 1;
+}
+
+bool parseRange(const std::string& text, uint64_t& offset, uint64_t& length)
+{
+	// Each number can end in K, M, G or T, multiples of 1024 like --block-size takes.
+	auto parseSize = [](const std::string& number, uint64_t& size)
+	{
+		size_t digits = 0;
+		size = 0;
+		while (digits < number.size() && number[digits] >= '0' && number[digits] <= '9')
+		{
+			if (size > (UINT64_MAX - 9) / 10)
+				return false;
+			size = size * 10 + (number[digits++] - '0');
+		}
+		if (digits == 0)
+			return false;
+
+		std::string unit = number.substr(digits);
+		unsigned int shift = 0;
+		if (unit == "K" || unit == "k" || unit == "KB" || unit == "kb")
+			shift = 10;
+		else if (unit == "M" || unit == "m" || unit == "MB" || unit == "mb")
+			shift = 20;
+		else if (unit == "G" || unit == "g" || unit == "GB" || unit == "gb")
+			shift = 30;
+		else if (unit == "T" || unit == "t" || unit == "TB" || unit == "tb")
+			shift = 40;
+		else if (!unit.empty())
+			return false;
+
+		if (size > (UINT64_MAX >> shift))
+			return false;
+		size <<= shift;
+		return true;
+	};
+
+	size_t colon = text.find(':');
+	if (!parseSize(text.substr(0, colon), offset))
+		return false;
+
+	// Without a length the range runs to the end of the file.
+	length = UINT64_MAX;
+	if (colon == std::string::npos || colon + 1 == text.size())
+		return true;
+	return parseSize(text.substr(colon + 1), length);
+}
@@ -2,8 +2,22 @@
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <algorithm>
+#include <deque>
+#include <sstream>
+#include <cstring>
 #include <stdio.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 #include "huffman.h"
+#include "threadpool.h"
+#include "pipeline.h"
+#include "mappedfile.h"
+#include "progress.h"
+#include "stats.h"
+#include "checksum.h"
 #include "ThirdParty/CLI11.hpp"
 #include "ThirdParty/md5.h"
 
@@ -13,33 +27,192 @@ struct FileVersion
 {
     uint8_t major;
     uint8_t minor;
+
+    bool operator==(const FileVersion& other) const { return major == other.major && minor == other.minor; }
+    bool operator!=(const FileVersion& other) const { return !(*this == other); }
+    bool operator<(const FileVersion& other) const { return major != other.major ? major < other.major : minor < other.minor; }
+    bool operator>=(const FileVersion& other) const { return !(*this < other); }
 };
 
 struct Header
 {
     FileVersion fileVersion;
+    // Files before v2.4 always use MD5.
+    Checksum::Type checksumType;
+    // The checksum of the original file, or for blocked and streamed v2.4 files, the checksum of the block checksums.
     std::string hash;
-    int fileSize;
-    int compressedSize;
+    uint64_t fileSize;
+    uint64_t compressedSize;
     std::string filename;
+    // v1.1 files store the frequency table, v2 files only store the canonical code lengths.
     std::map<uint8_t, uint32_t> freqTable;
+    lengthTable codeLengths;
+    unsigned int maxCodeLength;
+
+    // FLAG_ values combined.
+    uint8_t flags;
+
+    // Size of each block before compression, 0 when the file is a single stream. Blocks carry their own code lengths.
+    uint32_t blockSize;
+    std::vector<uint64_t> blockSizes;
+    // The checksum of each block's original data. Only v2.4 files have them.
+    std::vector<std::string> blockChecksums;
+
+    // Where decoding can start in the stream of a single stream file. Only used with FLAG_SEEK_INDEX.
+    huffman::SeekIndex seekIndex;
+
+    // The prebuilt table the file was coded with. Only used with FLAG_STATIC_TABLE.
+    uint32_t tableId;
+
+    // Number of interleaved streams every block is split into. 1 unless the file has FLAG_INTERLEAVED.
+    unsigned int streams;
 
     Header()
         : fileVersion{ 0, 0 }
+        , checksumType(Checksum::Type::MD5)
         , hash("")
         , fileSize(0)
         , compressedSize(0)
         , filename("")
         , freqTable{ }
+        , codeLengths{ }
+        , maxCodeLength(0)
+        , flags(0)
+        , blockSize(0)
+        , blockSizes{ }
+        , blockChecksums{ }
+        , seekIndex{ 0, { } }
+        , tableId(0)
+        , streams(1)
+    { }
+};
+
+// encodeBlock() and decodeBlock() compute the checksum of a block's original data on the thread that codes it.
+struct Block
+{
+    std::string data;
+    std::string checksum;
+};
+
+// Uncompressed bytes between the seek points of a single stream file.
+constexpr unsigned int DEFAULT_SEEK_INTERVAL = 1024 * 1024;
+
+// Unmapped inputs up to this size are read into memory once instead of being read for every pass.
+constexpr uint64_t DEFAULT_MEM_LIMIT = 512 * 1024 * 1024;
+
+// Size of the chunks single stream files are read, coded and written in. Big enough that every read and write is worth a trip to the disk.
+constexpr size_t DEFAULT_CHUNK_SIZE = 1024 * 1024;
+
+// Settings from the command line that compress() and decompress() need.
+struct Options
+{
+    bool overwrite;
+    bool keep;
+    unsigned int threads;
+    uint64_t blockSize;
+    bool useMmap;
+    uint64_t memLimit;
+    Progress::Format progress;
+    bool stats;
+    bool statsJson;
+    Checksum::Type checksum;
+    // Members of an archive to extract. Every member is extracted when it's empty.
+    std::vector<std::string> members;
+    // Archives share one table of code lengths between all of their members.
+    bool sharedTable;
+    // Uncompressed bytes between the seek points of a single stream file, 0 for no seek index.
+    uint64_t seekInterval;
+    // Only decompress rangeLength bytes from rangeOffset on. The length is cut off at the end of the file.
+    bool range;
+    uint64_t rangeOffset;
+    uint64_t rangeLength;
+    // A built in table or a table file to code single stream files with. The table file is also where decompress() looks for
+    // tables that aren't built in.
+    std::string tableName;
+    std::string tableFile;
+    // Blocks are split into this many interleaved streams so they decode faster, see Encoder::encodeInterleaved().
+    unsigned int streams;
+    // Single stream files are read, coded and written in chunks of this size.
+    size_t chunkSize;
+    // Blocks are coded in parts wherever their statistics change, see splitBlock().
+    bool split;
+    // Runs of the same byte are shortened before the blocks are coded, see rle.h.
+    bool rle;
+
+    Options()
+        : overwrite(false)
+        , keep(false)
+        , threads(1)
+        , blockSize(0)
+        , useMmap(true)
+        , memLimit(DEFAULT_MEM_LIMIT)
+        , progress(Progress::Format::Bar)
+        , stats(false)
+        , statsJson(false)
+        , checksum(Checksum::Type::CRC32C)
+        , members{ }
+        , sharedTable(false)
+        , seekInterval(DEFAULT_SEEK_INTERVAL)
+        , range(false)
+        , rangeOffset(0)
+        , rangeLength(UINT64_MAX)
+        , tableName("")
+        , tableFile("")
+        , streams(1)
+        , chunkSize(DEFAULT_CHUNK_SIZE)
+        , split(false)
+        , rle(false)
     { }
 };
 
 // The largest number of bytes that can be sent to the encoder.
 constexpr unsigned int MAX_BUFFER = 8192;
 
+// The most bytes packCodeLengths() can produce: a layout byte, a count and a pair for each of the 256 byte values.
+constexpr unsigned int MAX_PACKED_LENGTHS_SIZE = 2 + 2 * 256;
+
+// First bytes of blocks that don't start with code lengths, numbered on from the code length layouts (since v2.9).
+// A stored block is the original data as it is, for data that coding wouldn't make any smaller.
+constexpr uint8_t BLOCK_STORED = 3;
+// A split block is coded in parts that each have their own code lengths, see splitBlock().
+constexpr uint8_t BLOCK_SPLIT = 4;
+
+// Split blocks are counted in units of this many bytes. A part is always a whole number of units, apart from the last.
+constexpr size_t SPLIT_UNIT = 64 * 1024;
+
+// The bytes a part has to save before a block is split there: its entry in the part table, roughly.
+constexpr uint64_t SPLIT_PART_OVERHEAD = 8;
+
+// The file was written in one pass to a stream that can't seek. Blocks carry their own sizes and the hash is in the trailer.
+constexpr uint8_t FLAG_STREAMED = 1 << 0;
+
+// A single stream file with a seek index in its header, so a range can be decoded without decoding everything before it.
+constexpr uint8_t FLAG_SEEK_INDEX = 1 << 1;
+
+// A single stream file coded with a prebuilt table (see tables.h). The header has the table's ID in place of the code lengths.
+constexpr uint8_t FLAG_STATIC_TABLE = 1 << 2;
+
+// The blocks of a blocked or streamed file are each split into Header::streams interleaved bitstreams.
+constexpr uint8_t FLAG_INTERLEAVED = 1 << 3;
+
+// The runs in every block of a blocked or streamed file were shortened before it was coded, see rle.h.
+constexpr uint8_t FLAG_RLE = 1 << 4;
+
+// The most bytes decompressRange() decodes at once, rounded to whole seek intervals.
+constexpr unsigned int RANGE_PIECE_SIZE = 8 * 1024 * 1024;
+
+// Block size used when more than one thread is requested without giving a block size.
+constexpr unsigned int DEFAULT_BLOCK_SIZE = 4 * 1024 * 1024;
+
+// The biggest block size there is, headers store it in 32 bits.
+constexpr uint64_t MAX_BLOCK_SIZE = UINT32_MAX;
+
 // The current version of the compression program. Useful for confirming which version 
 // of this program wrote the compressed file so it can be handled correctly.
-constexpr FileVersion curFileVersion = { 1,1 };
+constexpr FileVersion curFileVersion = { 2,10 };
+
+// The last version that stored the full frequency table. Files written by it can still be decompressed.
+constexpr FileVersion legacyFileVersion = { 1,1 };
 
 // A unique byte set that is placed at the start of a compressed file. This is the first thing checked when decompressing a file.
 const std::string uniqueSig = "ANHC";
@@ -50,28 +223,151 @@ const std::string uniqueSig = "ANHC";
 
 // The meat of the program. These functions handle all the file reading and writing.
 
-void compress(std::string filename, std::string path);
+// A blockSize of 0 compresses the file as a single stream, anything else splits it into blocks that are encoded on threads.
+// The input is memory mapped unless options.useMmap is off or mapping fails, in which case it's streamed.
+// Progress, stats and other messages are printed to messages, errors to errors. Batch files give each their own streams, so files
+// running side by side never share one, not even its formatting.
+// Returns false if the file couldn't be compressed, after printing why.
+bool compress(std::string filename, std::string path, const Options& options, std::ostream& messages, std::ostream& errors);
+
+// Prints that the output couldn't be written, e.g. on a full disk, closes it and deletes it. Always returns false.
+bool removeOutput(std::ofstream& output, const std::string& outFilename, std::ostream& errors);
+
+// Reads the input once, one block at a time, and hands the blocks to a thread pool. The blocks and the index are written in order.
+// data is the mapped input, or nullptr to read the blocks from the stream.
+// Every thread reports the blocks it finishes to progress. split is passed on to encodeBlock().
+// Returns false if the output failed.
+bool compressBlocks(std::ifstream& input, const char* data, uint64_t fileLen, std::ofstream& output, Header& header, unsigned int threads, bool split, Progress& progress, Stats& stats);
+
+// Reads the input once without seeking, for stdin. Each block is written with its sizes in front of it and the file ends with a trailer.
+// Returns false if the output failed.
+bool compressStream(std::istream& input, std::ostream& output, Header& header, unsigned int threads, bool split, Progress& progress, Stats& stats);
+
+// Compresses one block on its own, see packBlock(). With split, a block whose statistics change part way through is coded
+// in parts instead, see splitBlock(). With rle its runs are shortened first and it starts with the length of the result
+// as a varint, or its own length if that didn't make it shorter.
+Block encodeBlock(const char* data, size_t size, unsigned int maxCodeLength, Checksum::Type checksumType, unsigned int streams = 1, bool split = false, bool rle = false);
+
+// A block coded from its histogram: its code lengths followed by its stream, padded to a whole byte. With more than one stream
+// the code lengths are followed by the output of Encoder::encodeInterleaved() instead. When that wouldn't be smaller than the
+// data itself, it's BLOCK_STORED followed by the data.
+std::string packBlock(const char* data, size_t size, const huffman::Histogram& histogram, unsigned int maxCodeLength, unsigned int streams);
+
+// The bytes a stream of bits takes once it's split into streams and padded, without the code lengths.
+uint64_t codedSize(uint64_t bits, unsigned int streams);
+
+// The bytes packBlock() will make of size bytes with this histogram, worked out from the code lengths alone.
+uint64_t packedSize(const huffman::Histogram& histogram, uint64_t size, unsigned int maxCodeLength, unsigned int streams);
+
+// Splits a block into parts of SPLIT_UNIT multiples wherever coding them apart is smaller, and packs each part on its own.
+// Returns a normal block if no split pays off.
+std::string splitBlock(const char* data, size_t size, unsigned int maxCodeLength, unsigned int streams);
 
 // This function feeds the encoder chunks of data so that it can populate its frequency table and produce a huffman tree.
-// It also feeds the MD5 hash generator. This isn't exactly related to the function as a whole, but it means the file only needs to be read twice.
-void createPrefix(std::ifstream& input, unsigned int fileLen, huffman::Encoder& encoder, MD5& md5);
+// It also feeds the MD5 hash generator. This isn't exactly related to the function as a whole, but it means the file only needs to be read twice when it doesn't fit in memory.
+void createPrefix(std::ifstream& input, uint64_t fileLen, huffman::Encoder& encoder, Checksum& checksum, Stats& stats, size_t chunkSize);
+
+// Takes all of the necessary data for decompression and writes it to the output. The size of the header only depends on the filename,
+// code lengths and block count, so it can be written again over itself once the hash and compressed sizes are known.
+void writeHeader(std::ostream& output, const Header& header);
+
+// Writes and reads the sizes and hash at the end of a streamed file.
+void writeTrailer(std::ostream& output, const Header& header);
+void readTrailer(std::istream& input, Header& header);
 
-// Takes all of the necessary data for decompression and writes it to the output. Returns the offset for compressed size.
-int writeHeader(std::ofstream& output, unsigned int fileLen, std::string filename, std::map<uint8_t, uint32_t> freqTable, MD5& md5);
+// Serializes the code lengths in whichever layout is smallest.
+std::string packCodeLengths(const lengthTable& codeLengths, unsigned int maxCodeLength);
 
-// The actual compression of the file.
-void encodeFile(std::ifstream& input, unsigned int fileLen, std::ofstream& output, huffman::Encoder& encoder);
+// The actual compression of the file, chunkSize bytes at a time. The input is read ahead and the output written behind on their
+// own threads (see pipeline.h). Each chunk is reported to progress once it's encoded.
+// Each chunk is also added to checksum if it isn't nullptr, for files whose checksum wasn't taken in an earlier pass.
+// Returns false if the output failed.
+bool encodeFile(std::ifstream& input, uint64_t fileLen, std::ofstream& output, huffman::Encoder& encoder, Progress& progress, Stats& stats, size_t chunkSize, Checksum* checksum = nullptr);
+bool encodeFile(const char* data, uint64_t fileLen, std::ofstream& output, huffman::Encoder& encoder, Progress& progress, Stats& stats, size_t chunkSize, Checksum* checksum = nullptr);
+
+// Codes a chunk straight into the next buffer of writer and queues it. encodeToWriter() with no data finishes the stream,
+// decodeToWriter() also adds the decoded chunk to checksum and progress, and returns its size.
+void encodeToWriter(huffman::Encoder& encoder, const char* data, size_t size, AsyncWriter& writer, Stats& stats);
+size_t decodeToWriter(huffman::Decoder& decoder, const char* data, size_t size, AsyncWriter& writer, Checksum& checksum, Progress& progress, Stats& stats);
+
+// Run a chunk through the buffer based coder API, growing buffer to the coder's bound first. Return the bytes written to buffer.
+// encodeChunk() with no data finishes the stream.
+size_t encodeChunk(huffman::Encoder& encoder, const char* data, size_t size, std::string& buffer);
+size_t decodeChunk(huffman::Decoder& decoder, const char* data, size_t size, std::string& buffer);
 
 // Includes constant checks for validity in the input file. If it makes it all the way through,
-// a final check against the MD5 hash will delete the newly written file if the hash doesn't match.
-void decompress(std::string filename, std::string path, bool overwriteFlag, bool keepFlag);
+// a final check against the checksum will delete the newly written file if it doesn't match.
+// Blocked files are decoded on threads, single stream files always use one thread.
+// Messages and errors are printed like compress() prints them. Decompressing to stdout prints the messages to errors instead.
+// Returns false if the file couldn't be decompressed, didn't match its checksum or couldn't be written, after printing why.
+bool decompress(std::string filename, std::string path, const Options& options, std::ostream& messages, std::ostream& errors);
+
+// The checks decompress() makes on what readHeader() read, before it creates the output. Files coded with a prebuilt table get its
+// code lengths, tables that aren't built in are read from tableFile. Prints an error and returns false if the file can't be decoded.
+bool checkHeader(const std::istream& input, Header& header, const std::string& tableFile, std::ostream& errors);
+
+// Decodes everything after the header with decompressRange(), decompressStream(), decompressBlocks() or decodeFile(), whichever
+// the file and options call for. data is the mapped compressed data after the header, or nullptr to read it from the stream.
+// Returns false if the data couldn't be decoded to the end or a range failed its checks, whole files are then checked against
+// header.hash.
+bool decompressData(std::istream& input, const char* data, size_t dataLen, std::ostream& output, Header& header, Checksum& checksum, const Options& options, Progress& progress, Stats& stats, std::ostream& errors);
+
+// Decodes a single stream file. data is the mapped compressed data after the header, or nullptr to read it from the stream.
+// Like encodeFile(), the reads and writes happen on their own threads while the chunks are decoded.
+// Returns false if the stream decoded to fewer bytes than header.fileSize, or the output failed.
+bool decodeFile(std::istream& input, const char* data, size_t dataLen, std::ostream& output, const Header& header, Checksum& checksum, Progress& progress, Stats& stats, size_t chunkSize, std::ostream& errors);
+
+// Hands the blocks of a blocked file to a thread pool. They are written in order. v2.4 blocks are checked against their
+// own checksums on the threads, older files are hashed in order as they are written. Returns false if a block didn't match its checksum
+// or came out short.
+bool decompressBlocks(std::istream& input, const char* data, size_t dataLen, std::ostream& output, const Header& header, Checksum& checksum, unsigned int threads, Progress& progress, Stats& stats, std::ostream& errors);
+
+// Decodes the blocks of a streamed file until the end marker, then fills in the header from the trailer. Returns false if a block
+// is bigger than the header allows or the file ends before the end marker, the trailer isn't read then, or if a block didn't match
+// its checksum or came out short.
+bool decompressStream(std::istream& input, std::ostream& output, Header& header, Checksum& checksum, unsigned int threads, Progress& progress, Stats& stats, std::ostream& errors);
+
+// Adds a decoded block to the file's checksum and writes it to the output. v2.4 blocks come with the checksum their thread computed,
+// which is compared against expected and added in place of the data. Older files hash the data itself. A mismatch, or a block
+// shorter than length, is printed to errors and returns false.
+bool writeDecoded(std::ostream& output, const Header& header, const Block& decoded, uint64_t length, const std::string& expected, size_t index, Checksum& checksum, Stats& stats, std::ostream& errors);
+
+// Adds a chunk of decoded data to the file's checksum and writes it to the output.
+void writeChunk(std::ostream& output, const char* decoded, size_t size, Checksum& checksum, Stats& stats);
+
+// The checksum each block of a blocked or streamed file carries. None before v2.4.
+Checksum::Type blockChecksumType(const Header& header);
+
+// The reverse of encodeBlock(). blockLen is the size of the block before compression.
+Block decodeBlock(const char* block, size_t size, unsigned int maxCodeLength, unsigned int blockLen, Checksum::Type checksumType, unsigned int streams = 1, bool rle = false);
+
+// The reverse of packBlock() and splitBlock(), unpackBlock() handles either. Decode into output, which has room for the length bytes the block had before
+// compression, and return the bytes decoded. Corrupt blocks come out short.
+size_t unpackBlock(const char* block, size_t size, unsigned int maxCodeLength, unsigned int streams, char* output, size_t length);
+size_t unpackSplit(const char* block, size_t size, unsigned int maxCodeLength, unsigned int streams, char* output, size_t length);
 
-// Returns a header object containing all of the header data.
-Header readHeader(std::ifstream& input);
+// Creates the decoder for a single stream file, from the frequency table of v1.1 files or the code lengths.
+huffman::Decoder makeDecoder(const Header& header, Stats& stats);
 
-bool checkSig(std::ifstream& filename);
+// Decompresses only the range of the original file Options gives. Single stream files with a seek index start at the seek point
+// in front of the range, blocked and streamed files only decode the blocks that overlap it. The input is only ever read forward,
+// so a range can also be taken from stdin. The file's checksum can't be checked, the checksums of decoded blocks are.
+// Returns false if a block didn't match its checksum or the range came out short, after printing why.
+bool decompressRange(std::istream& input, const char* data, size_t dataLen, std::ostream& output, const Header& header, const Options& options, Progress& progress, Stats& stats, std::ostream& errors);
 
-void listContents(std::string filename);
+// Returns a header object containing all of the header data. Only the version is read if it isn't one this program can decompress.
+Header readHeader(std::istream& input);
+
+// True for the legacy version and every v2 version up to the current one.
+bool supportedVersion(FileVersion version);
+
+// Reads the code lengths of a v2 header.
+void readCodeLengths(std::istream& input, lengthTable& codeLengths);
+
+bool checkSig(std::istream& input, std::ostream& errors);
+
+// Prints the header of a compressed file. Returns false if it isn't one or the header is corrupt.
+bool listContents(std::string filename);
 
 
 
@@ -80,12 +376,23 @@ void listContents(std::string filename);
 // Replaces an existing extension or appends .huf to the end of a filename to distinguish compressed files from their originals.
 std::string replaceExtension(std::string filename);
 
+// Turns the name of a compressed file back into a name for the decompressed one.
+std::string removeExtension(std::string filename);
+
 // Removes the path to a file from a string
 std::string removePath(const std::string& filename);
 
 // Make sure the path ends with a "/".
 void pathEndSlash(std::string& path);
 
+// Reads the OFFSET:LENGTH of --range. The length can be left out, which makes it run to the end of the file.
+bool parseRange(const std::string& text, uint64_t& offset, uint64_t& length);
+
+
+
+
+// Stops Windows from translating line endings on stdin and stdout.
+void setBinaryStdio();
 
 
 
@@ -101,5 +408,33 @@ These two functions use an array of uint8_ts to control the order the file is in
 local integers to big endian and vice versa, regardless of local architecture.
 */
 
-bool writeInt(std::ofstream& output, uint32_t num);
-uint32_t readInt(std::ifstream& input);
\ No newline at end of file
+bool writeInt(std::ostream& output, uint32_t num);
+uint32_t readInt(std::istream& input);
+
+// The same for 8 byte integers.
+bool writeLong(std::ostream& output, uint64_t num);
+uint64_t readLong(std::istream& input);
+
+// Sizes and counts are written as varints since v2.5, so small numbers take one byte and files bigger than 4 GB still fit.
+// width pads the number to at least that many bytes, for a field that is written again once its value is known.
+bool writeVarint(std::ostream& output, uint64_t num, unsigned int width = 1);
+uint64_t readVarint(std::istream& input);
+
+// Reads a varint from memory, moving data past it. False if it runs past end or is too long.
+bool readVarint(const char*& data, const char* end, uint64_t& num);
+
+// The number of bytes writeVarint() needs for num without padding.
+unsigned int varintSize(uint64_t num);
+
+// Reads a size the way a file of this version stored it.
+uint64_t readSize(std::istream& input, FileVersion version);
+
+// The most bytes size bytes can be compressed into when split into this many independently coded pieces.
+// Sizes the padding of fields that are written before compression is done.
+uint64_t maxEncodedSize(uint64_t size, uint64_t pieces);
+
+// Size of the trailer at the end of streamed files, without the checksum.
+size_t trailerSize(FileVersion version);
+
+// Bytes of the stream of a single stream file. compressedSize leaves out a last byte that is all padding, it's still written.
+uint64_t streamSize(const Header& header);
\ No newline at end of file
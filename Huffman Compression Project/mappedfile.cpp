@@ -0,0 +1,152 @@
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+    : m_data(nullptr)
+    , m_size(0)
+    , m_open(false)
+#ifdef _WIN32
+    , m_file(INVALID_HANDLE_VALUE)
+    , m_mapping(nullptr)
+#else
+    , m_fd(-1)
+#endif
+{ }
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string& filename)
+{
+    close();
+
+    m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+        return false;
+
+    // Pipes and consoles can't be mapped.
+    LARGE_INTEGER fileSize;
+    if (GetFileType(m_file) != FILE_TYPE_DISK || !GetFileSizeEx(m_file, &fileSize) || static_cast<unsigned long long>(fileSize.QuadPart) > SIZE_MAX)
+    {
+        close();
+        return false;
+    }
+
+    m_size = static_cast<size_t>(fileSize.QuadPart);
+    m_open = true;
+
+    // Windows refuses to map an empty file, which is fine as there's nothing to read.
+    if (m_size == 0)
+        return true;
+
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping != nullptr)
+        m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+
+    if (m_data == nullptr)
+    {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (m_data != nullptr)
+        UnmapViewOfFile(m_data);
+    if (m_mapping != nullptr)
+        CloseHandle(m_mapping);
+    if (m_file != INVALID_HANDLE_VALUE)
+        CloseHandle(m_file);
+
+    m_data = nullptr;
+    m_mapping = nullptr;
+    m_file = INVALID_HANDLE_VALUE;
+    m_size = 0;
+    m_open = false;
+}
+
+#else
+
+bool MappedFile::open(const std::string& filename)
+{
+    close();
+
+    m_fd = ::open(filename.c_str(), O_RDONLY);
+    if (m_fd < 0)
+        return false;
+
+    // Pipes and devices can't be mapped.
+    struct stat info;
+    if (fstat(m_fd, &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        close();
+        return false;
+    }
+
+    m_size = static_cast<size_t>(info.st_size);
+    m_open = true;
+
+    // mmap() refuses a length of 0, which is fine as there's nothing to read.
+    if (m_size == 0)
+        return true;
+
+    void* mapping = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        close();
+        return false;
+    }
+
+    // Every pass reads the file front to back.
+    madvise(mapping, m_size, MADV_SEQUENTIAL);
+    m_data = static_cast<const char*>(mapping);
+
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (m_data != nullptr)
+        munmap(const_cast<char*>(m_data), m_size);
+    if (m_fd >= 0)
+        ::close(m_fd);
+
+    m_data = nullptr;
+    m_fd = -1;
+    m_size = 0;
+    m_open = false;
+}
+
+#endif
+
+bool MappedFile::isOpen() const
+{
+    return m_open;
+}
+
+const char* MappedFile::data() const
+{
+    return m_data;
+}
+
+size_t MappedFile::size() const
+{
+    return m_size;
+}
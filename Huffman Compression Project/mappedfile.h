@@ -0,0 +1,47 @@
+#pragma once
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+/*
+Read only memory mapping of a whole file.
+
+Mapping lets the frequency pass, the hash and the encoder all read the file in place, instead of copying it
+into a buffer with std::ifstream::read on every pass. Only regular files can be mapped. Pipes, devices and
+files too big for the address space fail to open, and the caller is expected to fall back to streaming.
+*/
+
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Maps the whole file. Returns false if it couldn't be mapped.
+    bool open(const std::string& filename);
+
+    // Unmaps the file. Called by the destructor.
+    void close();
+
+    // True once open() succeeded. An empty file is open but has no data.
+    bool isOpen() const;
+
+    const char* data() const;
+    size_t size() const;
+
+private:
+    const char* m_data;
+    size_t m_size;
+    bool m_open;
+
+#ifdef _WIN32
+    // HANDLEs, kept as void* so windows.h doesn't leak into every file that includes this one.
+    void* m_file;
+    void* m_mapping;
+#else
+    int m_fd;
+#endif
+};
@@ -0,0 +1,153 @@
+#include "pipeline.h"
+#include <algorithm>
+
+AsyncReader::AsyncReader(std::istream& input, uint64_t length, size_t chunkSize, unsigned int buffers)
+    : m_input(input)
+    , m_remaining(length)
+    , m_chunkSize(std::max<size_t>(chunkSize, 1))
+    , m_buffers(std::max(buffers, 2U))
+    , m_read(0)
+    , m_released(0)
+    , m_holding(false)
+    , m_done(length == 0)
+    , m_stopping(false)
+{
+    m_thread = std::thread(&AsyncReader::readLoop, this);
+}
+
+AsyncReader::~AsyncReader()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_condition.notify_all();
+    m_thread.join();
+}
+
+const std::string& AsyncReader::next()
+{
+    static const std::string empty;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_holding)
+    {
+        m_released++;
+        m_holding = false;
+        m_condition.notify_all();
+    }
+
+    m_condition.wait(lock, [this]() { return m_read > m_released || m_done; });
+    if (m_read == m_released)
+        return empty;
+
+    m_holding = true;
+    return m_buffers[m_released % m_buffers.size()];
+}
+
+void AsyncReader::readLoop()
+{
+    while (true)
+    {
+        std::string* buffer;
+        size_t size;
+        {
+            // The buffer the caller is holding counts as taken, so it's never read over.
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this]() { return m_stopping || m_done || m_read - m_released < m_buffers.size(); });
+            if (m_stopping || m_done)
+                return;
+
+            buffer = &m_buffers[m_read % m_buffers.size()];
+            size = static_cast<size_t>(std::min<uint64_t>(m_remaining, m_chunkSize));
+        }
+
+        // The stream is only touched by this thread until it's done, so it's read without the lock.
+        buffer->resize(size);
+        m_input.read(&(*buffer)[0], size);
+        buffer->resize(static_cast<size_t>(m_input.gcount()));
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_remaining -= buffer->size();
+        if (!buffer->empty())
+            m_read++;
+
+        // A short read is the end of the stream.
+        if (buffer->size() < size || m_remaining == 0)
+            m_done = true;
+        m_condition.notify_all();
+    }
+}
+
+AsyncWriter::AsyncWriter(std::ostream& output, unsigned int buffers)
+    : m_output(output)
+    , m_buffers(std::max(buffers, 2U))
+    , m_sizes(m_buffers.size(), 0)
+    , m_submitted(0)
+    , m_written(0)
+    , m_stopping(false)
+{
+    m_thread = std::thread(&AsyncWriter::writeLoop, this);
+}
+
+AsyncWriter::~AsyncWriter()
+{
+    finish();
+}
+
+std::string& AsyncWriter::acquire()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_condition.wait(lock, [this]() { return m_submitted - m_written < m_buffers.size(); });
+    return m_buffers[m_submitted % m_buffers.size()];
+}
+
+void AsyncWriter::submit(size_t size)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_sizes[m_submitted % m_buffers.size()] = size;
+        m_submitted++;
+    }
+    m_condition.notify_all();
+}
+
+bool AsyncWriter::finish()
+{
+    if (m_thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_condition.notify_all();
+        m_thread.join();
+    }
+    return m_output.good();
+}
+
+void AsyncWriter::writeLoop()
+{
+    while (true)
+    {
+        const std::string* buffer;
+        size_t size;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this]() { return m_stopping || m_written < m_submitted; });
+            if (m_written == m_submitted)
+                return;
+
+            buffer = &m_buffers[m_written % m_buffers.size()];
+            size = m_sizes[m_written % m_buffers.size()];
+        }
+
+        m_output.write(buffer->data(), size);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_written++;
+        }
+        m_condition.notify_all();
+    }
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/*
+Background reading and writing for the single stream coders.
+
+Coding a stream one chunk at a time on one thread leaves the disk idle while a chunk is coded and the CPU idle while one is
+read or written. AsyncReader reads ahead on its own thread into a ring of buffers, AsyncWriter writes behind on its own
+thread from another ring. The coder in between only waits when the disk really is slower than it is.
+
+Both rings are a fixed set of buffers that are reused for every chunk, so nothing is allocated once they are full size.
+*/
+
+// Number of buffers in each ring: one with the coder, one with the I/O thread and the rest to absorb uneven speeds.
+constexpr unsigned int IO_BUFFERS = 4;
+
+class AsyncReader
+{
+public:
+    // Starts reading up to length bytes of input in chunks of chunkSize. UINT64_MAX reads until the end of the stream.
+    AsyncReader(std::istream& input, uint64_t length, size_t chunkSize, unsigned int buffers = IO_BUFFERS);
+
+    // Stops the reader thread. Anything it read ahead is lost, the input is left wherever it got to.
+    ~AsyncReader();
+
+    AsyncReader(const AsyncReader&) = delete;
+    AsyncReader& operator=(const AsyncReader&) = delete;
+
+    // Hands back the last chunk and waits for the next one. It stays valid until the next call. Empty once the input ends.
+    const std::string& next();
+
+private:
+    std::istream& m_input;
+    uint64_t m_remaining;
+    size_t m_chunkSize;
+
+    std::vector<std::string> m_buffers;
+    // Chunks read and chunks handed back. Chunk i is in buffer i % m_buffers.size().
+    uint64_t m_read;
+    uint64_t m_released;
+    // True while the caller holds the chunk m_released.
+    bool m_holding;
+    bool m_done;
+    bool m_stopping;
+
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::thread m_thread;
+
+    // Run by the reader thread. Fills free buffers until the input ends or the reader is stopped.
+    void readLoop();
+};
+
+class AsyncWriter
+{
+public:
+    // Starts the writer thread.
+    AsyncWriter(std::ostream& output, unsigned int buffers = IO_BUFFERS);
+
+    // Writes out everything that was submitted, see finish().
+    ~AsyncWriter();
+
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+    // A buffer to fill with the next chunk, waiting until one is free. It can be resized as needed and keeps its size
+    // for the next time it comes around.
+    std::string& acquire();
+
+    // Queues the first size bytes of the buffer from acquire() to be written.
+    void submit(size_t size);
+
+    // Waits until everything submitted is written and stops the thread. Returns false if the output failed.
+    bool finish();
+
+private:
+    std::ostream& m_output;
+
+    std::vector<std::string> m_buffers;
+    std::vector<size_t> m_sizes;
+    // Chunks submitted and chunks written. Chunk i is in buffer i % m_buffers.size().
+    uint64_t m_submitted;
+    uint64_t m_written;
+    bool m_stopping;
+
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::thread m_thread;
+
+    // Run by the writer thread. Writes submitted buffers in order until it's stopped and nothing is left.
+    void writeLoop();
+};
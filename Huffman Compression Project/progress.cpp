@@ -0,0 +1,89 @@
+#include "progress.h"
+#include <algorithm>
+#include <string>
+
+namespace
+{
+    // How often a report is written. A bar is redrawn often enough to look smooth, JSON lines are kept to a rate a log can take.
+    constexpr std::chrono::milliseconds BAR_INTERVAL(100);
+    constexpr std::chrono::milliseconds JSON_INTERVAL(1000);
+}
+
+Progress::Progress(uint64_t total, Format format, std::ostream& output)
+    : m_total(total)
+    , m_format(format)
+    , m_output(output)
+    , m_processed(0)
+    , m_start(Clock::now())
+    , m_nextReport(m_start)
+{ }
+
+void Progress::add(uint64_t bytes)
+{
+    uint64_t processed = m_processed.fetch_add(bytes) + bytes;
+    if (m_format == Format::None)
+        return;
+
+    // Another thread is already writing a report, this one isn't needed.
+    std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+    if (!lock.owns_lock())
+        return;
+
+    Clock::time_point now = Clock::now();
+    if (now < m_nextReport)
+        return;
+
+    m_nextReport = now + (m_format == Format::Bar ? BAR_INTERVAL : JSON_INTERVAL);
+    report(processed, now, false);
+}
+
+void Progress::finish()
+{
+    if (m_format == Format::None)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    report(m_processed, Clock::now(), true);
+}
+
+uint64_t Progress::processed() const
+{
+    return m_processed;
+}
+
+void Progress::report(uint64_t processed, Clock::time_point now, bool final)
+{
+    double seconds = std::chrono::duration<double>(now - m_start).count();
+    double bytesPerSec = seconds > 0 ? processed / seconds : 0;
+
+    if (m_format == Format::Json)
+    {
+        // {"processed":1048576,"total":4194304,"percent":25,"bytes_per_sec":52428800,"seconds":0.02,"done":false}
+        m_output << "{\"processed\":" << processed << ",\"total\":" << m_total;
+        if (m_total != 0)
+            m_output << ",\"percent\":" << processed * 100 / m_total;
+        m_output << ",\"bytes_per_sec\":" << static_cast<uint64_t>(bytesPerSec)
+            << ",\"seconds\":" << seconds
+            << ",\"done\":" << (final ? "true" : "false") << "}\n";
+        m_output.flush();
+        return;
+    }
+
+    // Progress bar will display like this:
+    // 	[######----]	1024/4096 KB	50.0 MB/s
+    // The bar is left out when the total isn't known.
+    const uint64_t barLen = 20;
+    if (m_total != 0)
+    {
+        uint64_t progBar = std::min(processed, m_total) * barLen / m_total;
+        m_output << "[" << std::string(progBar, '#') << std::string(barLen - progBar, '-') << "]\t"
+            << processed / 1024 << "/" << m_total / 1024 << " KB";
+    }
+    else
+    {
+        m_output << processed / 1024 << " KB";
+    }
+
+    m_output << "\t" << static_cast<uint64_t>(bytesPerSec / 100000) / 10.0 << " MB/s  " << (final ? "\n" : "\r");
+    m_output.flush();
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <iostream>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+
+/*
+Reports how far along a compression or decompression is.
+
+The coding loops only call add() once per chunk or block, and add() only writes a report when enough time has passed since
+the last one. It can be called from several threads at once, so the workers of a ThreadPool can all report into the same object.
+*/
+
+class Progress
+{
+public:
+    enum class Format
+    {
+        // Nothing is written.
+        None,
+        // A bar that is redrawn on one line, for terminals.
+        Bar,
+        // One JSON object per line, for logs and monitoring.
+        Json
+    };
+
+    // total is the number of bytes the job will process, or 0 if it isn't known up front.
+    Progress(uint64_t total, Format format, std::ostream& output);
+
+    Progress(const Progress&) = delete;
+    Progress& operator=(const Progress&) = delete;
+
+    // Counts bytes as processed and writes a report if one is due. Safe to call from any thread.
+    void add(uint64_t bytes);
+
+    // Writes the last report. A bar is ended with a new line.
+    void finish();
+
+    // getter method for the number of bytes added so far
+    uint64_t processed() const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    const uint64_t m_total;
+    const Format m_format;
+    std::ostream& m_output;
+
+    std::atomic<uint64_t> m_processed;
+
+    // Guards m_output and m_nextReport. Reports are skipped rather than waited for when another thread is writing one.
+    std::mutex m_mutex;
+    const Clock::time_point m_start;
+    Clock::time_point m_nextReport;
+
+    void report(uint64_t processed, Clock::time_point now, bool final);
+};
@@ -0,0 +1,103 @@
+#include "rle.h"
+#include <cstring>
+
+namespace
+{
+    inline uint64_t load64(const uint8_t* data)
+    {
+        uint64_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+}
+
+size_t rleBound(size_t size)
+{
+    // A count is at most 10 bytes, but one that long needs a run far longer than that.
+    return size + size / RLE_MIN_RUN + 1;
+}
+
+size_t rleEncode(const char* input, size_t size, std::string& output)
+{
+    output.resize(rleBound(size));
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(input);
+    const uint8_t* end = in + size;
+    uint8_t* out = reinterpret_cast<uint8_t*>(&output[0]);
+    uint8_t* start = out;
+
+    while (in < end)
+    {
+        // Runs are compared 8 bytes at a time, so a long run costs about a compare per 8 bytes instead of a code per byte.
+        uint8_t value = *in;
+        const uint8_t* run = in + 1;
+        uint64_t pattern = value * 0x0101010101010101ULL;
+        while (end - run >= 8 && load64(run) == pattern)
+            run += 8;
+        while (run < end && *run == value)
+            run++;
+
+        size_t length = run - in;
+        in = run;
+        if (length < RLE_MIN_RUN)
+        {
+            std::memset(out, value, length);
+            out += length;
+            continue;
+        }
+
+        std::memset(out, value, RLE_MIN_RUN);
+        out += RLE_MIN_RUN;
+        uint64_t repeats = length - RLE_MIN_RUN;
+        while (repeats >= 0x80)
+        {
+            *out++ = static_cast<uint8_t>((repeats & 0x7F) | 0x80);
+            repeats >>= 7;
+        }
+        *out++ = static_cast<uint8_t>(repeats);
+    }
+
+    output.resize(out - start);
+    return output.size();
+}
+
+size_t rleDecode(const char* input, size_t size, char* output, size_t length)
+{
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(input);
+    const uint8_t* end = in + size;
+    uint8_t* out = reinterpret_cast<uint8_t*>(output);
+    uint8_t* outEnd = out + length;
+
+    // The encoder only ever ends a run on a different byte, so counting equal bytes finds every count it wrote.
+    unsigned int run = 0;
+    uint8_t last = 0;
+    while (in < end && out < outEnd)
+    {
+        uint8_t value = *in++;
+        *out++ = value;
+        run = (run != 0 && value == last) ? run + 1 : 1;
+        last = value;
+        if (run < RLE_MIN_RUN)
+            continue;
+
+        uint64_t repeats = 0;
+        unsigned int shift = 0;
+        while (true)
+        {
+            if (in == end || shift >= 64)
+                return out - reinterpret_cast<uint8_t*>(output);
+            uint8_t byte = *in++;
+            repeats |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            shift += 7;
+            if ((byte & 0x80) == 0)
+                break;
+        }
+
+        if (repeats > static_cast<uint64_t>(outEnd - out))
+            repeats = outEnd - out;
+        std::memset(out, value, static_cast<size_t>(repeats));
+        out += repeats;
+        run = 0;
+    }
+
+    return out - reinterpret_cast<uint8_t*>(output);
+}
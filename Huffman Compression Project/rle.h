@@ -0,0 +1,28 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+Run length pass in front of the Huffman coder.
+
+Huffman codes can't be shorter than a bit, so a run of a million zero bytes still codes to about 125 KB, one code at a time.
+Runs are shortened before coding instead: after RLE_MIN_RUN bytes of the same value comes a varint (see writeVarint) with the
+number of further repeats of it. Shorter runs and everything else are copied as they are, so data without runs only grows by
+a count on the odd run of exactly RLE_MIN_RUN bytes.
+
+A run of any length becomes a handful of bytes, which the coder then codes like any other data.
+*/
+
+// Identical bytes in a row before a repeat count follows.
+constexpr size_t RLE_MIN_RUN = 4;
+
+// The most bytes rleEncode() can write for size bytes: a count after every run of RLE_MIN_RUN.
+size_t rleBound(size_t size);
+
+// Shortens the runs of size bytes of input into output, which is resized to fit. Returns the bytes written.
+size_t rleEncode(const char* input, size_t size, std::string& output);
+
+// The reverse of rleEncode(). Writes at most length bytes to output and returns the bytes written. Input that's corrupt or
+// expands past length comes out short.
+size_t rleDecode(const char* input, size_t size, char* output, size_t length);
@@ -0,0 +1,113 @@
+#include "stats.h"
+#include <iomanip>
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+namespace
+{
+    const char* const PHASE_NAMES[] = { "read", "header", "hash", "histogram", "tree", "encode", "decode", "write" };
+}
+
+Stats::Stats(bool enabled, const char* operation)
+    : m_enabled(enabled)
+    , m_operation(operation)
+    , m_phases{ }
+    , m_wallStart(Clock::now())
+    , m_cpuStart(enabled ? cpuSeconds() : 0)
+{ }
+
+bool Stats::enabled() const
+{
+    return m_enabled;
+}
+
+void Stats::add(Phase phase, double wallSeconds, double cpuSeconds, uint64_t bytesIn, uint64_t bytesOut)
+{
+    PhaseStats& stats = m_phases[static_cast<size_t>(phase)];
+    stats.wallSeconds += wallSeconds;
+    stats.cpuSeconds += cpuSeconds;
+    stats.calls++;
+    stats.bytesIn += bytesIn;
+    stats.bytesOut += bytesOut;
+}
+
+void Stats::print(std::ostream& output, bool json) const
+{
+    if (!m_enabled)
+        return;
+
+    double totalWall = std::chrono::duration<double>(Clock::now() - m_wallStart).count();
+    double totalCpu = cpuSeconds() - m_cpuStart;
+
+    if (json)
+    {
+        // One object per run so it can be appended to a log and read a line at a time.
+        output << "{\"operation\":\"" << m_operation << "\",\"wall_ms\":" << totalWall * 1000 << ",\"cpu_ms\":" << totalCpu * 1000 << ",\"phases\":{";
+        bool first = true;
+        for (size_t i = 0; i < m_phases.size(); i++)
+        {
+            const PhaseStats& stats = m_phases[i];
+            if (stats.calls == 0)
+                continue;
+
+            output << (first ? "" : ",") << "\"" << PHASE_NAMES[i] << "\":{\"wall_ms\":" << stats.wallSeconds * 1000
+                << ",\"cpu_ms\":" << stats.cpuSeconds * 1000 << ",\"calls\":" << stats.calls
+                << ",\"bytes_in\":" << stats.bytesIn << ",\"bytes_out\":" << stats.bytesOut << "}";
+            first = false;
+        }
+        output << "}}\n";
+        return;
+    }
+
+    std::ios::fmtflags flags = output.flags();
+    std::streamsize precision = output.precision();
+    output << std::left << std::setw(12) << m_operation << std::right
+        << std::setw(10) << "wall ms" << std::setw(10) << "cpu ms" << std::setw(10) << "calls"
+        << std::setw(14) << "bytes in" << std::setw(14) << "bytes out" << std::setw(10) << "MB/s" << "\n";
+
+    output << std::fixed << std::setprecision(1);
+    for (size_t i = 0; i < m_phases.size(); i++)
+    {
+        const PhaseStats& stats = m_phases[i];
+        if (stats.calls == 0)
+            continue;
+
+        // Throughput of whatever the phase handled more of.
+        uint64_t bytes = std::max(stats.bytesIn, stats.bytesOut);
+        double mbPerSec = stats.wallSeconds > 0 ? bytes / stats.wallSeconds / 1e6 : 0;
+
+        output << std::left << std::setw(12) << PHASE_NAMES[i] << std::right
+            << std::setw(10) << stats.wallSeconds * 1000 << std::setw(10) << stats.cpuSeconds * 1000 << std::setw(10) << stats.calls
+            << std::setw(14) << stats.bytesIn << std::setw(14) << stats.bytesOut << std::setw(10) << mbPerSec << "\n";
+    }
+
+    output << std::left << std::setw(12) << "total" << std::right
+        << std::setw(10) << totalWall * 1000 << std::setw(10) << totalCpu * 1000 << "\n";
+    output.flags(flags);
+    output.precision(precision);
+}
+
+double Stats::cpuSeconds()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        return 0;
+
+    // FILETIMEs count 100 nanosecond intervals.
+    auto toSeconds = [](const FILETIME& time) { return ((static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1e7; };
+    return toSeconds(kernel) + toSeconds(user);
+#else
+    timespec time;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time) != 0)
+        return 0;
+    return time.tv_sec + time.tv_nsec / 1e9;
+#endif
+}
@@ -0,0 +1,109 @@
+#pragma once
+#include <iostream>
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+/*
+Per-phase timing and counters for compress() and decompress(), printed with --stats.
+
+Each phase adds up the wall time, the CPU time of the whole process (so time spent by worker threads shows up as CPU time
+above the wall time), the number of times it ran and the bytes it took in and gave out. A disabled Stats doesn't read any
+clocks, the Timers only check one flag.
+
+Stats isn't thread-safe. Only the thread that owns it should time phases, worker threads are covered by the CPU time.
+*/
+
+class Stats
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    enum class Phase
+    {
+        // Reading the input, or mapping it.
+        Read,
+        // Writing and reading the header and trailer.
+        Header,
+        Hash,
+        Histogram,
+        Tree,
+        // For blocked files this is the time spent waiting on the workers.
+        Encode,
+        Decode,
+        Write,
+        Count
+    };
+
+    struct PhaseStats
+    {
+        double wallSeconds;
+        double cpuSeconds;
+        uint64_t calls;
+        uint64_t bytesIn;
+        uint64_t bytesOut;
+    };
+
+    // Times one run of a phase from construction to destruction.
+    class Timer
+    {
+    public:
+        Timer(Stats& stats, Phase phase)
+            : m_stats(stats.m_enabled ? &stats : nullptr)
+            , m_phase(phase)
+            , m_bytesIn(0)
+            , m_bytesOut(0)
+        {
+            if (m_stats != nullptr)
+            {
+                m_wallStart = Clock::now();
+                m_cpuStart = cpuSeconds();
+            }
+        }
+
+        ~Timer()
+        {
+            if (m_stats != nullptr)
+                m_stats->add(m_phase, std::chrono::duration<double>(Clock::now() - m_wallStart).count(), cpuSeconds() - m_cpuStart, m_bytesIn, m_bytesOut);
+        }
+
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        // Bytes the phase took in and gave out, counted when the Timer ends.
+        void bytes(uint64_t in, uint64_t out)
+        {
+            m_bytesIn += in;
+            m_bytesOut += out;
+        }
+
+    private:
+        Stats* m_stats;
+        Phase m_phase;
+        Clock::time_point m_wallStart;
+        double m_cpuStart;
+        uint64_t m_bytesIn;
+        uint64_t m_bytesOut;
+    };
+
+    // operation is what's being timed, e.g. "compress". It's printed with the results.
+    Stats(bool enabled, const char* operation);
+
+    bool enabled() const;
+
+    // Prints every phase that ran, followed by the totals since the Stats was created.
+    void print(std::ostream& output, bool json) const;
+
+    // CPU time used by every thread of this process so far.
+    static double cpuSeconds();
+
+private:
+    const bool m_enabled;
+    const char* m_operation;
+    std::array<PhaseStats, static_cast<size_t>(Phase::Count)> m_phases;
+
+    Clock::time_point m_wallStart;
+    double m_cpuStart;
+
+    void add(Phase phase, double wallSeconds, double cpuSeconds, uint64_t bytesIn, uint64_t bytesOut);
+};
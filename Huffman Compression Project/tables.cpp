@@ -0,0 +1,193 @@
+#include "tables.h"
+
+namespace
+{
+    // Code lengths of the built in tables, in order of byte value. They were built with --build-table, text from English prose
+    // and documentation, json from a mix of API responses, configuration and log records.
+    const uint8_t TEXT_LENGTHS[256] = {
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15,  6, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+         3, 15,  9, 15, 15, 15, 15, 12,  9,  9, 15, 15,  7,  9,  7, 10,
+        11, 10, 11, 15, 15, 15, 15, 15, 15, 15, 10, 15, 10, 15, 10, 15,
+        15,  9, 10,  9,  9,  9, 10, 10, 10,  8, 15, 15,  8, 10,  9,  9,
+         9, 15,  9,  9,  8, 10, 12, 10, 15, 10, 15, 15, 15, 15, 15, 15,
+         8,  4,  7,  5,  5,  3,  6,  6,  5,  4, 11,  8,  5,  6,  4,  4,
+         6,  9,  4,  5,  4,  6,  7,  7,  9,  6, 10, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15
+    };
+
+    const uint8_t JSON_LENGTHS[256] = {
+        15, 15, 15, 15, 15, 15, 15, 15, 15,  7,  6, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+         1, 15,  4, 15, 11, 15, 15, 15, 15, 15, 15, 15,  6,  9,  8, 15,
+         9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  6, 15, 15, 15, 15, 15,
+        15, 11, 15, 11, 11, 12, 15, 15, 15, 10, 15, 10, 15, 15, 13, 11,
+        14, 15, 10,  9, 10, 10, 15, 15, 15, 15, 15, 10, 11, 10, 15,  8,
+        11,  6,  8,  6,  6,  4,  8,  7,  8,  5, 14,  9,  7,  7,  6,  6,
+         6,  9,  6,  5,  5,  7,  8,  9, 10,  7, 15,  8, 15,  8, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15
+    };
+
+    CodeTable makeTable(uint32_t id, const char* name, const uint8_t* lengths)
+    {
+        CodeTable table;
+        table.id = id;
+        table.name = name;
+        std::copy(lengths, lengths + table.codeLengths.size(), table.codeLengths.begin());
+        table.maxCodeLength = *std::max_element(table.codeLengths.begin(), table.codeLengths.end());
+        return table;
+    }
+
+    // IDs of built in tables are part of the file format, a table can't be given a different one later.
+    const std::vector<CodeTable>& builtinTables()
+    {
+        static const std::vector<CodeTable> tables = {
+            makeTable(1, "text", TEXT_LENGTHS),
+            makeTable(2, "json", JSON_LENGTHS)
+        };
+        return tables;
+    }
+}
+
+const CodeTable* findTable(const std::string& name)
+{
+    for (const CodeTable& table : builtinTables())
+    {
+        if (table.name == name)
+            return &table;
+    }
+    return nullptr;
+}
+
+const CodeTable* findTable(uint32_t id)
+{
+    for (const CodeTable& table : builtinTables())
+    {
+        if (table.id == id)
+            return &table;
+    }
+    return nullptr;
+}
+
+std::vector<std::string> tableNames()
+{
+    std::vector<std::string> names;
+    for (const CodeTable& table : builtinTables())
+        names.push_back(table.name);
+    return names;
+}
+
+bool buildTable(const std::vector<std::string>& samples, const std::string& name, CodeTable& table)
+{
+    // Every byte value is counted once up front, so bytes the samples never had can still be compressed.
+    huffman::Histogram histogram;
+    std::string buffer(MAX_BUFFER, '\0');
+    for (unsigned int i = 0; i < 256; i++)
+        buffer[i] = static_cast<char>(i);
+    histogram.add(buffer.data(), 256);
+
+    for (const std::string& sample : samples)
+    {
+        std::ifstream input(sample, std::ios::binary);
+        if (!input.good())
+        {
+            std::cerr << "ERROR: Sample \"" << sample << "\" was not able to be opened.\n";
+            return false;
+        }
+
+        while (input.read(&buffer[0], buffer.size()) || input.gcount() > 0)
+            histogram.add(buffer.data(), static_cast<size_t>(input.gcount()));
+    }
+
+    huffman::Encoder encoder;
+    encoder.buildFreqTable(histogram);
+    encoder.buildEncodingTree(huffman::MAX_CODE_LENGTH);
+
+    table.name = name;
+    table.codeLengths = encoder.codeLengths();
+    table.maxCodeLength = encoder.maxCodeLength();
+    table.id = tableFileId(table.codeLengths);
+    return true;
+}
+
+uint32_t tableFileId(const lengthTable& codeLengths)
+{
+    return crc32c(0, codeLengths.data(), codeLengths.size()) | TABLE_FILE_ID_BIT;
+}
+
+bool writeTableFile(const std::string& filename, const CodeTable& table)
+{
+    std::ofstream output(filename, std::ios::binary);
+    if (!output.good())
+    {
+        std::cerr << "ERROR: Table file \"" << filename << "\" failed to create.\n";
+        return false;
+    }
+
+    output.write(tableSig.data(), tableSig.size());
+    output.put(curFileVersion.major);
+    output.put(curFileVersion.minor);
+    writeInt(output, table.id);
+
+    uint8_t nameLen = static_cast<uint8_t>(std::min<size_t>(table.name.size(), UINT8_MAX));
+    output.put(nameLen);
+    output.write(table.name.data(), nameLen);
+
+    output.put(table.maxCodeLength);
+    std::string lengths = packCodeLengths(table.codeLengths, table.maxCodeLength);
+    output.write(lengths.data(), lengths.size());
+    return output.good();
+}
+
+bool readTableFile(const std::string& filename, CodeTable& table, std::ostream& errors)
+{
+    std::ifstream input(filename, std::ios::binary);
+    std::string signature(tableSig.size(), '\0');
+    input.read(&signature[0], signature.size());
+    if (!input.good() || signature != tableSig)
+    {
+        errors << "ERROR: \"" << filename << "\" is not a table file.\n";
+        return false;
+    }
+
+    FileVersion version;
+    version.major = input.get();
+    version.minor = input.get();
+    if (!supportedVersion(version))
+    {
+        errors << "ERROR: Invalid table file version.\n";
+        return false;
+    }
+
+    table.id = readInt(input);
+    table.name.resize(static_cast<uint8_t>(input.get()));
+    input.read(&table.name[0], table.name.size());
+    table.maxCodeLength = static_cast<uint8_t>(input.get());
+    table.codeLengths.fill(0);
+    readCodeLengths(input, table.codeLengths);
+
+    // The ID is checked against the lengths, a file that was changed would decode to garbage instead.
+    if (!input.good() || table.id != tableFileId(table.codeLengths)
+        || table.maxCodeLength == 0 || table.maxCodeLength > huffman::MAX_WRITER_CODE_LENGTH
+        || *std::max_element(table.codeLengths.begin(), table.codeLengths.end()) > table.maxCodeLength
+        || !huffman::validCodeLengths(table.codeLengths))
+    {
+        errors << "ERROR: Table file \"" << filename << "\" is corrupt.\n";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include "main.h"
+
+/*
+Prebuilt code tables.
+
+A small file spends much of its compressed size on its code lengths, and building them takes a whole pass over the file
+before encoding can start. A prebuilt table is made once from sample data of the same kind. Files compressed with it only
+store the table's ID, and the encoder goes straight to encoding the file in a single pass.
+
+A few tables are built into the program. Others can be built from any samples with --build-table and kept in a table file.
+Files compressed with a table file need the same table file to be decompressed. Its ID is taken from its code lengths so
+the wrong table is caught before anything is decoded.
+*/
+
+// Written at the start of every table file.
+const std::string tableSig = "ANHT";
+
+// IDs of table files always have this bit set, so they never collide with a built in table.
+constexpr uint32_t TABLE_FILE_ID_BIT = 0x80000000;
+
+struct CodeTable
+{
+    // 0 is never a valid ID.
+    uint32_t id;
+    std::string name;
+    unsigned int maxCodeLength;
+
+    // Every byte value has a code, so anything can be compressed with any table.
+    lengthTable codeLengths;
+
+    CodeTable()
+        : id(0)
+        , name("")
+        , maxCodeLength(0)
+        , codeLengths{ }
+    { }
+};
+
+// The built in table with this name or ID. nullptr if there is none.
+const CodeTable* findTable(const std::string& name);
+const CodeTable* findTable(uint32_t id);
+
+// The names of the built in tables.
+std::vector<std::string> tableNames();
+
+// Builds a table from the byte counts of every sample file. Byte values the samples don't have still get a code.
+// Prints an error and returns false if a sample can't be read.
+bool buildTable(const std::vector<std::string>& samples, const std::string& name, CodeTable& table);
+
+// The ID a table file with these code lengths gets.
+uint32_t tableFileId(const lengthTable& codeLengths);
+
+// Table file format, all integers big endian:
+// 4 tableSig, 2 version, 4 ID, 1 name length (n), n name, 1 maximum code length, then the code lengths (see packCodeLengths).
+bool writeTableFile(const std::string& filename, const CodeTable& table);
+
+// Prints an error to errors and returns false if the file isn't a table file or its ID doesn't match its code lengths.
+bool readTableFile(const std::string& filename, CodeTable& table, std::ostream& errors);
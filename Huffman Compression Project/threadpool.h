@@ -0,0 +1,65 @@
+#pragma once
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+
+/*
+A fixed set of worker threads that run tasks in the order they were submitted.
+
+Results come back through std::future, so the caller decides what order to collect them in.
+This is what lets blocks be encoded out of order but still be written to the file in order.
+*/
+
+class ThreadPool
+{
+public:
+    // Starts the worker threads. At least one thread is always started.
+    ThreadPool(unsigned int threads);
+
+    // Finishes every task that was already submitted, then joins the worker threads.
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Queues a task and returns the future its result will be delivered through.
+    template <typename Task>
+    std::future<typename std::result_of<Task()>::type> submit(Task task);
+
+    // getter method for the number of worker threads
+    unsigned int size();
+
+private:
+    std::vector<std::thread> m_workers;
+    std::queue<std::function<void()>> m_tasks;
+
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_stopping;
+
+    // Run by each worker thread. Takes tasks off the queue until the pool is stopping and the queue is empty.
+    void workerLoop();
+};
+
+template <typename Task>
+std::future<typename std::result_of<Task()>::type> ThreadPool::submit(Task task)
+{
+    typedef typename std::result_of<Task()>::type Result;
+
+    // packaged_task can't be copied, but std::function needs a copyable callable, so it's shared instead.
+    auto packaged = std::make_shared<std::packaged_task<Result()>>(std::move(task));
+    std::future<Result> result = packaged->get_future();
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push([packaged]() { (*packaged)(); });
+    }
+    m_condition.notify_one();
+
+    return result;
+}